@@ -7,16 +7,51 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <stdexcept>
 #include <algorithm>
 #include <string>
 #include <vector>
 #include <stack>
+#include <deque>
 #include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+#include "haxpp.h"
 
 using namespace std;
 
+/* everything but the haxpp class is in here, so a program linking libhaxpp.a does not
+ * clash with the names of the internals, and a shared library would not export them */
+namespace haxpp_impl __attribute__((visibility("hidden"))) {
+
+using std::to_string; /* not hidden by the to_string() overloads below */
+
 template <typename T> struct bitmask_t {
     T                           start_bit;
     T                           num_bits;
@@ -317,78 +352,170 @@ public:
     static unsigned int precedence(const token &t,const bool rtl);
 };
 
-unsigned int token::precedence(const token &t,const bool rtl) {
-    switch (t.tval) {
-        case token::DEFINED:
-        case token::SIZEOF:
-        case token::ALIGNOF:
-            return 1;
-        case token::INCREMENT:
-            return rtl ? 2 : 1;
-        case token::DECREMENT:
-            return rtl ? 2 : 1;
-        case token::OPEN_PARENS:
-        case token::CLOSE_PARENS:
-        case token::OPEN_SBRACKET:
-        case token::CLOSE_SBRACKET:
-        case token::PERIOD:
-        case token::PTRARROW:
-            return 1u;
-        case token::PLUS:
-            return rtl ? 2 : 4;
-        case token::MINUS:
-            return rtl ? 2 : 4;
-        case token::STAR:
-            return rtl ? 2 : 3;
-        case token::AMPERSAND:
-            return rtl ? 2 : 8;
-        case token::NOT:
-        case token::COMPLEMENT:
-            return 2;
-        case token::DIVISION:
-        case token::MODULUS:
-            return 3;
-        case token::LEFT_SHIFT:
-        case token::RIGHT_SHIFT:
-            return 5;
-        case token::LESS_THAN:
-        case token::LESS_THAN_OR_EQUAL:
-        case token::GREATER_THAN:
-        case token::GREATER_THAN_OR_EQUAL:
-            return 6;
-        case token::EQUALS:
-        case token::NOT_EQUALS:
-            return 7;
-        case token::CARET:
-            return 9;
-        case token::PIPE:
-            return 10;
-        case token::LOGICAL_AND:
-            return 11;
-        case token::LOGICAL_OR:
-            return 12;
-        case token::QUESTIONMARK:
-        case token::COLON:
-            return 13;
-        case token::ASSIGNMENT:
-        case token::PLUS_EQUALS:
-        case token::MINUS_EQUALS:
-        case token::MULTIPLY_EQUALS:
-        case token::DIVIDE_EQUALS:
-        case token::MODULUS_EQUALS:
-        case token::LEFT_SHIFT_EQUALS:
-        case token::RIGHT_SHIFT_EQUALS:
-        case token::AND_EQUALS:
-        case token::XOR_EQUALS:
-        case token::OR_EQUALS:
-            return 14;
-        case token::COMMA:
-            return 15;
-        default:
-            break;
-    };
+enum class token_op_form_t {
+    NONE,               /* not an infix or postfix operator */
+    POSTFIX,
+    LTR,                /* binary, left to right */
+    RTL,                /* binary, right to left */
+    TERNARY
+};
 
-    return 0;
+/* operator properties of each token, indexed by token_t.
+ * precedence: lower binds tighter, 0 means not an operator */
+struct token_op_t {
+    token::token_t              tok;            /* must match the index, see static_assert below */
+    unsigned char               prefix_prec;    /* token::precedence(t,true) */
+    unsigned char               infix_prec;     /* token::precedence(t,false) */
+    token::token_t              prefix_node;    /* node type as prefix operator, or NONE */
+    token::token_t              infix_node;     /* node type as infix/postfix operator */
+    token_op_form_t             infix_form;
+};
+
+static constexpr token_op_t     token_op_table[] = {
+    {token::NONE,                 0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::MACRO,                0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::PREPROC,              0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::MACROSUBST,           0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::MACROPARAM,           0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::IDENTIFIER,           0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::FUNCTIONCALL,         0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::TYPECAST,             0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::TYPESPEC,             0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::INTEGER,              0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::FLOAT,                0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::STRING,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::MINUS,                2,  4,  token::NEGATE,          token::MINUS,           token_op_form_t::LTR},
+    {token::PLUS,                 2,  4,  token::PLUS,            token::PLUS,            token_op_form_t::LTR},
+    {token::DECREMENT,            2,  1,  token::PREDECREMENT,    token::POSTDECREMENT,   token_op_form_t::POSTFIX},
+    {token::INCREMENT,            2,  1,  token::PREINCREMENT,    token::POSTINCREMENT,   token_op_form_t::POSTFIX},
+    {token::PREDECREMENT,         0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::PREINCREMENT,         0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::POSTDECREMENT,        0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::POSTINCREMENT,        0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::NEGATE,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::DEREFERENCE,          0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::ADDRESSOF,            0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::COMMA,               15, 15,  token::NONE,            token::COMMA,           token_op_form_t::LTR},
+    {token::PERIOD,               1,  1,  token::NONE,            token::STRUCTREF,       token_op_form_t::LTR},
+    {token::DOTDOTDOT,            0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::PTRARROW,             1,  1,  token::NONE,            token::PTRARROW,        token_op_form_t::LTR},
+    {token::STRUCTREF,            0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::COMPLEMENT,           2,  2,  token::COMPLEMENT,      token::NONE,            token_op_form_t::NONE},
+    {token::NOT,                  2,  2,  token::NOT,             token::NONE,            token_op_form_t::NONE},
+    {token::AMPERSAND,            2,  8,  token::ADDRESSOF,       token::BINARY_AND,      token_op_form_t::LTR},
+    {token::STAR,                 2,  3,  token::DEREFERENCE,     token::MULTIPLY,        token_op_form_t::LTR},
+    {token::OPEN_PARENS,          1,  1,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::CLOSE_PARENS,         1,  1,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::OPEN_SBRACKET,        1,  1,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::CLOSE_SBRACKET,       1,  1,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::OPEN_CBRACKET,        0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::CLOSE_CBRACKET,       0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::SIZEOF,               1,  1,  token::SIZEOF,          token::NONE,            token_op_form_t::NONE},
+    {token::ALIGNAS,              0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::ALIGNOF,              1,  1,  token::ALIGNOF,         token::NONE,            token_op_form_t::NONE},
+    {token::ATOMIC,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::BOOL_KW,              0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::COMPLEX,              0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::GENERIC,              0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::IMAGINARY,            0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::NORETURN,             0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::STATIC_ASSERT,        0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::THREAD_LOCAL,         0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::PRAGMA,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::DIVISION,             3,  3,  token::NONE,            token::DIVISION,        token_op_form_t::LTR},
+    {token::MODULUS,              3,  3,  token::NONE,            token::MODULUS,         token_op_form_t::LTR},
+    {token::LESS_THAN,            6,  6,  token::NONE,            token::LESS_THAN,       token_op_form_t::LTR},
+    {token::GREATER_THAN,         6,  6,  token::NONE,            token::GREATER_THAN,    token_op_form_t::LTR},
+    {token::LESS_THAN_OR_EQUAL,   6,  6,  token::NONE,            token::LESS_THAN_OR_EQUAL,token_op_form_t::LTR},
+    {token::GREATER_THAN_OR_EQUAL, 6,  6,  token::NONE,            token::GREATER_THAN_OR_EQUAL,token_op_form_t::LTR},
+    {token::LEFT_SHIFT,           5,  5,  token::NONE,            token::LEFT_SHIFT,      token_op_form_t::LTR},
+    {token::RIGHT_SHIFT,          5,  5,  token::NONE,            token::RIGHT_SHIFT,     token_op_form_t::LTR},
+    {token::EQUALS,               7,  7,  token::NONE,            token::EQUALS,          token_op_form_t::LTR},
+    {token::NOT_EQUALS,           7,  7,  token::NONE,            token::NOT_EQUALS,      token_op_form_t::LTR},
+    {token::ASSIGNMENT,          14, 14,  token::NONE,            token::ASSIGNMENT,      token_op_form_t::RTL},
+    {token::CARET,                9,  9,  token::NONE,            token::BINARY_XOR,      token_op_form_t::LTR},
+    {token::PIPE,                10, 10,  token::NONE,            token::BINARY_OR,       token_op_form_t::LTR},
+    {token::BINARY_AND,           0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::BINARY_XOR,           0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::BINARY_OR,            0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::MULTIPLY,             0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::LOGICAL_AND,         11, 11,  token::NONE,            token::LOGICAL_AND,     token_op_form_t::LTR},
+    {token::LOGICAL_OR,          12, 12,  token::NONE,            token::LOGICAL_OR,      token_op_form_t::LTR},
+    {token::QUESTIONMARK,        13, 13,  token::NONE,            token::TERNARY,         token_op_form_t::TERNARY},
+    {token::COLON,               13, 13,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::PLUS_EQUALS,         14, 14,  token::NONE,            token::PLUS_EQUALS,     token_op_form_t::RTL},
+    {token::MINUS_EQUALS,        14, 14,  token::NONE,            token::MINUS_EQUALS,    token_op_form_t::RTL},
+    {token::MULTIPLY_EQUALS,     14, 14,  token::NONE,            token::MULTIPLY_EQUALS, token_op_form_t::RTL},
+    {token::DIVIDE_EQUALS,       14, 14,  token::NONE,            token::DIVIDE_EQUALS,   token_op_form_t::RTL},
+    {token::MODULUS_EQUALS,      14, 14,  token::NONE,            token::MODULUS_EQUALS,  token_op_form_t::RTL},
+    {token::LEFT_SHIFT_EQUALS,   14, 14,  token::NONE,            token::LEFT_SHIFT_EQUALS,token_op_form_t::RTL},
+    {token::RIGHT_SHIFT_EQUALS,  14, 14,  token::NONE,            token::RIGHT_SHIFT_EQUALS,token_op_form_t::RTL},
+    {token::AND_EQUALS,          14, 14,  token::NONE,            token::AND_EQUALS,      token_op_form_t::RTL},
+    {token::XOR_EQUALS,          14, 14,  token::NONE,            token::XOR_EQUALS,      token_op_form_t::RTL},
+    {token::OR_EQUALS,           14, 14,  token::NONE,            token::OR_EQUALS,       token_op_form_t::RTL},
+    {token::AUTO,                 0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::BREAK,                0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::CASE,                 0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::CHAR,                 0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::CONST,                0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::CONTINUE,             0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::DEFAULT,              0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::DO,                   0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::DOUBLE,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::ELSE,                 0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::ENUM,                 0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::EXTERN,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::FLOAT_KW,             0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::FOR,                  0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::GOTO,                 0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::IF,                   0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::ELIF,                 0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::ENDIF,                0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::DEFINED,              1,  1,  token::DEFINED,         token::NONE,            token_op_form_t::NONE},
+    {token::IFDEF,                0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::IFNDEF,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::DEFINE,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::UNDEF,                0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::INCLUDE,              0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::LINE,                 0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::ERROR,                0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::INT,                  0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::LONG,                 0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::REGISTER,             0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::RETURN,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::SHORT,                0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::SIGNED,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::STATIC,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::STRUCT,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::SWITCH,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::TYPEDEF,              0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::UNION,                0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::UNSIGNED,             0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::VOID,                 0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::VOLATILE,             0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::WHILE,                0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::STRINGIFY,            0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::TOKEN_PASTE,          0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::VA_ARGS,              0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::VA_OPT,               0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE},
+    {token::TERNARY,              0,  0,  token::NONE,            token::NONE,            token_op_form_t::NONE}
+};
+
+static_assert(sizeof(token_op_table)/sizeof(token_op_table[0]) == size_t(token::MAX_TOKEN), "token_op_table does not cover every token");
+
+static constexpr bool token_op_table_ordered(const size_t i) {
+    return i >= size_t(token::MAX_TOKEN) || (token_op_table[i].tok == token::token_t(i) && token_op_table_ordered(i+size_t(1)));
+}
+
+static_assert(token_op_table_ordered(0), "token_op_table is not in token_t order");
+
+static inline const token_op_t &token_op(const token::token_t t) {
+    return token_op_table[(size_t(t) < size_t(token::MAX_TOKEN)) ? size_t(t) : size_t(0)];
+}
+
+unsigned int token::precedence(const token &t,const bool rtl) {
+    const token_op_t &o = token_op(t.tval);
+    return rtl ? o.prefix_prec : o.infix_prec;
 }
 
 bool token::int_t::operator!=(const int_t &i) const {
@@ -468,6 +595,174 @@ token::token(const token_t t) : tval(t) {
 
 typedef vector<token>           token_string;
 
+class pp_directive_index;
+class pp_context;
+
+/* state of one translation unit lives in a pp_context, so that several can run at
+ * once. caches that only depend on the file system are shared by all contexts and
+ * guarded by pp_shared_lock */
+static mutex                    pp_shared_lock;
+static atomic<uint64_t>         pp_cache_generation(0); /* bumped when --daemon drops cache entries */
+
+/* standard streams and working directory of the command being run. --daemon runs each
+ * client's command on a thread of its own, with the client's */
+static thread_local FILE*       pp_stdin_fp = NULL;
+static thread_local FILE*       pp_stdout_fp = NULL;
+static thread_local FILE*       pp_stderr_fp = NULL;
+static thread_local string      pp_cwd;                 /* --daemon only */
+
+static inline FILE *pp_stdin() {
+    return (pp_stdin_fp != NULL) ? pp_stdin_fp : stdin;
+}
+
+static inline FILE *pp_stdout() {
+    return (pp_stdout_fp != NULL) ? pp_stdout_fp : stdout;
+}
+
+static inline FILE *pp_stderr() {
+    return (pp_stderr_fp != NULL) ? pp_stderr_fp : stderr;
+}
+
+/* path as a key of the shared caches, which see several working directories with --daemon */
+static string pp_path_key(const string &path) {
+    if (pp_cwd.empty() || path.empty() || path[0] == '/')
+        return path;
+
+    return pp_cwd + "/" + path;
+}
+
+static string pp_path_dir(const string &path) {
+    const size_t p = path.find_last_of('/');
+    return (p != string::npos) ? path.substr(0,p+size_t(1)) : string("./");
+}
+
+/* --daemon: an inotify instance watching the directory of everything cached, or -1.
+ * one directory can be watched under several names (a/, a/./, b/../a/) */
+static int                      pp_watch_fd = -1;
+static map< int,set<string> >   pp_watch_dirs;          /* watch descriptor -> directory names, with a trailing / */
+static set<string>              pp_watched;
+
+/* true if changes in dir are seen, so what was read from it may be cached. caller holds pp_shared_lock */
+static bool pp_watch_dir(const string &dir) {
+    if (pp_watch_fd < 0 || pp_watched.find(dir) != pp_watched.end())
+        return true;
+
+    const int wd = inotify_add_watch(pp_watch_fd,dir.c_str(),IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|
+        IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF|IN_ONLYDIR);
+    if (wd < 0)
+        return false;
+
+    pp_watch_dirs[wd].insert(dir);
+    pp_watched.insert(dir);
+    return true;
+}
+
+/* --prefetch: when a file is opened, the #include lines in it are resolved ahead of the
+ * reader and the files they name are read in the background, through io_uring where
+ * the kernel has it, by a few threads otherwise. the reader takes the contents when it
+ * gets to the #include. it is only a guess: lines in inactive blocks are read too, and
+ * what it reads is used only if the file has not changed since */
+class pp_prefetch_entry {
+public:
+    shared_ptr<const string>    content;            /* NULL if it could not be read */
+    struct stat                 st;                 /* of the file, as it was read */
+    bool                        started = false;    /* a worker took it off pp_prefetch_queue */
+    bool                        done = false;
+};
+
+static constexpr size_t         pp_prefetch_max_files = 512;
+static atomic<bool>             pp_prefetch_enabled(false);
+static mutex                    pp_prefetch_lock;
+static condition_variable       pp_prefetch_work;           /* pp_prefetch_queue has paths, or stopping */
+static condition_variable       pp_prefetch_done;           /* an entry is done */
+static map<string, shared_ptr<pp_prefetch_entry> > pp_prefetch_files; /* pp_path_key() -> entry */
+static deque<string>            pp_prefetch_queue;
+
+/* open, fstat and read path. caller fills in e under pp_prefetch_lock */
+static shared_ptr<const string> pp_prefetch_read(const string &path,struct stat &st) {
+    const int fd = open(path.c_str(),O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return shared_ptr<const string>();
+
+    auto b = make_shared<string>();
+    char buf[16384];
+    ssize_t rd;
+
+    if (fstat(fd,&st) == 0 && S_ISREG(st.st_mode))
+        b->reserve(size_t(st.st_size));
+    while ((rd=read(fd,buf,sizeof(buf))) > 0)
+        b->append(buf,size_t(rd));
+
+    close(fd);
+    if (rd < 0)
+        return shared_ptr<const string>();
+
+    return b;
+}
+
+/* contents of path: prefetched if it was, waiting for the read if it is under way,
+ * or else read now. NULL if it cannot be read */
+static shared_ptr<const string> pp_prefetch_get(const string &path) {
+    const string key = pp_path_key(path);
+    shared_ptr<pp_prefetch_entry> e;
+    struct stat st;
+
+    {
+        unique_lock<mutex> lock(pp_prefetch_lock);
+        const auto fi = pp_prefetch_files.find(key);
+        if (fi != pp_prefetch_files.end()) {
+            e = fi->second;
+            pp_prefetch_files.erase(fi);
+
+            if (e->started)
+                pp_prefetch_done.wait(lock,[&e]() { return e->done; });
+            else
+                e.reset(); /* still queued, the worker will skip it */
+        }
+    }
+
+    if (e && e->content && stat(path.c_str(),&st) == 0 && st.st_size == e->st.st_size &&
+        st.st_mtim.tv_sec == e->st.st_mtim.tv_sec && st.st_mtim.tv_nsec == e->st.st_mtim.tv_nsec)
+        return e->content;
+
+    return pp_prefetch_read(path,st);
+}
+
+/* --batch: contents of every file opened, read once and shared by all units */
+static atomic<bool>             pp_file_cache_enabled(false);
+static map<string, shared_ptr<const string> > pp_file_cache;
+
+static shared_ptr<const string> pp_file_cache_get(const string &path) {
+    const string key = pp_path_key(path);
+    uint64_t generation;
+    bool cacheable;
+
+    {
+        lock_guard<mutex> lock(pp_shared_lock);
+        auto fi = pp_file_cache.find(key);
+        if (fi != pp_file_cache.end())
+            return fi->second;
+
+        cacheable = pp_watch_dir(pp_path_dir(key));
+        generation = pp_cache_generation;
+    }
+
+    const shared_ptr<const string> data = pp_prefetch_get(path);
+    if (!data)
+        return data;
+
+    lock_guard<mutex> lock(pp_shared_lock);
+    if (!cacheable || generation != pp_cache_generation) /* changed while it was read */
+        return data;
+
+    return pp_file_cache.insert(make_pair(key,data)).first->second;
+}
+
+/* --shared-cache */
+class pp_shm_map;
+static atomic<pp_shm_map*>      pp_shm(NULL);           /* mappings are never unmapped, FileSources point into them */
+static bool pp_shm_get(const string &path,const char* &data,size_t &size,shared_ptr<const string> &content);
+
 class FileSource {
 public:
                                 FileSource() : fp(NULL), ownership(false) { }
@@ -475,13 +770,20 @@ public:
 public:
     void                        set(FILE *_fp);
     void                        set(const string &_path);
+    void                        set(const string &_path,const shared_ptr<const string> &_content);
     void                        close();
     void                        open();
     bool                        is_open() const;
     bool                        eof() const;
     const string&               get_path() const;
+    bool                        is_memory() const { return mem != NULL; }
+    const char*                 memory() const { return mem; }
+    size_t                      memory_size() const { return mem_size; }
     int                         getc();
+    void                        ungetc(const int c);
     void                        reset_counters();
+    long                        tell() const;
+    void                        seek(const long offset,const int32_t _line);
 public:
     inline int32_t current_line() const {
         return line;
@@ -489,12 +791,26 @@ public:
     inline int current_column() const {
         return column;
     }
+public:
+    size_t                      token_count = 0; /* tokens produced from this file, for the per-file budget */
+    pp_directive_index*         dir_index = NULL; /* directive index for this file, if any */
+    bool                        dir_index_build = false; /* dir_index is being built by this read */
+    size_t                      cond_depth = 0; /* ctx.cond_stack depth when the file was entered */
+    string*                     capture = NULL; /* if set, every char read is appended here */
+    uint64_t                    configs = 0; /* --config: bitmask of the configurations reading this file */
+    bool                        hdr_record = false; /* --header-cache: this inclusion is recorded, see pp_context::hdr_recs */
 private:
     FILE*                       fp;
     bool                        ownership;
     string                      path;
     int32_t                     line;
     int                         column;
+    int                         pushback = EOF; /* one char of lookahead returned by ungetc() */
+    shared_ptr<const string>    content; /* contents read from memory instead of fp (--batch file cache, library input) */
+    const char*                 mem = NULL; /* content, or --shared-cache memory, once open */
+    size_t                      mem_size = 0;
+    size_t                      mem_pos = 0;
+    bool                        mem_eof = false; /* a read hit the end, like feof() */
 };
 
 class FileDest {
@@ -504,6 +820,7 @@ public:
 public:
     void                        set(FILE *_fp);
     void                        set(const string &_path);
+    void                        set(const function<void(const char*,size_t)> &_sink);
     void                        close();
     void                        open();
     bool                        is_open() const;
@@ -511,15 +828,59 @@ public:
     void                        putc(char c);
     void                        puts(const char *s);
     void                        puts(const string &s);
+public:
+    string*                     capture = NULL; /* if set, everything written is appended here too */
 private:
     FILE*                       fp;
     bool                        ownership;
     string                      path;
+    function<void(const char*,size_t)> sink; /* library: output goes here instead of fp */
 };
 
 void FileSource::reset_counters() {
     line = 1;
     column = 0;
+    token_count = 0;
+    pushback = EOF;
+    dir_index = NULL;
+    dir_index_build = false;
+    cond_depth = 0;
+    configs = 0;
+    hdr_record = false;
+}
+
+/* byte offset of the next char getc() will return, or -1 if not known */
+long FileSource::tell() const {
+    long r;
+
+    if (mem != NULL)
+        r = long(mem_pos);
+    else if (fp != NULL)
+        r = ftell(fp);
+    else
+        return -1;
+
+    if (r > 0l && pushback != EOF)
+        r--;
+
+    return r;
+}
+
+/* reposition to the start of a line previously found with tell() */
+void FileSource::seek(const long offset,const int32_t _line) {
+    if (mem != NULL) {
+        if (offset < 0l || size_t(offset) > mem_size)
+            throw runtime_error("File I/O error, seeking");
+        mem_pos = size_t(offset);
+        mem_eof = false;
+    }
+    else if (fp == NULL || fseek(fp,offset,SEEK_SET) != 0) {
+        throw runtime_error("File I/O error, seeking");
+    }
+
+    pushback = EOF;
+    line = _line;
+    column = 0;
 }
 
 void FileSource::set(FILE *_fp) {
@@ -535,16 +896,52 @@ void FileSource::set(const string &_path) {
     reset_counters();
 }
 
+/* read _content instead of the file, _path is only the name reported */
+void FileSource::set(const string &_path,const shared_ptr<const string> &_content) {
+    set(_path);
+    content = _content;
+}
+
 void FileSource::close() {
     if (fp != NULL) {
         if (ownership) fclose(fp);
         fp = NULL;
     }
     ownership = false;
+    content.reset();
+    mem = NULL;
+    mem_size = 0;
+    mem_pos = 0;
+    mem_eof = false;
 }
 
 void FileSource::open() {
-    if (fp == NULL) {
+    if (fp == NULL && mem == NULL) {
+        if (!content && pp_file_cache_enabled)
+            content = pp_file_cache_get(path);
+
+        if (content) {
+            mem = content->data();
+            mem_size = content->size();
+            mem_pos = 0;
+            mem_eof = false;
+            return;
+        }
+
+        if (pp_shm != NULL && !path.empty() && pp_shm_get(path,mem,mem_size,content)) {
+            mem_pos = 0;
+            mem_eof = false;
+            return;
+        }
+
+        if (pp_prefetch_enabled && !path.empty() && (content=pp_prefetch_get(path))) {
+            mem = content->data();
+            mem_size = content->size();
+            mem_pos = 0;
+            mem_eof = false;
+            return;
+        }
+
         fp = fopen(path.c_str(),"rb");
         if (fp != NULL)
             ownership = true;
@@ -552,10 +949,14 @@ void FileSource::open() {
 }
 
 bool FileSource::is_open() const {
-    return (fp != NULL);
+    return (fp != NULL || mem != NULL);
 }
 
 bool FileSource::eof() const {
+    if (pushback != EOF)
+        return false;
+    if (mem != NULL)
+        return mem_eof;
     if (fp != NULL)
         return feof(fp);
     return true;
@@ -565,10 +966,55 @@ const string& FileSource::get_path() const {
     return path;
 }
 
+/* push back one char returned by getc() */
+void FileSource::ungetc(const int c) {
+    if (c == EOF)
+        return;
+    if (pushback != EOF)
+        throw runtime_error("FileSource only supports one char of pushback");
+
+    pushback = c;
+    if (c == '\n')
+        line--;
+    else
+        column--;
+
+    if (capture != NULL && !capture->empty())
+        capture->pop_back();
+}
+
 int FileSource::getc() {
     int c = EOF;
 
-    if (fp != NULL) {
+    if (pushback != EOF) {
+        c = pushback;
+        pushback = EOF;
+
+        if (c == '\n') {
+            line++;
+            column = 1;
+        }
+        else {
+            column++;
+        }
+    }
+    else if (mem != NULL) {
+        do {
+            c = (mem_pos < mem_size) ? (unsigned char)(mem[mem_pos++]) : EOF;
+        } while (c == '\r'/*chars to ignore*/);
+
+        if (c == EOF)
+            mem_eof = true;
+
+        if (c == '\n') {
+            line++;
+            column = 1;
+        }
+        else {
+            column++;
+        }
+    }
+    else if (fp != NULL) {
         do {
             c = fgetc(fp);
         } while (c == '\r'/*chars to ignore*/);
@@ -585,6 +1031,9 @@ int FileSource::getc() {
             throw runtime_error("File I/O error, reading");
     }
 
+    if (capture != NULL && c != EOF)
+        capture->push_back((char)c);
+
     return c;
 }
 
@@ -599,12 +1048,19 @@ void FileDest::set(const string &_path) {
     path = _path;
 }
 
+void FileDest::set(const function<void(const char*,size_t)> &_sink) {
+    close();
+    path.clear();
+    sink = _sink;
+}
+
 void FileDest::close() {
     if (fp != NULL) {
         if (ownership) fclose(fp);
         fp = NULL;
     }
     ownership = false;
+    sink = nullptr;
 }
 
 void FileDest::open() {
@@ -616,7 +1072,7 @@ void FileDest::open() {
 }
 
 bool FileDest::is_open() const {
-    return (fp != NULL);
+    return (fp != NULL || sink);
 }
 
 const string& FileDest::get_path() const {
@@ -624,7 +1080,13 @@ const string& FileDest::get_path() const {
 }
 
 void FileDest::putc(char c) {
-    if (fp != NULL) {
+    if (capture != NULL)
+        capture->push_back(c);
+
+    if (sink) {
+        sink(&c,1);
+    }
+    else if (fp != NULL) {
         if (fputc((int)c,fp) == EOF) {
             if (ferror(fp))
                 throw runtime_error("File I/O error, writing");
@@ -633,7 +1095,13 @@ void FileDest::putc(char c) {
 }
 
 void FileDest::puts(const char *s) {
-    if (fp != NULL) {
+    if (capture != NULL)
+        capture->append(s);
+
+    if (sink) {
+        sink(s,strlen(s));
+    }
+    else if (fp != NULL) {
         if (fputs(s,fp) == EOF) {
             if (ferror(fp))
                 throw runtime_error("File I/O error, writing");
@@ -642,9 +1110,60 @@ void FileDest::puts(const char *s) {
 }
 
 void FileDest::puts(const string &s) {
-    puts(s.c_str());
+    if (capture != NULL)
+        capture->append(s);
+
+    if (sink)
+        sink(s.data(),s.size());
+    else if (fp != NULL && fputs(s.c_str(),fp) == EOF && ferror(fp))
+        throw runtime_error("File I/O error, writing");
 }
 
+/* where every directive line of a file is and how the conditionals nest, recorded the
+ * first time the file is read so that later reads can jump over inactive blocks */
+class pp_directive_t {
+public:
+    long                        offset = 0;         /* start of the line */
+    int32_t                     line = 0;
+    token::token_t              kind = token::NONE; /* IF, IFDEF, ... or NONE if not a known directive */
+    size_t                      next = ~size_t(0);  /* if/elif/else: the next elif/else/endif of the same conditional */
+    vector<string>              refs;               /* identifiers named by #if/#elif/#ifdef/#ifndef */
+};
+
+class pp_directive_index {
+public:
+    static constexpr size_t     none = ~size_t(0);
+public:
+    time_t                      mtime = 0;
+    off_t                       size = 0;
+    uint64_t                    generation = 0;     /* pp_cache_generation when it was started */
+    bool                        complete = false;   /* the whole file was recorded */
+    bool                        building = false;
+    vector<pp_directive_t>      dirs;               /* in file order */
+    vector<size_t>              open_conds;         /* while building, last if/elif/else of each open conditional */
+    bool                        toplevel_content = false; /* non-directive text outside any conditional */
+public:
+    string                      include_guard() const;
+    void                        note(const long offset,const int32_t line,const string &kw,const string &rest);
+    size_t                      find_before(const long offset) const;
+};
+
+static map<string,string>       pp_include_guards;      /* resolved path -> guard macro */
+static map<string,string>       pp_realpaths;
+
+/* directory contents, read once so that include lookups do not stat() every search path */
+class pp_dir_listing {
+public:
+    bool                        exists = false;
+    map<string,unsigned char>   entries; /* name -> d_type, DT_UNKNOWN until checked */
+    bool                        kept = true; /* false if --daemon cannot watch it, then it is listed again each time */
+};
+
+static map<string,pp_dir_listing> pp_dir_listings;
+
+/* (search paths, quote or angle, includer directory, spelling) -> resolved path, empty if not found */
+static map<string,string>       pp_include_cache;
+
 class FileSourceStack {
 public:
     static constexpr size_t     default_size = 64;
@@ -719,7 +1238,6 @@ void pp_cond_t::on_if(const bool r,const bool pr) {
 void pp_cond_t::on_elif(const bool r) {
     if (allow_elif) {
         if (cond) pcond = false;
-        allow_elif = false;
         cond = r;
     }
     else {
@@ -747,883 +1265,2377 @@ void pp_cond_t::on_else() {
     }
 }
 
-class macro_t {
+static inline uint64_t pp_monotonic_ns() {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC,&ts) != 0)
+        return 0;
+
+    return (uint64_t(ts.tv_sec) * uint64_t(1000000000ull)) + uint64_t(ts.tv_nsec);
+}
+
+/* thrown when input exceeds one of the resource budgets */
+class pp_budget_error : public runtime_error {
 public:
-    vector<token>               subst; /* MACROSUBST, IDENTIFIER, __VA_ARGS__, __VA_OPT__ ( MACROSUBST ) */
-    vector<string>              param;
-    bool                        last_param_variadic = false;
-    bool                        last_param_optional = false;
-    bool                        parens = false;
+    explicit pp_budget_error(const string &what) : runtime_error(what) { }
+};
+
+/* resource budgets, so that pathological input (runaway macro recursion, exponential
+ * token pasting, absurd comment nesting) ends in a diagnostic instead of a hung or
+ * crashed process. zero means unlimited. */
+class pp_budget_t {
 public:
-    bool operator!=(const macro_t &m) const;
-    bool operator==(const macro_t &m) const;
+    unsigned int                max_expand_depth = 256;
+    size_t                      max_line_tokens = size_t(1) << size_t(20);
+    size_t                      max_file_tokens = size_t(1) << size_t(26);
+    unsigned int                max_comment_depth = 256;
+    uint64_t                    time_limit_ms = 0;
+public:
+    unsigned int                expand_depth = 0;
+    unsigned int                expand_peak = 0;    /* deepest expand_depth within the innermost do_macro_expand() */
+    uint64_t                    start_ns = 0;
+public:
+    void start();
+    void check_time() const;
+    void check_expand_depth(const unsigned int depth) const;
+    void check_line_tokens(const size_t count) const;
+    void check_file_tokens(const size_t count) const;
+    void check_comment_depth(const unsigned int depth) const;
 };
 
-bool macro_t::operator!=(const macro_t &m) const {
-    return !(*this == m);
+void pp_budget_t::start() {
+    start_ns = pp_monotonic_ns();
+    expand_depth = 0;
+    expand_peak = 0;
 }
 
-bool macro_t::operator==(const macro_t &m) const {
-    if (subst != m.subst) return false;
-    if (param != m.param) return false;
-    if (parens != m.parens) return false;
-    if (last_param_variadic != m.last_param_variadic) return false;
-    if (last_param_optional != m.last_param_optional) return false;
-    return true;
+void pp_budget_t::check_time() const {
+    if (time_limit_ms != 0ull) {
+        const uint64_t elapsed_ms = (pp_monotonic_ns() - start_ns) / uint64_t(1000000ull);
+        if (elapsed_ms > time_limit_ms)
+            throw pp_budget_error("time limit exceeded (" + to_string(time_limit_ms) + "ms)");
+    }
 }
 
-static map<string,macro_t>      macro_store;
-static string_storage           string_store;
-
-static FileSourceStack          in_src_stk;
-static FileDest                 out_dst;
+void pp_budget_t::check_expand_depth(const unsigned int depth) const {
+    if (max_expand_depth != 0u && depth > max_expand_depth)
+        throw pp_budget_error("macro expansion nested too deeply (limit " + to_string(max_expand_depth) + ")");
+}
 
-static bool                     ppp_only = false;
-static bool                     ppt_only = false;
-static bool                     pp_only = false;
+void pp_budget_t::check_line_tokens(const size_t count) const {
+    if (max_line_tokens != size_t(0) && count > max_line_tokens)
+        throw pp_budget_error("macro expansion produced too many tokens for one line (limit " + to_string(max_line_tokens) + ")");
+}
 
-static string                   in_file = "-";
-static string                   out_file = "-";
+void pp_budget_t::check_file_tokens(const size_t count) const {
+    if (max_file_tokens != size_t(0) && count > max_file_tokens)
+        throw pp_budget_error("too many tokens produced from one file (limit " + to_string(max_file_tokens) + ")");
+}
 
-static void help() {
-    fprintf(stderr,"haxpp infile outfile\n");
+void pp_budget_t::check_comment_depth(const unsigned int depth) const {
+    if (max_comment_depth != 0u && depth > max_comment_depth)
+        throw pp_budget_error("comments nested too deeply (limit " + to_string(max_comment_depth) + ")");
 }
 
-static int parse_argv(int argc,char **argv) {
-    int nwac=0;
-    char *a;
-    int i=1;
+/* 64-bit FNV-1a, used for cheap fingerprints of definitions and content */
+static constexpr uint64_t       fnv1a64_init = 0xcbf29ce484222325ull;
+static constexpr uint64_t       fnv1a64_prime = 0x100000001b3ull;
 
-    while (i < argc) {
-        a = argv[i++];
+static inline uint64_t fnv1a64(uint64_t h,const void *p,const size_t len) {
+    const unsigned char *b = (const unsigned char*)p;
 
-        if (*a == '-' && strcmp(a,"-") != 0/*not "-"*/) {
-            do { a++; } while (*a == '-');
+    for (size_t i=0;i < len;i++)
+        h = (h ^ uint64_t(b[i])) * fnv1a64_prime;
 
-            if (!strcmp(a,"h") || !strcmp(a,"help")) {
-                help();
-                return 1;
-            }
-            else if (!strcmp(a,"EE")) {
-                ppp_only = true;
-            }
-            else if (!strcmp(a,"ET")) {
-                ppt_only = true;
-            }
-            else if (!strcmp(a,"E")) {
-                pp_only = true;
-            }
-            else {
-                fprintf(stderr,"Unknown switch %s\n",a);
-                return 1;
-            }
-        }
-        else {
-            switch (nwac++) {
-                case 0:
-                    in_file = a;
-                    break;
-                case 1:
-                    out_file = a;
-                    break;
-                default:
-                    fprintf(stderr,"Unexpected arg %s\n",a);
-                    return 1;
-            }
-        }
-    }
+    return h;
+}
 
-    return 0;
+static inline uint64_t fnv1a64(uint64_t h,const string &s) {
+    const uint64_t len = s.size();
+    h = fnv1a64(h,&len,sizeof(len)); /* length prefix so adjacent strings cannot alias */
+    return fnv1a64(h,s.data(),s.size());
 }
 
-/* caller just read a backslash '\\' */
-static void read_line_esc(string &line,FileSource &src) {
-    int c2 = src.getc();
-    if (c2 != EOF) { /* trailing \<EOF> should just do nothing */
-        if (c2 == '\n') { /* \<newline>, so it continues on the next line */
-            line += ' ';
+/* --shared-cache: file contents shared by every haxpp process on the machine through
+ * one mapped file (put it on /dev/shm for POSIX shared memory). entries are written
+ * once to space taken with an atomic bump of pp_shm_header::used, then published by a
+ * compare-and-swap of a hash table slot, so readers never lock. an entry is only used
+ * if the file still has the size and mtime it was read with. when the space runs out
+ * a fresh file is renamed over it; processes still using the old one keep it mapped */
+static const char               pp_shm_magic[8] = {'H','A','X','S','H','M','1','\n'};
+static constexpr unsigned int   pp_shm_max_probe = 32;
+
+class pp_shm_header {
+public:
+    char                        magic[8];
+    uint64_t                    size;           /* of the whole file */
+    uint64_t                    slots;          /* hash table slots, right after the header */
+    uint64_t                    used;           /* end of allocated space, atomic */
+};
+
+/* followed by the path and the contents, at 8 byte alignment */
+class pp_shm_entry {
+public:
+    uint64_t                    hash;           /* of the path */
+    int64_t                     mtime_sec;
+    int64_t                     mtime_nsec;
+    uint64_t                    size;
+    uint64_t                    path_len;
+public:
+    const char*                 path() const { return (const char*)(this + 1); }
+    const char*                 data() const { return path() + ((path_len + uint64_t(7)) & ~uint64_t(7)); }
+};
+
+class pp_shm_map {
+public:
+    string                      path;
+    char*                       base = NULL;
+    uint64_t                    size = 0;
+    uint64_t                    slots = 0;      /* hdr()->slots as checked when mapped, the file can be written by anyone */
+    dev_t                       dev = 0;        /* of the file mapped */
+    ino_t                       ino = 0;
+public:
+    pp_shm_header*              hdr() const { return (pp_shm_header*)base; }
+    uint64_t*                   slot(const uint64_t i) const { return (uint64_t*)(base + sizeof(pp_shm_header)) + i; }
+};
+
+static string                   pp_shm_cwd;             /* relative paths are keyed from here */
+
+static pp_shm_map *pp_shm_map_fd(const string &path,const int fd,const uint64_t size) {
+    struct stat st;
+
+    if (fstat(fd,&st) != 0)
+        return NULL;
+
+    void *p = mmap(NULL,size_t(size),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    pp_shm_map *m = new pp_shm_map;
+    m->path = path;
+    m->base = (char*)p;
+    m->size = size;
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    return m;
+}
+
+static void pp_shm_unmap(pp_shm_map *m) {
+    munmap(m->base,size_t(m->size));
+    delete m;
+}
+
+/* the cache file at path, if it looks like one */
+static pp_shm_map *pp_shm_attach(const string &path) {
+    const int fd = open(path.c_str(),O_RDWR|O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0)
+        return NULL;
+
+    pp_shm_map *m = NULL;
+    if (fstat(fd,&st) == 0 && uint64_t(st.st_size) >= sizeof(pp_shm_header) && (m=pp_shm_map_fd(path,fd,uint64_t(st.st_size))) != NULL) {
+        const pp_shm_header *h = m->hdr();
+
+        m->slots = h->slots;
+        if (memcmp(h->magic,pp_shm_magic,sizeof(h->magic)) != 0 || h->size != m->size || m->slots == 0 ||
+            m->slots > (m->size - sizeof(pp_shm_header)) / sizeof(uint64_t)) {
+            pp_shm_unmap(m);
+            m = NULL;
         }
-        else {
-            line += '\\';
-            line += c2;
+    }
+
+    close(fd);
+    return m;
+}
+
+/* a new, empty cache file. it appears at path only once it is complete. with replace,
+ * it takes the place of the one there */
+static pp_shm_map *pp_shm_create(const string &path,const uint64_t size,const bool replace) {
+    const string tmp = path + ".tmp" + to_string((long)getpid()) + "." + to_string(hash<thread::id>()(this_thread::get_id()));
+    const int fd = open(tmp.c_str(),O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC,0644);
+    if (fd < 0)
+        return NULL;
+
+    pp_shm_map *m = NULL;
+    if (ftruncate(fd,off_t(size)) == 0 && (m=pp_shm_map_fd(path,fd,size)) != NULL) {
+        pp_shm_header *h = m->hdr();
+
+        memcpy(h->magic,pp_shm_magic,sizeof(h->magic));
+        h->size = size;
+        h->slots = m->slots = size / uint64_t(8192);
+        h->used = sizeof(pp_shm_header) + h->slots * sizeof(uint64_t);
+
+        if (replace ? (rename(tmp.c_str(),path.c_str()) != 0) : (link(tmp.c_str(),path.c_str()) != 0)) {
+            pp_shm_unmap(m);
+            m = NULL;
         }
     }
+
+    close(fd);
+    unlink(tmp.c_str()); /* after link(), or if it failed */
+    return m;
 }
 
-/* caller just read a quote '\'' or '\"' in (c) */
-static void read_line_quote(string &line,FileSource &src,const char c) {
-    int c2;
+/* true if the file at m.path is full, it cannot take another entry */
+static bool pp_shm_full(const pp_shm_map &m) {
+    return __atomic_load_n(&m.hdr()->used,__ATOMIC_RELAXED) >= m.size;
+}
 
-    line += c;
-    do {
-        c2 = src.getc();
-        if (c == EOF)
-            break;
-        else if (c == '\n')
-            break;
-        else if (c == '\\')
-            read_line_esc(line,src);
-        else {
-            line += c2;
-            if (c2 == c)
-                break;
+/* the entry at off, or NULL if off or the lengths in the entry reach outside the mapping.
+ * a slot holds whatever any process that can write the file put there */
+static const pp_shm_entry *pp_shm_entry_at(const pp_shm_map &m,const uint64_t off) {
+    if (off < sizeof(pp_shm_header) + m.slots * sizeof(uint64_t) || (off & uint64_t(7)) != 0 || off > m.size - sizeof(pp_shm_entry))
+        return NULL;
+
+    const pp_shm_entry *e = (const pp_shm_entry*)(m.base + off);
+    const uint64_t room = m.size - off - sizeof(pp_shm_entry);
+
+    if (e->path_len > room || ((e->path_len + uint64_t(7)) & ~uint64_t(7)) > room ||
+        e->size > room - ((e->path_len + uint64_t(7)) & ~uint64_t(7)))
+        return NULL;
+
+    return e;
+}
+
+/* make e visible under its path, replacing an older entry for it */
+static void pp_shm_publish(const pp_shm_map &m,const uint64_t off) {
+    const pp_shm_entry *e = (const pp_shm_entry*)(m.base + off);
+
+    for (unsigned int i=0;i < pp_shm_max_probe;i++) {
+        uint64_t *s = m.slot((e->hash + i) % m.slots);
+        uint64_t cur = __atomic_load_n(s,__ATOMIC_ACQUIRE);
+
+        for (;;) {
+            if (cur != 0) {
+                const pp_shm_entry *o = pp_shm_entry_at(m,cur);
+                if (o != NULL && (o->hash != e->hash || o->path_len != e->path_len || memcmp(o->path(),e->path(),size_t(e->path_len)) != 0))
+                    break; /* another file's slot. a bad one is overwritten */
+            }
+            if (__atomic_compare_exchange_n(s,&cur,off,false,__ATOMIC_RELEASE,__ATOMIC_ACQUIRE))
+                return;
         }
-    } while(1);
+    }
 }
 
-/* caller just read // */
-static bool read_line_skip_cpp_comment(FileSource &src) {
-    string tmp;
-    int c;
+/* m is full: use the file another process replaced it with, or replace it. the file at
+ * the path is locked meanwhile, so that it is replaced only once. NULL to keep m */
+static pp_shm_map *pp_shm_replace(const pp_shm_map &m) {
+    const int fd = open(m.path.c_str(),O_RDONLY|O_CLOEXEC);
+    struct stat fst,pst;
+    pp_shm_map *n = NULL;
+
+    if (fd < 0) { /* removed, start a new one */
+        if ((n=pp_shm_create(m.path,m.size,false)) == NULL)
+            n = pp_shm_attach(m.path);
+        return n;
+    }
 
-    do {
-        c = src.getc();
-        if (c == EOF)
-            break;
-        else if (c == '\n')
-            return false;
-        else if (c == '\\') {
-            c = src.getc();
-            if (c == '\n') break;
+    if (flock(fd,LOCK_EX) == 0 && fstat(fd,&fst) == 0 && stat(m.path.c_str(),&pst) == 0) {
+        if (fst.st_dev != pst.st_dev || fst.st_ino != pst.st_ino) { /* replaced while waiting for the lock */
+            n = pp_shm_attach(m.path);
         }
-    } while(1);
+        else if (fst.st_dev != m.dev || fst.st_ino != m.ino) {
+            n = pp_shm_attach(m.path);
+            if (n != NULL && pp_shm_full(*n)) { /* that one filled up too */
+                pp_shm_map *r = pp_shm_create(m.path,m.size,true);
+                if (r != NULL) {
+                    pp_shm_unmap(n);
+                    n = r;
+                }
+            }
+        }
+        else {
+            n = pp_shm_create(m.path,m.size,true);
+        }
+    }
 
-    return true;
+    close(fd);
+    return n;
 }
 
-/* caller just read / * * / */
-static void read_line_skip_c_comment(FileSource &src) {
-    string tmp;
-    int c;
+/* contents of path, from the shared cache or read now and added to it */
+static bool pp_shm_get(const string &path,const char* &data,size_t &size,shared_ptr<const string> &content) {
+    pp_shm_map *m = pp_shm;
+    struct stat st;
 
-    do {
-        c = src.getc();
-        if (c == EOF)
+    const string key = (path[0] == '/') ? path : (pp_cwd.empty() ? pp_shm_cwd : pp_cwd) + "/" + path;
+    const uint64_t h = fnv1a64(fnv1a64_init,key);
+
+    if (stat(path.c_str(),&st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+
+    for (unsigned int i=0;i < pp_shm_max_probe;i++) {
+        const uint64_t off = __atomic_load_n(m->slot((h + i) % m->slots),__ATOMIC_ACQUIRE);
+        if (off == 0)
             break;
-        else if (c == '*') { /* C comment closing */
-            c = src.getc();
-            if (c == '/') break;
+
+        const pp_shm_entry *e = pp_shm_entry_at(*m,off);
+        if (e != NULL && e->hash == h && e->path_len == key.size() && memcmp(e->path(),key.data(),key.size()) == 0) {
+            if (e->size != uint64_t(st.st_size) || e->mtime_sec != int64_t(st.st_mtim.tv_sec) || e->mtime_nsec != int64_t(st.st_mtim.tv_nsec))
+                break; /* stale, read it again */
+
+            data = e->data();
+            size = size_t(e->size);
+            return true;
         }
-        else if (c == '/') {
-            c = src.getc();
-            if (c == '*') /* another C comment opening. we allow nesting */
-                read_line_skip_c_comment(src);
+    }
+
+    /* read it, and keep it only if the file did not change meanwhile */
+    FILE *fp = fopen(path.c_str(),"rb");
+    auto b = make_shared<string>();
+    struct stat st2;
+    char buf[16384];
+    size_t rd;
+
+    if (fp == NULL)
+        return false;
+
+    while ((rd=fread(buf,1,sizeof(buf),fp)) > 0)
+        b->append(buf,rd);
+
+    const bool same = fstat(fileno(fp),&st2) == 0 && st2.st_size == st.st_size && st2.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+        st2.st_mtim.tv_nsec == st.st_mtim.tv_nsec && b->size() == size_t(st.st_size);
+    fclose(fp);
+
+    content = b;
+    data = b->data();
+    size = b->size();
+
+    if (!same)
+        return true;
+
+    const uint64_t need = (sizeof(pp_shm_entry) + ((key.size() + size_t(7)) & ~size_t(7)) + b->size() + size_t(7)) & ~uint64_t(7);
+    if (need > m->size / uint64_t(4))
+        return true; /* not worth the space */
+
+    const uint64_t off = __atomic_fetch_add(&m->hdr()->used,need,__ATOMIC_RELAXED);
+    if (off > m->size - need) { /* full, go on in a new file */
+        lock_guard<mutex> lock(pp_shared_lock);
+        if (pp_shm == m) {
+            pp_shm_map *n = pp_shm_replace(*m);
+            if (n != NULL)
+                pp_shm = n;
         }
-    } while(1);
+        return true;
+    }
+    if (off < sizeof(pp_shm_header) + m->slots * sizeof(uint64_t) || (off & uint64_t(7)) != 0)
+        return true; /* used is not what this process wrote there */
+
+    pp_shm_entry *e = (pp_shm_entry*)(m->base + off);
+    e->hash = h;
+    e->mtime_sec = int64_t(st.st_mtim.tv_sec);
+    e->mtime_nsec = int64_t(st.st_mtim.tv_nsec);
+    e->size = uint64_t(b->size());
+    e->path_len = uint64_t(key.size());
+    memcpy((char*)e->path(),key.data(),key.size());
+    memcpy((char*)e->data(),b->data(),b->size());
+
+    pp_shm_publish(*m,off);
+    return true;
 }
 
-bool read_line(string &line,FileSource &src) {
-    int c;
+class macro_t {
+public:
+    string                      body; /* raw text of the definition, after the parameter list */
+    vector<token>               subst; /* MACROSUBST, IDENTIFIER, __VA_ARGS__, __VA_OPT__ ( MACROSUBST ), valid once body_parsed */
+    bool                        body_parsed = false;
+    vector<string>              param;
+    bool                        last_param_variadic = false;
+    bool                        last_param_optional = false;
+    bool                        parens = false;
+    uint64_t                    fingerprint = 0; /* hash of the normalized definition, see update_fingerprint() */
+    string                      def_source; /* where it was defined, for diagnostics and reports */
+    int32_t                     def_line = 0;
+    uint64_t                    version = 0; /* unique per definition, 0 means not defined */
+public:
+    bool operator!=(const macro_t &m) const;
+    bool operator==(const macro_t &m) const;
+    void update_fingerprint();
+    void materialize(pp_context &ctx);
+    static string normalize_body(const string &b);
+};
 
-    line.clear();
-    while (!src.eof()) {
-        c = src.getc();
+/* body text with each run of whitespace outside of quotes reduced to one space, which
+ * is what decides whether two definitions are the same */
+string macro_t::normalize_body(const string &b) {
+    char quote = 0;
+    string r;
 
-        if (c == EOF)
-            break;
-        else if (c == '\n')
-            break;
-        else if (c == '\\')
-            read_line_esc(line,src);
-        else if (c == '\'')
-            read_line_quote(line,src,c);
-        else if (c == '/') {
-            int c2 = src.getc();
-            if (c2 == EOF) {
-                line += c;
-            }
-            else if (c2 == '/') { /* C++ // comment */
-                if (!read_line_skip_cpp_comment(src))
-                    break;
-            }
-            else if (c2 == '*') { /* C comment like this */
-                read_line_skip_c_comment(src);
-            }
-            else {
-                line += c;
-                line += c2;
-            }
+    r.reserve(b.size());
+    for (size_t i=0;i < b.size();i++) {
+        const char c = b[i];
+
+        if (quote != 0) {
+            r += c;
+            if (c == '\\' && (i+size_t(1)) < b.size())
+                r += b[++i];
+            else if (c == quote)
+                quote = 0;
+        }
+        else if (c == ' ' || c == '\t') {
+            if (!r.empty() && r.back() != ' ')
+                r += ' ';
+        }
+        else {
+            if (c == '\"' || c == '\'')
+                quote = c;
+
+            r += c;
         }
-        else
-            line += c;
     }
 
-    if (line.empty() && src.eof())
-        return false;
+    while (!r.empty() && r.back() == ' ')
+        r.pop_back();
+
+    return r;
+}
+
+/* call once the definition is complete. redefinition checks compare this first and
+ * only fall back to comparing the definition text when the fingerprints match.
+ * it works on the raw body so the body does not have to be tokenized. */
+void macro_t::update_fingerprint() {
+    uint64_t h = fnv1a64_init;
+    const unsigned char flags =
+        (parens ? 1u : 0u) + (last_param_variadic ? 2u : 0u) + (last_param_optional ? 4u : 0u);
+
+    h = fnv1a64(h,&flags,sizeof(flags));
+    for (const auto &p : param)
+        h = fnv1a64(h,p);
+
+    h = fnv1a64(h,normalize_body(body));
+    fingerprint = h;
+}
 
+bool macro_t::operator!=(const macro_t &m) const {
+    return !(*this == m);
+}
+
+bool macro_t::operator==(const macro_t &m) const {
+    if (fingerprint != m.fingerprint) return false;
+    if (body != m.body && normalize_body(body) != normalize_body(m.body)) return false;
+    if (param != m.param) return false;
+    if (parens != m.parens) return false;
+    if (last_param_variadic != m.last_param_variadic) return false;
+    if (last_param_optional != m.last_param_optional) return false;
     return true;
 }
 
-void parse_skip_whitespace(string::iterator &li,const string::iterator lie) {
-    while (li != lie && (*li == ' ' || *li == '\t')) li++;
+/* macro table with O(1) snapshots. definitions in frozen layers are shared by every
+ * snapshot made since, changes go to a private overlay. a null entry hides the macro */
+class macro_table {
+public:
+    typedef shared_ptr<macro_t> ref_t;
+
+    class layer {
+    public:
+        shared_ptr<const layer> parent;
+        map<string,ref_t>       entries;
+        size_t                  depth = 1;
+    };
+
+    static constexpr size_t     max_depth = 8; /* flatten when lookups would walk more layers than this */
+public:
+    macro_t*                    find(const string &name) const;
+    ref_t                       get(const string &name) const;
+    void                        set(const string &name,const ref_t &m);
+    void                        define(const string &name,macro_t &&m) { set(name,make_shared<macro_t>(move(m))); }
+    void                        undef(const string &name) { set(name,ref_t()); }
+    macro_table                 snapshot();
+    void                        list(map<string,const macro_t*> &r) const;
+    void                        clear() { base.reset(); overlay.clear(); }
+private:
+    const ref_t*                lookup(const string &name) const;
+    void                        flatten();
+private:
+    shared_ptr<const layer>     base;
+    map<string,ref_t>           overlay;
+};
+
+/* NULL if not found, else the entry (which may be a null ref, meaning #undef) */
+const macro_table::ref_t *macro_table::lookup(const string &name) const {
+    auto oi = overlay.find(name);
+    if (oi != overlay.end())
+        return &oi->second;
+
+    for (const layer *l=base.get();l != NULL;l=l->parent.get()) {
+        auto li = l->entries.find(name);
+        if (li != l->entries.end())
+            return &li->second;
+    }
+
+    return NULL;
 }
 
-enum token::token_t is_pp_keyword(const string &s) {
-    if (s == "if")
-        return token::IF;
-    if (s == "else")
-        return token::ELSE;
-    if (s == "elif")
-        return token::ELIF;
-    if (s == "endif")
-        return token::ENDIF;
-    if (s == "defined")
-        return token::DEFINED;
-    if (s == "ifdef")
-        return token::IFDEF;
-    if (s == "ifndef")
-        return token::IFNDEF;
-    if (s == "define")
-        return token::DEFINE;
-    if (s == "undef")
-        return token::UNDEF;
-    if (s == "include")
-        return token::INCLUDE;
-    if (s == "line")
-        return token::LINE;
-    if (s == "error")
-        return token::ERROR;
-    if (s == "pragma")
-        return token::PRAGMA;
+macro_t *macro_table::find(const string &name) const {
+    const ref_t *r = lookup(name);
+    return r != NULL ? r->get() : NULL;
+}
 
-    return token::NONE;
+macro_table::ref_t macro_table::get(const string &name) const {
+    const ref_t *r = lookup(name);
+    return r != NULL ? *r : ref_t();
 }
 
-enum token::token_t is_keyword(const string &s) {
-    if (s == "_Alignas")
-        return token::ALIGNAS;
-    if (s == "_Alignof")
-        return token::ALIGNOF;
-    if (s == "_Atomic")
-        return token::ATOMIC;
-    if (s == "_Bool")
-        return token::BOOL_KW;
-    if (s == "_Complex")
-        return token::COMPLEX;
-    if (s == "_Generic")
-        return token::GENERIC;
-    if (s == "_Imaginary")
-        return token::IMAGINARY;
-    if (s == "_Noreturn")
-        return token::NORETURN;
-    if (s == "_Pragma")
-        return token::PRAGMA;
-    if (s == "_Static_assert")
-        return token::STATIC_ASSERT;
-    if (s == "_Thread_local")
-        return token::THREAD_LOCAL;
-    if (s == "auto")
-        return token::AUTO;
-    if (s == "break")
-        return token::BREAK;
-    if (s == "case")
-        return token::CASE;
-    if (s == "char")
-        return token::CHAR;
-    if (s == "const")
-        return token::CONST;
-    if (s == "continue")
-        return token::CONTINUE;
-    if (s == "default")
-        return token::DEFAULT;
-    if (s == "do")
-        return token::DO;
-    if (s == "double")
-        return token::DOUBLE;
-    if (s == "else")
-        return token::ELSE;
-    if (s == "enum")
-        return token::ENUM;
-    if (s == "extern")
-        return token::EXTERN;
-    if (s == "float")
-        return token::FLOAT_KW;
-    if (s == "for")
-        return token::FOR;
-    if (s == "goto")
-        return token::GOTO;
-    if (s == "if")
-        return token::IF;
-    if (s == "int")
-        return token::INT;
-    if (s == "long")
-        return token::LONG;
-    if (s == "register")
-        return token::REGISTER;
-    if (s == "return")
-        return token::RETURN;
-    if (s == "short")
-        return token::SHORT;
-    if (s == "signed")
-        return token::SIGNED;
-    if (s == "sizeof")
-        return token::SIZEOF;
-    if (s == "static")
-        return token::STATIC;
-    if (s == "struct")
-        return token::STRUCT;
-    if (s == "switch")
-        return token::SWITCH;
-    if (s == "typedef")
-        return token::TYPEDEF;
-    if (s == "union")
-        return token::UNION;
-    if (s == "unsigned")
-        return token::UNSIGNED;
-    if (s == "void")
-        return token::VOID;
-    if (s == "volatile")
-        return token::VOLATILE;
-    if (s == "while")
-        return token::WHILE;
+void macro_table::set(const string &name,const ref_t &m) {
+    if (m || (base && lookup(name) != NULL))
+        overlay[name] = m;
+    else
+        overlay.erase(name); /* nothing below to hide */
+}
 
-    /* GCC treats these as keywords anyway, why not do the same? */
-    if (s == "__VA_ARGS__")
-        return token::VA_ARGS;
-    if (s == "__VA_OPT__")
-        return token::VA_OPT;
+/* freeze the overlay into a new layer shared by this table and the copy returned */
+macro_table macro_table::snapshot() {
+    if (!overlay.empty()) {
+        auto l = make_shared<layer>();
 
-    return token::NONE;
-}
+        l->parent = base;
+        l->depth = base ? (base->depth + size_t(1)) : size_t(1);
+        l->entries = move(overlay);
+        overlay.clear();
+        base = l;
 
-bool is_macro(const string &s) {
-    return macro_store.find(s) != macro_store.end();
-}
+        if (base->depth > max_depth)
+            flatten();
+    }
 
-/* ANSI C89 Sec 3.1.2 "Identifiers" */
-bool isidentifier_fc(const char c) { /* first char */
-    return (isalpha(c) || c == '_');
+    return *this;
 }
 
-bool isidentifier_mc(const char c) { /* non-first char */
-    return isdigit(c) || isidentifier_fc(c);
-}
+void macro_table::flatten() {
+    auto l = make_shared<layer>();
 
-bool isoctdigit(const char c) {
-    return (c >= '0' && c <= '7');
+    for (const layer *p=base.get();p != NULL;p=p->parent.get()) {
+        for (const auto &e : p->entries)
+            l->entries.insert(e); /* newer layers were visited first and win */
+    }
+    for (auto i=l->entries.begin();i != l->entries.end();) {
+        if (!i->second) i = l->entries.erase(i);
+        else i++;
+    }
+
+    base = l;
 }
 
-bool isoctdigit_throw(const char c) {
-    if (c == '8' || c == '9')
-        throw invalid_argument("invalid octal digit");
+/* every visible macro, sorted by name */
+void macro_table::list(map<string,const macro_t*> &r) const {
+    std::set<string> hidden; /* set() is a member */
 
-    return (c >= '0' && c <= '7');
-}
+    const auto add = [&r,&hidden](const map<string,ref_t> &m) {
+        for (const auto &e : m) {
+            if (r.find(e.first) != r.end() || hidden.find(e.first) != hidden.end())
+                continue;
+            if (e.second)
+                r[e.first] = e.second.get();
+            else
+                hidden.insert(e.first);
+        }
+    };
 
-unsigned char char2dec_assume(const char c) { /* assumes you checked first! */
-    return (c - '0');
+    add(overlay);
+    for (const layer *l=base.get();l != NULL;l=l->parent.get())
+        add(l->entries);
 }
 
-unsigned char char2oct_assume(const char c) { /* assumes you checked first! */
-    return (c - '0');
-}
+/* --pch-save/--pch: the macro table, include guards and #pragma once files after
+ * a prelude, in a file that is mapped and used in place. all offsets are from the
+ * start of the file, strings are (offset,length) into the string table */
+class pp_pch_str {
+public:
+    uint32_t                    off,len;
+};
 
-bool ishexdigit(const char c) {
-    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
-}
+class pp_pch_header {
+public:
+    char                        magic[8];       /* "HAXPCH2" */
+    uint32_t                    header_size;    /* sizeof(pp_pch_header), catches layout changes */
+    uint32_t                    input_count;
+    uint32_t                    macro_count;
+    uint32_t                    param_count;
+    uint32_t                    guard_count;
+    uint32_t                    once_count;
+    uint32_t                    inputs_off,macros_off,params_off,guards_off,once_off;
+    uint32_t                    strtab_off,strtab_size;
+    uint32_t                    pad;
+    uint64_t                    options_hash;   /* -D, -U and -I, see pp_pch_options_hash() */
+    uint64_t                    hash;           /* FNV-1a of everything after the header */
+};
 
-unsigned char char2hex_assume(const char c) { /* assumes you checked first! */
-    if (c >= 'A' && c <= 'F')
-        return (c + 10 - 'A');
-    if (c >= 'a' && c <= 'f')
-        return (c + 10 - 'a');
+class pp_pch_input {
+public:
+    pp_pch_str                  path;
+    uint64_t                    size;
+    int64_t                     mtime;
+    uint64_t                    content_hash;
+};
 
-    return (c - '0');
-}
+class pp_pch_macro { /* sorted by name */
+public:
+    pp_pch_str                  name,body,def_source;
+    int32_t                     def_line;
+    uint32_t                    param_first,param_count; /* into the param table */
+    uint32_t                    flags;          /* 1=parens 2=last param variadic 4=last param optional */
+    uint64_t                    fingerprint;
+};
 
-unsigned long long parse_escape_oct(string::iterator &li,const string::iterator lie,const unsigned int min_digits,const unsigned int max_digits) {
-    unsigned long long r = 0;
-    unsigned int digits = 0;
+class pp_pch_guard {
+public:
+    pp_pch_str                  path,macro;
+};
 
-    while (li != lie && digits < max_digits) {
-        if (isoctdigit(*li)) {
-            r = (r << 3ull) + char2oct_assume(*(li++));
-            digits++;
-        }
-        else {
-            break;
-        }
-    }
+class pp_pch_file {
+public:
+                                pp_pch_file() { }
+                                pp_pch_file(const pp_pch_file &) = delete;
+                                ~pp_pch_file() { close(); }
+public:
+    bool                        is_loaded() const { return hdr != NULL; }
+    void                        load(const string &path);
+    void                        close();
+    string                      str(const pp_pch_str &s) const { return string(strtab + s.off,s.len); }
+    const pp_pch_macro*         find(const string &name) const;
+    void                        to_macro(macro_t &m,const pp_pch_macro &pm) const;
+public:
+    const pp_pch_header*        hdr = NULL;
+    const pp_pch_input*         inputs = NULL;
+    const pp_pch_macro*         macros = NULL;
+    const pp_pch_str*           params = NULL;
+    const pp_pch_guard*         guards = NULL;
+    const pp_pch_str*           once = NULL;
+    const char*                 strtab = NULL;
+    string                      path;
+private:
+    void*                       base = MAP_FAILED;
+    size_t                      size = 0;
+};
 
-    if (digits < min_digits)
-        throw invalid_argument("octal parse: not enough digits");
+/* per-macro expansion statistics, collected only when a report was asked for */
+class macro_stats_t {
+public:
+    uint64_t                    calls = 0;
+    uint64_t                    tokens = 0;
+    uint64_t                    time_ns = 0; /* inclusive of nested expansions */
+    unsigned int                max_depth = 0; /* deepest nesting reached while an expansion was active */
+    string                      def_source;
+    int32_t                     def_line = 0;
+};
 
-    return r;
-}
+enum class macro_stats_sort_t {
+    TIME,
+    CALLS,
+    TOKENS,
+    DEPTH,
+    NAME
+};
 
-unsigned long long parse_escape_hex(string::iterator &li,const string::iterator lie,const unsigned int min_digits,const unsigned int max_digits) {
-    unsigned long long r = 0;
-    unsigned int digits = 0;
+/* --config: one of several macro configurations processed side by side. while a
+ * configuration is worked on, its state is swapped into the pp_context */
+class pp_config_t {
+public:
+    string                      out_file;
+    vector< pair<char,string> > macros;         /* -D and -U of this configuration */
+    macro_table                 macro_store;
+    stack<pp_cond_t>            cond_stack;
+    set<string>                 once_files;
+    set<string>                 pch_hidden;
+    map<string, vector<macro_table::ref_t> > push_stack;
+    vector<size_t>              cond_depths;    /* cond_stack depth when each file on in_src_stk was entered */
+    FileDest                    out;
+    bool                        emit_line = false;
+    int32_t                     lineno_expect = -1;
+};
 
-    while (li != lie && digits < max_digits) {
-        if (ishexdigit(*li)) {
-            r = (r << 4ull) + char2hex_assume(*(li++));
-            digits++;
-        }
-        else {
-            break;
-        }
-    }
+static constexpr size_t         pp_configs_max = 64; /* one bit each in FileSource::configs */
 
-    if (digits < min_digits)
-        throw invalid_argument("hex parse: not enough digits");
+enum class pp_tristate_t {
+    NO,
+    YES,
+    UNKNOWN
+};
 
-    return r;
-}
+/* #if/#elif expression compiled to a flat postfix program run on a small stack */
+class pp_if_program {
+public:
+    enum opcode_t {
+        PUSH,           /* push v */
+        DEFINED,        /* push 1 if names[v] is a macro, else 0 */
+        POP,
+        NEG,
+        NOT,
+        COMPL,
+        BOOL,           /* a != 0 */
+        ADD,
+        SUB,
+        MUL,
+        DIV,
+        MOD,
+        SHL,
+        SHR,
+        LT,
+        LE,
+        GT,
+        GE,
+        EQ,
+        NE,
+        BAND,
+        BXOR,
+        BOR,
+        JZ,             /* pop, jump to v if zero */
+        JMP,            /* jump to v */
+        ANDJ,           /* pop, if zero push 0 and jump to v (short circuit &&) */
+        ORJ,            /* pop, if nonzero push 1 and jump to v (short circuit ||) */
+        /* three-valued programs only, see run3() */
+        IDENT,          /* identifier names[v] that is not a macro, 0 */
+        LAND,           /* a && b, both evaluated */
+        LOR,            /* a || b, both evaluated */
+        SEL             /* c ? a : b, all three evaluated */
+    };
+    struct op_t {
+        opcode_t                op;
+        signed long long        v;
+    };
+public:
+    vector<op_t>                code;
+    vector<string>              names;
+    size_t                      max_stack = 0;
+    bool                        tristate = false; /* compile for run3(), no jumps */
+public:
+    void clear();
+    size_t emit(const opcode_t op,const signed long long v=0);
+    void patch(const size_t at);
+    signed long long run(pp_context &ctx) const;
+    pp_tristate_t run3(pp_context &ctx,signed long long &v) const;
+    void dump(FILE *fp) const;
+};
 
-unsigned long long parse_string_char_escape(string::iterator &li,const string::iterator lie) {
-    unsigned long long r = ' ';
-    char c;
+class pp_if_memo_entry {
+public:
+    vector< pair<string,uint64_t> > refs; /* every identifier consulted, with the definition version seen */
+    pp_if_program               prog;
+    bool                        result = false;
+};
 
-    if (li == lie) throw invalid_argument("expected string char escape");
-    if (*li != '\\') throw invalid_argument("expected string char escape backslash");
-    li++;
-    if (li == lie) throw invalid_argument("expected string char escape and char");
-    c = (*li++);
+/* the #if being parsed right now, so its references can be recorded */
+class pp_if_memo_pending_t {
+public:
+    bool                        active = false;
+    string                      source;
+    int32_t                     lineno = 0;
+    vector< pair<string,uint64_t> > refs;
+};
 
-    switch (c) {
-        case 'a':   return 0x07;
-        case 'b':   return 0x08;
-        case 'e':   return 0x1B;
-        case 'f':   return 0x0C;
-        case 'n':   return 0x0A;
-        case 'r':   return 0x0D;
-        case 't':   return 0x09;
-        case 'v':   return 0x0B;
-        case '\\':  return 0x5C;
-        case '\'':  return 0x27;
-        case '\"':  return 0x22;
-        case '?':   return 0x3F;
-        case 'x':   return parse_escape_hex(li,lie,2,2);
-        case 'u':   return parse_escape_hex(li,lie,4,4);
-        case 'U':   return parse_escape_hex(li,lie,8,8);
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-            li--; /* step back so it can parse the first digit we just ate */
-            return parse_escape_oct(li,lie,1,3);
-        default:
-            fprintf(stderr,"WARNING: Unknown char escape \\%c\n",c);
-            break;
-    };
+class expression;
 
-    return r;
-}
+/* --header-cache: a file read while recording a header, so entries from disk can be checked */
+class pp_hdr_input {
+public:
+    string                      path;
+    int64_t                     mtime = 0;
+    int64_t                     mtime_nsec = 0;
+    int64_t                     size = 0;
+    uint64_t                    content_hash = 0;   /* decides when the mtime differs */
+};
 
-char parse_string_char(string::iterator &li,const string::iterator lie) {
-    if (li == lie) throw invalid_argument("expected string char");
+/* --header-cache: what one inclusion of a header did. it is replayed instead of reading
+ * the header again when every macro it consulted has the same definition again */
+class pp_hdr_entry {
+public:
+    string                      path;
+    vector< pair<string,uint64_t> > refs;       /* macros consulted before the header changed them, fingerprint or 0 if undefined */
+    vector< pair<string,shared_ptr<const macro_t> > > defs; /* final state of each macro the header defined or undefined, NULL if undefined */
+    vector<string>              once;           /* #pragma once, by realpath */
+    vector< pair<string,bool> > once_refs;      /* files #included before the header changed ctx.once_files, by realpath, and whether they were in it */
+    vector<pp_hdr_input>        inputs;         /* the header and everything it included */
+    set<string>                 absent;         /* paths #include tried before the file it found, must not exist */
+    string                      text;           /* the -E output */
+};
 
-    if (*li == '\\') {
-        unsigned long long c = parse_string_char_escape(li,lie);
-        if (c > 0xFFu) fprintf(stderr,"WARNING: Char constant exceeds type range\n");
+/* a header being read and recorded, innermost last in pp_context::hdr_recs */
+class pp_hdr_rec {
+public:
+    pp_hdr_entry                e;
+    set<string>                 seen;           /* names in e.refs, or defined/undefined by the header */
+    set<string>                 touched;        /* names defined/undefined by the header */
+    set<string>                 once_seen;      /* files in e.once_refs */
+    size_t                      text_start = 0; /* where its output starts in pp_context::out_text */
+    uint64_t                    generation = 0; /* pp_cache_generation when it was started */
+    bool                        cacheable = true;
+};
 
-        return (char)(c & 0xFFul);
-    }
+static constexpr size_t         pp_hdr_max_per_file = 8;
 
-    return *(li++);
-}
+/* include_paths_key + path -> entries, newest last. shared by all contexts */
+static map<string, vector< shared_ptr<const pp_hdr_entry> > > pp_hdr_cache;
+static set<string>              pp_hdr_cache_loaded; /* keys already read from the cache directory */
 
-unsigned long long parse_sq_char(string::iterator &li,const string::iterator lie) {
-    /* at this point *li == '\'' */
-    unsigned long long shf = 0;
-    unsigned long long r = 0;
-    char c;
+/* what the command line asked for. a pp_context takes its own copy */
+class pp_options {
+public:
+    bool                        ppp_only = false;
+    bool                        ppt_only = false;
+    bool                        pp_only = false;
+    bool                        unifdef = false;        /* --unifdef */
+    vector< pair<char,string> > cmdline_macros;         /* -D and -U in command line order */
+    vector<string>              include_paths;          /* -I */
+    pp_budget_t                 budget;                 /* limits only, the counters start at zero */
+    string                      macro_stats_file;
+    bool                        macro_stats_json = false;
+    macro_stats_sort_t          macro_stats_sort = macro_stats_sort_t::TIME;
+    string                      pch_load_file;          /* --pch */
+    string                      pch_save_file;          /* --pch-save */
+    vector<pp_config_t>         configs;                /* --config, out_file and macros only */
+    bool                        header_cache = false;   /* --header-cache */
+    string                      header_cache_dir;       /* --header-cache=DIR, empty to keep entries in memory only */
+    string                      result_cache_dir;       /* --result-cache=DIR */
+    uint64_t                    result_cache_size = uint64_t(1024) << uint64_t(20); /* --result-cache-size, in bytes */
+    bool                        prefetch = false;       /* --prefetch */
+};
 
-    if (li == lie) throw invalid_argument("expected char, got end of line");
-    if (*li != '\'') throw invalid_argument("expected char quote, got " + *li);
-    li++;
+/* all state of one preprocessor run. the functions that preprocess take the context
+ * as their first argument and touch nothing else but the shared caches, so separate
+ * contexts can be used from separate threads */
+class pp_context {
+public:
+                                pp_context(const pp_options &o);
+                                pp_context(const pp_context &) = delete;
+                                ~pp_context();
+public:
+    pp_options                  opt;
+    macro_table                 macro_store;
+    map<string, vector<macro_table::ref_t> > macro_push_stack; /* #pragma push_macro */
+    string_storage              string_store;
+    uint64_t                    macro_version_next = 1; /* source of macro_t::version. identical redefinitions keep their version */
+    vector< pair<string,uint64_t> >* macro_ref_log = NULL; /* when set, is_macro() records each lookup and the version seen (0 if undefined) */
+    shared_ptr<const pp_pch_file> pch;                  /* --pch, read only, may be shared by several contexts */
+    set<string>                 macro_pch_hidden;       /* PCH macros that were #undef'd */
+    set<string>                 inputs;                 /* files read so far, for --pch-save and --result-cache */
+    set<string>                 absent;                 /* --result-cache: paths #include tried before the file it found */
+    map<string,macro_stats_t>   macro_stats;
+    FileSourceStack             in_src_stk;
+    FileDest                    out_dst;
+    pp_budget_t                 budget;
+    stack<pp_cond_t>            cond_stack;
+    set<string>                 once_files;             /* realpath of files with #pragma once */
+    string                      include_paths_key;      /* opt.include_paths, as part of a pp_include_cache key */
+    string*                     include_defer = NULL;   /* if set, pp_include() stores the path here instead of pushing it */
+    map<string,pp_directive_index> directive_indexes;
+    vector<pp_config_t>         configs;
+    set<string>                 unifdef_undefined;      /* macros named by -U, known to be undefined when specializing with --unifdef */
+    /* memoized #if results, keyed by directive location. an entry applies only if every
+     * macro the directive consulted still has the definition version it had then */
+    map< pair<string,int32_t>,vector<pp_if_memo_entry> > if_memo;
+    pp_if_memo_pending_t        if_memo_pending;
+    unique_ptr<expression>      expr;                   /* #if expression storage, reused across directives */
+    string                      error;                  /* what ended the run, if it failed */
+    /* library: supplies #include files from memory, see haxpp::on_include */
+    function<bool(const string &name,const bool angled,const string &includer,string &path,string &text)> include_hook;
+    /* library: takes each line of output tokens instead of out_dst */
+    function<void(pp_context &ctx,const token_string &tokens,const int32_t lineno,const string &source)> line_hook;
+    bool                        hdr_cache = false;      /* --header-cache, and the run is one it works for */
+    vector<pp_hdr_rec>          hdr_recs;
+    string                      out_text;               /* out_dst output, while the header or result cache needs it */
+    shared_ptr<const pp_hdr_entry> hdr_replay;          /* output of a cached header, written after the #include line */
+    bool                        result_cache = false;   /* --result-cache, and the run is one it works for */
+};
 
-    /* NTS: The reason we loop like this is to support things like 'abcd' to define a 32-bit value
-     *      that, when written to memory, spells out 'abcd'. Used in i.e. Microsoft VFW libraries. */
-    do {
-        if (li == lie) throw invalid_argument("string cut short, expected close quote");
-        if (*li == '\'') { li++; break; }
-        c = parse_string_char(li,lie);
-        r += ((unsigned long long)((unsigned char)c)) << shf;
-        shf += 8ull;
-    } while (1);
+static void pp_note_input(pp_context &ctx,const string &path) {
+    if ((!ctx.opt.pch_save_file.empty() || ctx.result_cache) && !path.empty())
+        ctx.inputs.insert(path);
+}
+
+/* a path an #include tried before the file it found. output recorded from here on is
+ * only good while it does not exist */
+static void pp_note_absent(pp_context &ctx,const string &path) {
+    if (ctx.result_cache)
+        ctx.absent.insert(path);
+    if (!ctx.hdr_recs.empty())
+        ctx.hdr_recs.back().e.absent.insert(path);
+}
 
-    if (shf > 64ull) fprintf(stderr,"WARNING: char constant too big for compiler storage, truncated");
+/* --header-cache: a macro looked up while a header is recorded */
+static inline void pp_hdr_note_ref(pp_context &ctx,const string &name,const macro_t *m) {
+    pp_hdr_rec &rec = ctx.hdr_recs.back();
 
-    return r;
+    if (rec.seen.insert(name).second)
+        rec.e.refs.push_back(make_pair(name,m != NULL ? m->fingerprint : uint64_t(0)));
 }
 
-static inline char strit_next(string::iterator &ti,const string::iterator lie) {
-    if (ti != lie)
-        return *ti;
+/* --header-cache: an #include checked against ctx.once_files while a header is recorded */
+static inline void pp_hdr_note_once(pp_context &ctx,const string &rpath,const bool once) {
+    pp_hdr_rec &rec = ctx.hdr_recs.back();
 
-    return 0;
+    if (rec.once_seen.insert(rpath).second)
+        rec.e.once_refs.push_back(make_pair(rpath,once));
 }
 
-static inline bool strit_next_match_inc(string::iterator &ti,const string::iterator lie,const char c) {
-    if (ti != lie && *ti == c) {
-        ti++;
-        return true;
+/* --header-cache: a macro defined or undefined while a header is recorded */
+static inline void pp_hdr_note_def(pp_context &ctx,const string &name) {
+    if (!ctx.hdr_recs.empty()) {
+        pp_hdr_rec &rec = ctx.hdr_recs.back();
+        rec.seen.insert(name);
+        rec.touched.insert(name);
     }
+}
 
-    return false;
+/* --header-cache: the headers being recorded did something that cannot be replayed */
+static inline void pp_hdr_uncacheable(pp_context &ctx) {
+    for (auto &rec : ctx.hdr_recs)
+        rec.cacheable = false;
 }
 
-static inline bool strit_next_match_inc(string::iterator &ti,const string::iterator lie,const char c,const char c2) {
-    auto tmp = ti;
-
-    if (tmp != lie && *tmp == c) {
-        tmp++;
-        if (tmp != lie && *tmp == c2) {
-            tmp++;
-            ti = tmp;
-            return true;
-        }
-    }
-
-    return false;
-}
-
-static inline bool strit_next_match_inc(string::iterator &ti,const string::iterator lie,const char c,const char c2,const char c3) {
-    auto tmp = ti;
-
-    if (tmp != lie && *tmp == c) {
-        tmp++;
-        if (tmp != lie && *tmp == c2) {
-            tmp++;
-            if (tmp != lie && *tmp == c3) {
-                tmp++;
-                ti = tmp;
-                return true;
-            }
-        }
-    }
+#ifndef HAXPP_LIBRARY /* the command line program */
+/* a command line: the options, and what to run them on */
+class pp_cmdline {
+public:
+    pp_options                  opt;
+    string                      in_file = "-";
+    string                      out_file = "-";
+    string                      batch_file;         /* --batch */
+    unsigned int                batch_jobs = 0;     /* --jobs, 0 = one per CPU */
+    string                      daemon_socket;      /* --daemon */
+    string                      shared_cache_file;  /* --shared-cache */
+    uint64_t                    shared_cache_size = uint64_t(256) << uint64_t(20); /* --shared-cache-size, in bytes */
+};
 
-    return false;
+static void help() {
+    fprintf(pp_stderr(),"haxpp [options] infile outfile\n");
+    fprintf(pp_stderr(),"  -E                         Preprocess\n");
+    fprintf(pp_stderr(),"  -EE                        Only read lines, strip comments\n");
+    fprintf(pp_stderr(),"  -ET                        Dump tokens\n");
+    fprintf(pp_stderr(),"  -I <path>, -I<path>        Add a directory to the #include search path\n");
+    fprintf(pp_stderr(),"  -D <m>[=v], -D<m>[=v]      Define macro m as v, or 1\n");
+    fprintf(pp_stderr(),"  -U <m>, -U<m>              Undefine macro m. With --unifdef, m is known undefined\n");
+    fprintf(pp_stderr(),"  --config=OUT[,-Dm[=v]][,-Um]...\n");
+    fprintf(pp_stderr(),"                             Add a configuration. The input is read once and\n");
+    fprintf(pp_stderr(),"                             preprocessed for every configuration, each to its own OUT\n");
+    fprintf(pp_stderr(),"  --unifdef                  Resolve conditionals that only depend on -D/-U macros,\n");
+    fprintf(pp_stderr(),"                             copy everything else through as written\n");
+    fprintf(pp_stderr(),"  --batch=FILE               Preprocess every entry of a compile_commands.json style FILE.\n");
+    fprintf(pp_stderr(),"                             Each output is the entry's output or -o with .o replaced by .i\n");
+    fprintf(pp_stderr(),"  --jobs=N                   Threads for --batch (0=one per CPU)\n");
+    fprintf(pp_stderr(),"  --daemon=SOCKET            Stay resident and serve the commands of haxpp run with\n");
+    fprintf(pp_stderr(),"                             HAXPP_DAEMON=SOCKET, keeping what was read between them\n");
+    fprintf(pp_stderr(),"  --pch-save=FILE            Save the macros and include guards at the end of input to FILE\n");
+    fprintf(pp_stderr(),"  --pch=FILE                 Start with the state saved by --pch-save, if it is up to date\n");
+    fprintf(pp_stderr(),"  --header-cache[=DIR]       Replay the output of a header included again with the same\n");
+    fprintf(pp_stderr(),"                             values for the macros it tests. DIR keeps it across runs\n");
+    fprintf(pp_stderr(),"  --result-cache=DIR         Reuse the output of an earlier run with the same options and\n");
+    fprintf(pp_stderr(),"                             input files, kept in DIR\n");
+    fprintf(pp_stderr(),"  --result-cache-size=MB     Size limit of the result cache, least recently used go first\n");
+    fprintf(pp_stderr(),"  --shared-cache=FILE        Share the contents of files read with other haxpp processes\n");
+    fprintf(pp_stderr(),"                             through FILE, mapped in memory (e.g. on /dev/shm)\n");
+    fprintf(pp_stderr(),"  --shared-cache-size=MB     Size of a new --shared-cache file\n");
+    fprintf(pp_stderr(),"  --prefetch                 Read the files #include names ahead, in the background\n");
+    fprintf(pp_stderr(),"  --max-expand-depth=N       Limit macro expansion nesting (0=unlimited)\n");
+    fprintf(pp_stderr(),"  --max-line-tokens=N        Limit tokens produced for one line (0=unlimited)\n");
+    fprintf(pp_stderr(),"  --max-file-tokens=N        Limit tokens produced from one file (0=unlimited)\n");
+    fprintf(pp_stderr(),"  --max-comment-depth=N      Limit nested /* */ comment depth (0=unlimited)\n");
+    fprintf(pp_stderr(),"  --time-limit=MS            Limit wall clock time per translation unit (0=unlimited)\n");
+    fprintf(pp_stderr(),"  --macro-stats=FILE         Write macro expansion statistics at exit (- for pp_stderr())\n");
+    fprintf(pp_stderr(),"  --macro-stats-format=F     Statistics format: text or json\n");
+    fprintf(pp_stderr(),"  --macro-stats-sort=K       Sort statistics by time, calls, tokens, depth or name\n");
 }
 
-unsigned long long parse_hex_number(string::iterator &li,const string::iterator lie) {
-    unsigned long long r = 0;
+/* match "name=value" switches. returns the value, or NULL if not this switch */
+static const char *parse_argv_value(const char *a,const char *name) {
+    const size_t l = strlen(name);
 
-    while (li != lie && ishexdigit(*li))
-        r = (r << 4ull) + char2hex_assume(*(li++));
+    if (!strncmp(a,name,l) && a[l] == '=')
+        return a + l + 1;
 
-    return r;
+    return NULL;
 }
 
-unsigned long long parse_oct_number(string::iterator &li,const string::iterator lie) {
-    unsigned long long r = 0;
-
-    while (li != lie && isoctdigit_throw(*li))
-        r = (r << 3ull) + char2oct_assume(*(li++));
+static bool parse_argv_ull(unsigned long long &r,const char *v) {
+    char *e = NULL;
 
-    return r;
+    if (*v == 0) return false;
+    r = strtoull(v,&e,0);
+    return (e != NULL && *e == 0);
 }
 
-unsigned long long parse_dec_number(string::iterator &li,const string::iterator lie) {
-    unsigned long long r = 0;
-
-    while (li != lie && isdigit(*li))
-        r = (r * 10ull) + char2dec_assume(*(li++));
+static int parse_argv(pp_cmdline &cl,int argc,char **argv) {
+    pp_options &opt = cl.opt;
+    unsigned long long n;
+    const char *v;
+    int nwac=0;
+    char *a;
+    int i=1;
 
-    return r;
-}
+    while (i < argc) {
+        a = argv[i++];
 
-void parse_float_hexponent(signed long long &exponent,string::iterator &li,const string::iterator lie) {
-    /* e.g. "p-3". caller has already eaten the 'p' */
-    signed long long exp_adjust;
+        if (*a == '-' && strcmp(a,"-") != 0/*not "-"*/) {
+            do { a++; } while (*a == '-');
 
-    if (strit_next_match_inc(li,lie,'-'))
-        exp_adjust = -((signed long long)parse_dec_number(li,lie));
-    else if (strit_next_match_inc(li,lie,'+'))
-        exp_adjust =   (signed long long)parse_dec_number(li,lie);
-    else
-        exp_adjust =   (signed long long)parse_dec_number(li,lie);
+            if (!strcmp(a,"h") || !strcmp(a,"help")) {
+                help();
+                return 1;
+            }
+            else if (!strcmp(a,"EE")) {
+                opt.ppp_only = true;
+            }
+            else if (!strcmp(a,"ET")) {
+                opt.ppt_only = true;
+            }
+            else if (!strcmp(a,"E")) {
+                opt.pp_only = true;
+            }
+            else if (!strcmp(a,"I")) { /* GCC style -I <path> */
+                a = argv[i++];
+                if (a == NULL) return 1;
+                if (*a == 0) return 1;
+                opt.include_paths.push_back(a);
+            }
+            else if (*a == 'I') { /* GCC style -I<path> */
+                a++;
+                if (*a == 0) return 1;
+                opt.include_paths.push_back(a);
+            }
+            else if (!strcmp(a,"D") || !strcmp(a,"U")) { /* GCC style -D <name>[=value], -U <name> */
+                const char w = *a;
+                a = argv[i++];
+                if (a == NULL) return 1;
+                if (*a == 0) return 1;
+                opt.cmdline_macros.push_back(make_pair(w,string(a)));
+            }
+            else if (*a == 'D' || *a == 'U') { /* GCC style -D<name>[=value], -U<name> */
+                const char w = *a;
+                a++;
+                if (*a == 0) return 1;
+                opt.cmdline_macros.push_back(make_pair(w,string(a)));
+            }
+            else if ((v=parse_argv_value(a,"config")) != NULL) {
+                pp_config_t cfg;
+                const char *f = v;
 
-    exponent += exp_adjust;
-}
+                do {
+                    const char *e = strchr(f,',');
+                    const string part = e != NULL ? string(f,size_t(e-f)) : string(f);
 
-void parse_float_exponent(long double &r,string::iterator &li,const string::iterator lie) {
-    /* e.g. "e-3". caller has already eaten the 'e' */
-    signed long long exp_adjust;
+                    if (f == v)
+                        cfg.out_file = part;
+                    else if (part.size() > 2 && part[0] == '-' && (part[1] == 'D' || part[1] == 'U'))
+                        cfg.macros.push_back(make_pair(part[1],part.substr(2)));
+                    else
+                        goto bad_value;
 
-    if (strit_next_match_inc(li,lie,'-'))
-        exp_adjust = -((signed long long)parse_dec_number(li,lie));
-    else if (strit_next_match_inc(li,lie,'+'))
-        exp_adjust =   (signed long long)parse_dec_number(li,lie);
-    else
-        exp_adjust =   (signed long long)parse_dec_number(li,lie);
+                    f = e != NULL ? e+1 : NULL;
+                } while (f != NULL);
 
-    if (exp_adjust != 0) {
-        long double m = 1;
-        while (exp_adjust <= -9) {
-            exp_adjust += 9;
-            m /= 1000000000;
+                if (cfg.out_file.empty()) goto bad_value;
+                if (opt.configs.size() >= pp_configs_max) goto bad_value;
+                opt.configs.push_back(move(cfg));
+            }
+            else if ((v=parse_argv_value(a,"batch")) != NULL) {
+                if (*v == 0) goto bad_value;
+                cl.batch_file = v;
+            }
+            else if ((v=parse_argv_value(a,"jobs")) != NULL) {
+                if (!parse_argv_ull(n,v)) goto bad_value;
+                cl.batch_jobs = (unsigned int)n;
+            }
+            else if ((v=parse_argv_value(a,"shared-cache")) != NULL) {
+                if (*v == 0) goto bad_value;
+                cl.shared_cache_file = v;
+            }
+            else if ((v=parse_argv_value(a,"shared-cache-size")) != NULL) {
+                if (!parse_argv_ull(n,v) || n == 0) goto bad_value;
+                cl.shared_cache_size = uint64_t(n) << uint64_t(20);
+            }
+            else if ((v=parse_argv_value(a,"daemon")) != NULL) {
+                if (*v == 0) goto bad_value;
+                cl.daemon_socket = v;
+            }
+            else if ((v=parse_argv_value(a,"pch")) != NULL) {
+                if (*v == 0) goto bad_value;
+                opt.pch_load_file = v;
+            }
+            else if ((v=parse_argv_value(a,"pch-save")) != NULL) {
+                if (*v == 0) goto bad_value;
+                opt.pch_save_file = v;
+            }
+            else if (!strcmp(a,"unifdef")) {
+                opt.unifdef = true;
+            }
+            else if (!strcmp(a,"header-cache")) {
+                opt.header_cache = true;
+            }
+            else if ((v=parse_argv_value(a,"header-cache")) != NULL) {
+                if (*v == 0) goto bad_value;
+                opt.header_cache = true;
+                opt.header_cache_dir = v;
+            }
+            else if ((v=parse_argv_value(a,"result-cache")) != NULL) {
+                if (*v == 0) goto bad_value;
+                opt.result_cache_dir = v;
+            }
+            else if ((v=parse_argv_value(a,"result-cache-size")) != NULL) {
+                if (!parse_argv_ull(n,v) || n == 0) goto bad_value;
+                opt.result_cache_size = uint64_t(n) << uint64_t(20);
+            }
+            else if (!strcmp(a,"prefetch")) {
+                opt.prefetch = true;
+            }
+            else if ((v=parse_argv_value(a,"max-expand-depth")) != NULL) {
+                if (!parse_argv_ull(n,v)) goto bad_value;
+                opt.budget.max_expand_depth = (unsigned int)n;
+            }
+            else if ((v=parse_argv_value(a,"max-line-tokens")) != NULL) {
+                if (!parse_argv_ull(n,v)) goto bad_value;
+                opt.budget.max_line_tokens = (size_t)n;
+            }
+            else if ((v=parse_argv_value(a,"max-file-tokens")) != NULL) {
+                if (!parse_argv_ull(n,v)) goto bad_value;
+                opt.budget.max_file_tokens = (size_t)n;
+            }
+            else if ((v=parse_argv_value(a,"max-comment-depth")) != NULL) {
+                if (!parse_argv_ull(n,v)) goto bad_value;
+                opt.budget.max_comment_depth = (unsigned int)n;
+            }
+            else if ((v=parse_argv_value(a,"time-limit")) != NULL) {
+                if (!parse_argv_ull(n,v)) goto bad_value;
+                opt.budget.time_limit_ms = (uint64_t)n;
+            }
+            else if ((v=parse_argv_value(a,"macro-stats")) != NULL) {
+                opt.macro_stats_file = v;
+            }
+            else if ((v=parse_argv_value(a,"macro-stats-format")) != NULL) {
+                if (!strcmp(v,"json"))
+                    opt.macro_stats_json = true;
+                else if (!strcmp(v,"text"))
+                    opt.macro_stats_json = false;
+                else
+                    goto bad_value;
+            }
+            else if ((v=parse_argv_value(a,"macro-stats-sort")) != NULL) {
+                if (!strcmp(v,"time"))
+                    opt.macro_stats_sort = macro_stats_sort_t::TIME;
+                else if (!strcmp(v,"calls"))
+                    opt.macro_stats_sort = macro_stats_sort_t::CALLS;
+                else if (!strcmp(v,"tokens"))
+                    opt.macro_stats_sort = macro_stats_sort_t::TOKENS;
+                else if (!strcmp(v,"depth"))
+                    opt.macro_stats_sort = macro_stats_sort_t::DEPTH;
+                else if (!strcmp(v,"name"))
+                    opt.macro_stats_sort = macro_stats_sort_t::NAME;
+                else
+                    goto bad_value;
+            }
+            else {
+                fprintf(pp_stderr(),"Unknown switch %s\n",a);
+                return 1;
+            }
         }
-        while (exp_adjust < 0) {
-            exp_adjust++;
-            m /= 10;
+        else {
+            switch (nwac++) {
+                case 0:
+                    cl.in_file = a;
+                    break;
+                case 1:
+                    cl.out_file = a;
+                    break;
+                default:
+                    fprintf(pp_stderr(),"Unexpected arg %s\n",a);
+                    return 1;
+            }
         }
+    }
 
-        while (exp_adjust >= 9) {
-            exp_adjust -= 9;
-            m *= 1000000000;
+    return 0;
+bad_value:
+    fprintf(pp_stderr(),"Invalid value for switch %s\n",a);
+    return 1;
+}
+#endif /* HAXPP_LIBRARY */
+
+/* caller just read a backslash '\\' */
+static void read_line_esc(string &line,FileSource &src) {
+    int c2 = src.getc();
+    if (c2 != EOF) { /* trailing \<EOF> should just do nothing */
+        if (c2 == '\n') { /* \<newline>, so it continues on the next line */
+            line += ' ';
         }
-        while (exp_adjust > 0) {
-            exp_adjust--;
-            m *= 10;
+        else {
+            line += '\\';
+            line += c2;
         }
-
-        r *= m;
     }
 }
 
-void parse_float_suffixes(token &r,string::iterator &li,const string::iterator lie) {
-    if (strit_next_match_inc(li,lie,'f'))
-        r.bsize = 32; /* float */
-    else if (strit_next_match_inc(li,lie,'F'))
-        r.bsize = 32; /* float */
-    else if (strit_next_match_inc(li,lie,'d'))
-        r.bsize = 64; /* double */
-    else if (strit_next_match_inc(li,lie,'D'))
-        r.bsize = 64; /* double */
-    else if (strit_next_match_inc(li,lie,'l'))
-        r.bsize = 80; /* long double */
-    else if (strit_next_match_inc(li,lie,'L'))
-        r.bsize = 80; /* long double */
+/* caller just read a quote '\'' or '\"' in (c) */
+static void read_line_quote(string &line,FileSource &src,const char c) {
+    int c2;
+
+    line += c;
+    do {
+        c2 = src.getc();
+        if (c == EOF)
+            break;
+        else if (c == '\n')
+            break;
+        else if (c == '\\')
+            read_line_esc(line,src);
+        else {
+            line += c2;
+            if (c2 == c)
+                break;
+        }
+    } while(1);
 }
 
-void parse_int_suffixes(token &r,string::iterator &li,const string::iterator lie) {
-    if (strit_next_match_inc(li,lie,'u'))
-        r.i.sign = false;
-    else if (strit_next_match_inc(li,lie,'U'))
-        r.i.sign = false;
+/* caller just read // */
+static bool read_line_skip_cpp_comment(FileSource &src) {
+    string tmp;
+    int c;
 
-    if (strit_next_match_inc(li,lie,'i','6','4'))
-        r.bsize = 64; /* long long */
-    else if (strit_next_match_inc(li,lie,'I','6','4'))
-        r.bsize = 64; /* long long */
-    else if (strit_next_match_inc(li,lie,'l','l'))
-        r.bsize = 64; /* long long */
-    else if (strit_next_match_inc(li,lie,'L','L'))
-        r.bsize = 64; /* long long */
-    else if (strit_next_match_inc(li,lie,'l'))
-        r.bsize = 32; /* long */
-    else if (strit_next_match_inc(li,lie,'L'))
-        r.bsize = 32; /* long */
+    do {
+        c = src.getc();
+        if (c == EOF)
+            break;
+        else if (c == '\n')
+            return false;
+        else if (c == '\\') {
+            c = src.getc();
+            if (c == '\n') break;
+        }
+    } while(1);
+
+    return true;
 }
 
-token parse_hex_number_float_sub(string::iterator &li,const string::iterator lie) {
-    const unsigned long long tmp_msd = 0xfull << (64ull - 4ull);
-    unsigned long long tmp = 0;
-    int tmpshf = 64;
-    token r;
+/* caller just read / *
+ * nesting is tracked with a counter rather than recursion so that the depth
+ * limit can be enforced without risking the stack */
+static void read_line_skip_c_comment(pp_context &ctx,FileSource &src) {
+    unsigned int depth = 1;
+    int c = src.getc();
 
-    if (li != lie) {
-        while (li != lie && isxdigit(*li)) {
-            if (tmpshf >= 4) {
-                tmpshf -= 4;
-                tmp += ((unsigned long long)char2hex_assume(*li)) << (unsigned long long)tmpshf;
+    while (c != EOF) {
+        if (c == '*') { /* C comment closing */
+            c = src.getc();
+            if (c == '/') {
+                if (--depth == 0u) break;
+                c = src.getc();
             }
-
-            li++;
         }
-    }
-
-    if (tmp != 0ull) { /* or else this will loop forever */
-        while ((tmp & tmp_msd) == 0ull) {
-            tmpshf += 4;
-            tmp <<= 4ull;
+        else if (c == '/') {
+            c = src.getc();
+            if (c == '*') { /* another C comment opening. we allow nesting */
+                ctx.budget.check_comment_depth(++depth);
+                c = src.getc();
+            }
+        }
+        else {
+            c = src.getc();
         }
-
-        assert(tmpshf <= 64);
     }
+}
 
-    const int dpshf = tmpshf;
+bool read_line(pp_context &ctx,string &line,FileSource &src) {
+    int c;
 
-    if (strit_next_match_inc(li,lie,'.')) {
-        while (li != lie && isxdigit(*li)) {
-            if (tmpshf >= 4) {
-                tmpshf -= 4;
-                tmp += ((unsigned long long)char2hex_assume(*li)) << (unsigned long long)tmpshf;
-            }
+    line.clear();
+    while (!src.eof()) {
+        c = src.getc();
 
-            li++;
+        if (c == EOF)
+            break;
+        else if (c == '\n')
+            break;
+        else if (c == '\\')
+            read_line_esc(line,src);
+        else if (c == '\'')
+            read_line_quote(line,src,c);
+        else if (c == '/') {
+            int c2 = src.getc();
+            if (c2 == EOF) {
+                line += c;
+            }
+            else if (c2 == '/') { /* C++ // comment */
+                if (!read_line_skip_cpp_comment(src))
+                    break;
+            }
+            else if (c2 == '*') { /* C comment like this */
+                read_line_skip_c_comment(ctx,src);
+            }
+            else {
+                line += c;
+                line += c2;
+            }
         }
+        else
+            line += c;
     }
 
-    signed long long exponent = -dpshf;
-
-    /* FIXME: GCC behavior suggests the 'p' is mandatory. */
-    if (strit_next_match_inc(li,lie,'p'))
-        parse_float_hexponent(exponent,li,lie);
-    else if (strit_next_match_inc(li,lie,'P'))
-        parse_float_hexponent(exponent,li,lie);
+    if (line.empty() && src.eof())
+        return false;
 
-    r.tval = token::FLOAT;
-    r.f.fraction = tmp;
-    r.f.exponent = exponent;
-    return r;
+    return true;
 }
 
-long double parse_dec_number_float_sub(string::iterator &li,const string::iterator lie) {
-    long double r = 0;
+/* skip the rest of the logical line, with only enough lexing to follow
+ * comments, quotes and line continuations. returns false at EOF. */
+static bool skip_line_raw(pp_context &ctx,FileSource &src) {
+    int c;
 
-    if (li != lie) {
-        unsigned long long tmp = 0,tmpdiv = 1;
+    while ((c=src.getc()) != EOF) {
+        if (c == '\n') {
+            return true;
+        }
+        else if (c == '\\') {
+            src.getc(); /* escaped char, or \<newline> continuation */
+        }
+        else if (c == '\"' || c == '\'') { /* unterminated quotes end at the newline */
+            int c2;
 
-        /* NTS: Process digits in batches to allow precision in integer math and reduce cumulative floating point error */
-        while (li != lie && isdigit(*li)) {
-            if (tmpdiv >= 100000000000ull) {
-                r = (r * tmpdiv) + tmp;
-                tmpdiv = 1;
-                tmp = 0;
+            while ((c2=src.getc()) != EOF) {
+                if (c2 == '\\')
+                    src.getc();
+                else if (c2 == c)
+                    break;
+                else if (c2 == '\n')
+                    return true;
             }
-
-            tmp = (tmp * 10ull) + ((unsigned long long)(*(li++) - '0'));
-            tmpdiv *= 10ull;
         }
-
-        if (tmpdiv > 1ull) {
-            r = (r * tmpdiv) + tmp;
+        else if (c == '/') {
+            const int c2 = src.getc();
+            if (c2 == '*')
+                read_line_skip_c_comment(ctx,src);
+            else if (c2 == '/') {
+                if (!read_line_skip_cpp_comment(src))
+                    return true;
+            }
+            else
+                src.ungetc(c2);
         }
     }
 
-    if (li != lie && *li == '.') {
-        unsigned long long tmp = 0,tmpdiv = 1;
-        long double d = 1.0;
+    return false;
+}
 
-        /* skip '.' */
-        li++;
+bool isidentifier_mc(const char c);
 
-        /* NTS: Process digits in batches to allow precision in integer math and reduce cumulative floating point error */
-        while (li != lie && isdigit(*li)) {
-            if (tmpdiv >= 100000000000ull) {
-                d *= (signed long long)tmpdiv; /* only because on x86 there is only a signed divide by int */
-                r += tmp / d;
-                tmpdiv = 1;
-                tmp = 0;
-            }
+static bool is_pp_cond_keyword(const string &kw) {
+    return kw == "if" || kw == "ifdef" || kw == "ifndef" || kw == "elif" || kw == "else" || kw == "endif";
+}
 
-            tmp = (tmp * 10ull) + ((unsigned long long)(*(li++) - '0'));
-            tmpdiv *= 10ull;
-        }
+enum token::token_t is_pp_keyword(const string &s);
+bool isidentifier_fc(const char c);
 
-        if (tmpdiv > 1ull) {
-            d *= (signed long long)tmpdiv; /* only because on x86 there is only a signed divide by int */
-            r += tmp / d;
-        }
+void pp_directive_index::note(const long offset,const int32_t line,const string &kw,const string &rest) {
+    if (offset < 0l) {
+        building = false; /* cannot seek, give up */
+        return;
     }
 
-    if (strit_next_match_inc(li,lie,'e'))
-        parse_float_exponent(r,li,lie);
-    else if (strit_next_match_inc(li,lie,'E'))
-        parse_float_exponent(r,li,lie);
+    const size_t idx = dirs.size();
+    dirs.resize(idx + size_t(1));
 
-    return r;
+    pp_directive_t &d = dirs.back();
+    d.offset = offset;
+    d.line = line;
+    d.kind = is_pp_keyword(kw);
+
+    switch (d.kind) {
+        case token::IF:
+        case token::ELIF:
+        case token::IFDEF:
+        case token::IFNDEF: {
+            set<string> seen; /* refs in order of appearance, each once */
+
+            for (size_t i=0;i < rest.size();) {
+                if (isidentifier_fc(rest[i])) {
+                    const size_t b = i;
+                    while (i < rest.size() && isidentifier_mc(rest[i])) i++;
+
+                    string ident = rest.substr(b,i-b);
+                    if (ident != "defined" && seen.insert(ident).second)
+                        d.refs.push_back(move(ident));
+                }
+                else if (rest[i] >= '0' && rest[i] <= '9') { /* skip suffixes like 10UL */
+                    while (i < rest.size() && isidentifier_mc(rest[i])) i++;
+                }
+                else {
+                    i++;
+                }
+            }
+            break;
+        }
+        default:
+            break;
+    };
+
+    switch (d.kind) {
+        case token::IF:
+        case token::IFDEF:
+        case token::IFNDEF:
+            open_conds.push_back(idx);
+            break;
+        case token::ELIF:
+        case token::ELSE:
+            if (!open_conds.empty()) {
+                dirs[open_conds.back()].next = idx;
+                open_conds.back() = idx;
+            }
+            break;
+        case token::ENDIF:
+            if (!open_conds.empty()) {
+                dirs[open_conds.back()].next = idx;
+                open_conds.pop_back();
+            }
+            break;
+        default:
+            break;
+    };
 }
 
-void print_token(FILE *fp,const token &t);
+/* the X of a file entirely wrapped in #ifndef X ... #endif, with nothing outside it
+ * and no #elif/#else at the outer level. empty if the file has no such guard */
+string pp_directive_index::include_guard() const {
+    if (!complete || toplevel_content || dirs.size() < size_t(2))
+        return string();
 
-bool parse_number_looks_like_float(string::iterator /*does not modify caller copy*/li,const string::iterator lie) {
-    if (strit_next_match_inc(li,lie,'0','x')) {
-        while (li != lie && isxdigit(*li)) li++;
-        if (li != lie) return (*li == '.' || *li == 'p' || *li == 'p');
-    }
-    else {
-        while (li != lie && isdigit(*li)) li++;
-        if (li != lie) return (*li == '.' || *li == 'e' || *li == 'E');
+    const pp_directive_t &first = dirs.front();
+    if (first.kind != token::IFNDEF || first.refs.empty())
+        return string();
+    if (first.next != (dirs.size() - size_t(1)) || dirs.back().kind != token::ENDIF)
+        return string();
+
+    return first.refs.front();
+}
+
+/* the last directive that starts before offset */
+size_t pp_directive_index::find_before(const long offset) const {
+    size_t lo = 0,hi = dirs.size();
+
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / size_t(2);
+        if (dirs[mid].offset < offset)
+            lo = mid + size_t(1);
+        else
+            hi = mid;
     }
 
-    return false;
+    return (lo > size_t(0)) ? (lo - size_t(1)) : none;
 }
 
-/* will return int or float */
-token parse_number(string::iterator &li,const string::iterator lie) {
-    token r;
+/* find the directive index for a freshly opened file, or start building one */
+void pp_directive_index_attach(pp_context &ctx,FileSource &src) {
+    struct stat st;
 
-    /* at this point isdigit(*li) */
-    if (li == lie) throw invalid_argument("expected number, got end of line");
-    if (!isdigit(*li)) throw invalid_argument(string("expected number, got ") + *li);
+    if (src.get_path().empty() || src.tell() != 0l)
+        return;
+    if (stat(src.get_path().c_str(),&st) != 0 || !S_ISREG(st.st_mode))
+        return;
 
-    if (parse_number_looks_like_float(li,lie)) {
-        if (strit_next_match_inc(li,lie,'0','x'))
-            r = parse_hex_number_float_sub(li,lie);
-        else
-            r = parse_dec_number_float_sub(li,lie);
+    pp_directive_index &idx = ctx.directive_indexes[pp_path_key(src.get_path())];
+    const uint64_t generation = pp_cache_generation;
 
-        parse_float_suffixes(r,li,lie);
+    if (idx.complete && idx.mtime == st.st_mtime && idx.size == st.st_size && idx.generation == generation) {
+        src.dir_index = &idx;
     }
-    else {
-        if (strit_next_match_inc(li,lie,'0')) {
-            if (strit_next_match_inc(li,lie,'x')) /* hexadecimal integer */
-                r = parse_hex_number(li,lie);
-            else /* octal */
-                r = parse_oct_number(li,lie);
+    else if (!idx.building) { /* a file that includes itself is indexed by the outer read only */
+        idx = pp_directive_index();
+        idx.mtime = st.st_mtime;
+        idx.size = st.st_size;
+        idx.generation = generation;
+        idx.building = true;
+        src.dir_index = &idx;
+        src.dir_index_build = true;
+    }
+}
+
+/* the file has been read to the end */
+void pp_directive_index_detach(FileSource &src) {
+    if (src.dir_index != NULL && src.dir_index_build) {
+        if (src.dir_index->building && src.dir_index->open_conds.empty()) {
+            src.dir_index->complete = true;
+            src.dir_index->open_conds.clear();
+
+            const string guard = src.dir_index->include_guard();
+            if (!guard.empty()) {
+                lock_guard<mutex> lock(pp_shared_lock);
+                if (src.dir_index->generation == pp_cache_generation)
+                    pp_include_guards[pp_path_key(src.get_path())] = guard;
+            }
         }
-        else { /* integer */
-            r = parse_dec_number(li,lie);
+        else {
+            src.dir_index->dirs.clear();
         }
 
-        parse_int_suffixes(r,li,lie);
+        src.dir_index->building = false;
     }
 
-    return r;
+    src.dir_index = NULL;
+    src.dir_index_build = false;
 }
 
-stringref_t parse_string(string::iterator &li,const string::iterator lie) {
-    /* at this point *li == '\"' */
-    string r;
-    char c;
+static inline bool pp_directive_index_building(const FileSource &src) {
+    return src.dir_index_build && src.dir_index->building;
+}
 
-    if (li == lie) throw invalid_argument("expected string, got end of line");
-    if (*li != '\"') throw invalid_argument("expected string, got " + *li);
-    li++;
+/* record the line just read by read_line() if it is a directive */
+void pp_directive_index_note_line(FileSource &src,const long offset,const int32_t line,const string &text) {
+    if (!pp_directive_index_building(src))
+        return;
+
+    size_t i = 0;
+    while (i < text.size() && (text[i] == ' ' || text[i] == '\t')) i++;
+    if (i >= text.size())
+        return;
+    if (text[i] != '#') {
+        if (src.dir_index->open_conds.empty())
+            src.dir_index->toplevel_content = true;
+        return;
+    }
 
-    do {
-        if (li == lie) throw invalid_argument("string cut short, expected close quote");
-        if (*li == '\"') { li++; break; }
-        c = parse_string_char(li,lie);
-        r += c;
-    } while (1);
+    i++;
+    while (i < text.size() && (text[i] == ' ' || text[i] == '\t')) i++;
+
+    const size_t b = i;
+    while (i < text.size() && isidentifier_mc(text[i])) i++;
 
-    return string_store.add(r);
+    src.dir_index->note(offset,line,text.substr(b,i-b),text.substr(i));
 }
 
-string parse_identifier(string::iterator &li,const string::iterator lie) {
-    string r;
+/* inactive block skipping with a complete directive index: jump straight from the
+ * directive that started the block to the next one of the same conditional */
+bool read_line_skip_inactive_indexed(pp_context &ctx,string &line,FileSource &src,int32_t &lineno) {
+    const pp_directive_index &idx = *src.dir_index;
+    size_t e = idx.find_before(src.tell());
 
-    if (li == lie) throw invalid_argument("expected identifier, got end of line");
-    if (!isidentifier_fc(*li)) throw invalid_argument("expected identifier");
+    line.clear();
+    while (e != pp_directive_index::none) {
+        const size_t n = idx.dirs[e].next;
+        if (n == pp_directive_index::none)
+            break;
 
-    do {
-        r += *(li++);
-        if (li == lie) break;
-        if (!isidentifier_mc(*li)) break;
-    } while (1);
+        const pp_directive_t &d = idx.dirs[n];
 
-    return r;
+        /* #elif whose result cannot matter, see read_line_skip_inactive() */
+        if (d.kind == token::ELIF && !ctx.cond_stack.empty() && (!ctx.cond_stack.top().pcond || ctx.cond_stack.top().cond)) {
+            ctx.cond_stack.top().on_elif(false);
+            e = n;
+            continue;
+        }
+
+        src.seek(d.offset,d.line);
+        lineno = d.line;
+        return read_line(ctx,line,src);
+    }
+
+    /* unterminated conditional, nothing more in this file matters */
+    while (src.getc() != EOF);
+    return false;
 }
 
-/* standard C++ to_string() always prints 6 digits in GCC.
- * we want more digits! */
-string a_better_float_to_string(const long double v) {
-    char tmp[40];
+/* fast path for lines in an inactive conditional block (#if 0 etc). the raw bytes are
+ * scanned only for comment and quote state and for lines that start with '#'. nested
+ * conditionals are counted here and never tokenized. returns the first #elif, #else
+ * or #endif that belongs to the current conditional, as read_line() would, along with
+ * its line number. returns false at EOF. */
+bool read_line_skip_inactive(pp_context &ctx,string &line,FileSource &src,int32_t &lineno) {
+    unsigned int depth = 0;
+    int c;
 
-    snprintf(tmp,sizeof(tmp),"%.40Lf",v); /* expect overprint, but snprintf to stop at 39 chars + NUL */
-    return tmp;
+    if (src.dir_index != NULL && src.dir_index->complete)
+        return read_line_skip_inactive_indexed(ctx,line,src,lineno);
+
+    const bool build = pp_directive_index_building(src);
+
+    line.clear();
+    while (!src.eof()) {
+        const long loffset = build ? src.tell() : -1l;
+        const int32_t lline = src.current_line();
+
+        /* start of a line: whitespace and comments may come before the '#' */
+        do {
+            c = src.getc();
+            if (c == '/') {
+                const int c2 = src.getc();
+                if (c2 == '*') {
+                    read_line_skip_c_comment(ctx,src);
+                    c = ' ';
+                }
+                else if (c2 == '/') { /* a \<newline> continues the line past the comment */
+                    c = read_line_skip_cpp_comment(src) ? '/' : '\n';
+                }
+                else {
+                    src.ungetc(c2);
+                }
+            }
+        } while (c == ' ' || c == '\t');
+
+        if (c == EOF)
+            break;
+        if (c == '\n')
+            continue;
+        if (c != '#') {
+            if (c != '/') /* a '/' is consumed, what follows it is already pushed back */
+                src.ungetc(c);
+            if (!skip_line_raw(ctx,src)) break;
+            continue;
+        }
+
+        const int32_t dline = src.current_line();
+        string kw;
+
+        do { c = src.getc(); } while (c == ' ' || c == '\t');
+        while (c != EOF && isidentifier_mc((char)c)) {
+            kw += (char)c;
+            c = src.getc();
+        }
+        src.ungetc(c);
+
+        if (!is_pp_cond_keyword(kw)) {
+            if (build)
+                src.dir_index->note(loffset,lline,kw,string());
+            if (!skip_line_raw(ctx,src)) break;
+            continue;
+        }
+
+        /* while building the index, conditionals are read in full for the macros they name */
+        string rest;
+        if (build) {
+            read_line(ctx,rest,src);
+            src.dir_index->note(loffset,lline,kw,rest);
+        }
+
+        if (kw == "if" || kw == "ifdef" || kw == "ifndef") {
+            depth++;
+            if (!build && !skip_line_raw(ctx,src)) break;
+            continue;
+        }
+        if (depth > 0u) {
+            if (kw == "endif") depth--;
+            if (!build && !skip_line_raw(ctx,src)) break;
+            continue;
+        }
+
+        /* #elif only needs evaluating if no earlier branch was taken and the enclosing
+         * block is active. otherwise its result cannot matter, so do not tokenize it. */
+        if (kw == "elif" && !ctx.cond_stack.empty() && (!ctx.cond_stack.top().pcond || ctx.cond_stack.top().cond)) {
+            ctx.cond_stack.top().on_elif(false);
+            if (!build && !skip_line_raw(ctx,src)) break;
+            continue;
+        }
+
+        if (!build)
+            read_line(ctx,rest,src);
+
+        line = string("#") + kw + rest;
+        lineno = dline;
+        return true;
+    }
+
+    return false;
 }
 
-string to_string(const token &t) {
-    switch (t.tval) {
-        case token::MACRO:
-            return string("[macro]") + t.sval + " ";
-        case token::PREPROC:
-            return "[preprocessordirective] ";
-        case token::MACROSUBST:
-            return string("[macrosubst]\"") + t.sval + "\" ";
-        case token::IDENTIFIER:
-            return string("[identifier]") + t.sval + " ";
+void parse_skip_whitespace(string::iterator &li,const string::iterator lie) {
+    while (li != lie && (*li == ' ' || *li == '\t')) li++;
+}
+
+enum token::token_t is_pp_keyword(const string &s) {
+    if (s == "if")
+        return token::IF;
+    if (s == "else")
+        return token::ELSE;
+    if (s == "elif")
+        return token::ELIF;
+    if (s == "endif")
+        return token::ENDIF;
+    if (s == "defined")
+        return token::DEFINED;
+    if (s == "ifdef")
+        return token::IFDEF;
+    if (s == "ifndef")
+        return token::IFNDEF;
+    if (s == "define")
+        return token::DEFINE;
+    if (s == "undef")
+        return token::UNDEF;
+    if (s == "include")
+        return token::INCLUDE;
+    if (s == "line")
+        return token::LINE;
+    if (s == "error")
+        return token::ERROR;
+    if (s == "pragma")
+        return token::PRAGMA;
+
+    return token::NONE;
+}
+
+enum token::token_t is_keyword(const string &s) {
+    if (s == "_Alignas")
+        return token::ALIGNAS;
+    if (s == "_Alignof")
+        return token::ALIGNOF;
+    if (s == "_Atomic")
+        return token::ATOMIC;
+    if (s == "_Bool")
+        return token::BOOL_KW;
+    if (s == "_Complex")
+        return token::COMPLEX;
+    if (s == "_Generic")
+        return token::GENERIC;
+    if (s == "_Imaginary")
+        return token::IMAGINARY;
+    if (s == "_Noreturn")
+        return token::NORETURN;
+    if (s == "_Pragma")
+        return token::PRAGMA;
+    if (s == "_Static_assert")
+        return token::STATIC_ASSERT;
+    if (s == "_Thread_local")
+        return token::THREAD_LOCAL;
+    if (s == "auto")
+        return token::AUTO;
+    if (s == "break")
+        return token::BREAK;
+    if (s == "case")
+        return token::CASE;
+    if (s == "char")
+        return token::CHAR;
+    if (s == "const")
+        return token::CONST;
+    if (s == "continue")
+        return token::CONTINUE;
+    if (s == "default")
+        return token::DEFAULT;
+    if (s == "do")
+        return token::DO;
+    if (s == "double")
+        return token::DOUBLE;
+    if (s == "else")
+        return token::ELSE;
+    if (s == "enum")
+        return token::ENUM;
+    if (s == "extern")
+        return token::EXTERN;
+    if (s == "float")
+        return token::FLOAT_KW;
+    if (s == "for")
+        return token::FOR;
+    if (s == "goto")
+        return token::GOTO;
+    if (s == "if")
+        return token::IF;
+    if (s == "int")
+        return token::INT;
+    if (s == "long")
+        return token::LONG;
+    if (s == "register")
+        return token::REGISTER;
+    if (s == "return")
+        return token::RETURN;
+    if (s == "short")
+        return token::SHORT;
+    if (s == "signed")
+        return token::SIGNED;
+    if (s == "sizeof")
+        return token::SIZEOF;
+    if (s == "static")
+        return token::STATIC;
+    if (s == "struct")
+        return token::STRUCT;
+    if (s == "switch")
+        return token::SWITCH;
+    if (s == "typedef")
+        return token::TYPEDEF;
+    if (s == "union")
+        return token::UNION;
+    if (s == "unsigned")
+        return token::UNSIGNED;
+    if (s == "void")
+        return token::VOID;
+    if (s == "volatile")
+        return token::VOLATILE;
+    if (s == "while")
+        return token::WHILE;
+
+    /* GCC treats these as keywords anyway, why not do the same? */
+    if (s == "__VA_ARGS__")
+        return token::VA_ARGS;
+    if (s == "__VA_OPT__")
+        return token::VA_OPT;
+
+    return token::NONE;
+}
+
+/* look up a macro. a macro from the PCH is copied into macro_store the first time it is used */
+macro_t *macro_find(pp_context &ctx,const string &s) {
+    macro_t *r = ctx.macro_store.find(s);
+
+    if (r == NULL && ctx.pch && (ctx.macro_pch_hidden.empty() || ctx.macro_pch_hidden.find(s) == ctx.macro_pch_hidden.end())) {
+        const pp_pch_macro *pm = ctx.pch->find(s);
+        if (pm != NULL) {
+            macro_t m;
+            ctx.pch->to_macro(m,*pm);
+            m.version = ctx.macro_version_next++;
+            ctx.macro_store.define(s,move(m));
+            r = ctx.macro_store.find(s);
+        }
+    }
+
+    if (!ctx.hdr_recs.empty())
+        pp_hdr_note_ref(ctx,s,r);
+
+    return r;
+}
+
+bool is_macro(pp_context &ctx,const string &s) {
+    const macro_t *m = macro_find(ctx,s);
+
+    if (ctx.macro_ref_log != NULL)
+        ctx.macro_ref_log->push_back(make_pair(s,m != NULL ? m->version : uint64_t(0)));
+
+    return m != NULL;
+}
+
+uint64_t macro_version(pp_context &ctx,const string &s) {
+    const macro_t *m = macro_find(ctx,s);
+    if (m != NULL)
+        return m->version;
+
+    return 0;
+}
+
+/* ANSI C89 Sec 3.1.2 "Identifiers" */
+bool isidentifier_fc(const char c) { /* first char */
+    return (isalpha(c) || c == '_');
+}
+
+bool isidentifier_mc(const char c) { /* non-first char */
+    return isdigit(c) || isidentifier_fc(c);
+}
+
+bool isoctdigit(const char c) {
+    return (c >= '0' && c <= '7');
+}
+
+bool isoctdigit_throw(const char c) {
+    if (c == '8' || c == '9')
+        throw invalid_argument("invalid octal digit");
+
+    return (c >= '0' && c <= '7');
+}
+
+unsigned char char2dec_assume(const char c) { /* assumes you checked first! */
+    return (c - '0');
+}
+
+unsigned char char2oct_assume(const char c) { /* assumes you checked first! */
+    return (c - '0');
+}
+
+bool ishexdigit(const char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+unsigned char char2hex_assume(const char c) { /* assumes you checked first! */
+    if (c >= 'A' && c <= 'F')
+        return (c + 10 - 'A');
+    if (c >= 'a' && c <= 'f')
+        return (c + 10 - 'a');
+
+    return (c - '0');
+}
+
+unsigned long long parse_escape_oct(string::iterator &li,const string::iterator lie,const unsigned int min_digits,const unsigned int max_digits) {
+    unsigned long long r = 0;
+    unsigned int digits = 0;
+
+    while (li != lie && digits < max_digits) {
+        if (isoctdigit(*li)) {
+            r = (r << 3ull) + char2oct_assume(*(li++));
+            digits++;
+        }
+        else {
+            break;
+        }
+    }
+
+    if (digits < min_digits)
+        throw invalid_argument("octal parse: not enough digits");
+
+    return r;
+}
+
+unsigned long long parse_escape_hex(string::iterator &li,const string::iterator lie,const unsigned int min_digits,const unsigned int max_digits) {
+    unsigned long long r = 0;
+    unsigned int digits = 0;
+
+    while (li != lie && digits < max_digits) {
+        if (ishexdigit(*li)) {
+            r = (r << 4ull) + char2hex_assume(*(li++));
+            digits++;
+        }
+        else {
+            break;
+        }
+    }
+
+    if (digits < min_digits)
+        throw invalid_argument("hex parse: not enough digits");
+
+    return r;
+}
+
+unsigned long long parse_string_char_escape(string::iterator &li,const string::iterator lie) {
+    unsigned long long r = ' ';
+    char c;
+
+    if (li == lie) throw invalid_argument("expected string char escape");
+    if (*li != '\\') throw invalid_argument("expected string char escape backslash");
+    li++;
+    if (li == lie) throw invalid_argument("expected string char escape and char");
+    c = (*li++);
+
+    switch (c) {
+        case 'a':   return 0x07;
+        case 'b':   return 0x08;
+        case 'e':   return 0x1B;
+        case 'f':   return 0x0C;
+        case 'n':   return 0x0A;
+        case 'r':   return 0x0D;
+        case 't':   return 0x09;
+        case 'v':   return 0x0B;
+        case '\\':  return 0x5C;
+        case '\'':  return 0x27;
+        case '\"':  return 0x22;
+        case '?':   return 0x3F;
+        case 'x':   return parse_escape_hex(li,lie,2,2);
+        case 'u':   return parse_escape_hex(li,lie,4,4);
+        case 'U':   return parse_escape_hex(li,lie,8,8);
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+            li--; /* step back so it can parse the first digit we just ate */
+            return parse_escape_oct(li,lie,1,3);
+        default:
+            fprintf(pp_stderr(),"WARNING: Unknown char escape \\%c\n",c);
+            break;
+    };
+
+    return r;
+}
+
+char parse_string_char(string::iterator &li,const string::iterator lie) {
+    if (li == lie) throw invalid_argument("expected string char");
+
+    if (*li == '\\') {
+        unsigned long long c = parse_string_char_escape(li,lie);
+        if (c > 0xFFu) fprintf(pp_stderr(),"WARNING: Char constant exceeds type range\n");
+
+        return (char)(c & 0xFFul);
+    }
+
+    return *(li++);
+}
+
+unsigned long long parse_sq_char(string::iterator &li,const string::iterator lie) {
+    /* at this point *li == '\'' */
+    unsigned long long shf = 0;
+    unsigned long long r = 0;
+    char c;
+
+    if (li == lie) throw invalid_argument("expected char, got end of line");
+    if (*li != '\'') throw invalid_argument("expected char quote, got " + *li);
+    li++;
+
+    /* NTS: The reason we loop like this is to support things like 'abcd' to define a 32-bit value
+     *      that, when written to memory, spells out 'abcd'. Used in i.e. Microsoft VFW libraries. */
+    do {
+        if (li == lie) throw invalid_argument("string cut short, expected close quote");
+        if (*li == '\'') { li++; break; }
+        c = parse_string_char(li,lie);
+        r += ((unsigned long long)((unsigned char)c)) << shf;
+        shf += 8ull;
+    } while (1);
+
+    if (shf > 64ull) fprintf(pp_stderr(),"WARNING: char constant too big for compiler storage, truncated");
+
+    return r;
+}
+
+static inline char strit_next(string::iterator &ti,const string::iterator lie) {
+    if (ti != lie)
+        return *ti;
+
+    return 0;
+}
+
+static inline bool strit_next_match_inc(string::iterator &ti,const string::iterator lie,const char c) {
+    if (ti != lie && *ti == c) {
+        ti++;
+        return true;
+    }
+
+    return false;
+}
+
+static inline bool strit_next_match_inc(string::iterator &ti,const string::iterator lie,const char c,const char c2) {
+    auto tmp = ti;
+
+    if (tmp != lie && *tmp == c) {
+        tmp++;
+        if (tmp != lie && *tmp == c2) {
+            tmp++;
+            ti = tmp;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static inline bool strit_next_match_inc(string::iterator &ti,const string::iterator lie,const char c,const char c2,const char c3) {
+    auto tmp = ti;
+
+    if (tmp != lie && *tmp == c) {
+        tmp++;
+        if (tmp != lie && *tmp == c2) {
+            tmp++;
+            if (tmp != lie && *tmp == c3) {
+                tmp++;
+                ti = tmp;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+unsigned long long parse_hex_number(string::iterator &li,const string::iterator lie) {
+    unsigned long long r = 0;
+
+    while (li != lie && ishexdigit(*li))
+        r = (r << 4ull) + char2hex_assume(*(li++));
+
+    return r;
+}
+
+unsigned long long parse_oct_number(string::iterator &li,const string::iterator lie) {
+    unsigned long long r = 0;
+
+    while (li != lie && isoctdigit_throw(*li))
+        r = (r << 3ull) + char2oct_assume(*(li++));
+
+    return r;
+}
+
+unsigned long long parse_dec_number(string::iterator &li,const string::iterator lie) {
+    unsigned long long r = 0;
+
+    while (li != lie && isdigit(*li))
+        r = (r * 10ull) + char2dec_assume(*(li++));
+
+    return r;
+}
+
+void parse_float_hexponent(signed long long &exponent,string::iterator &li,const string::iterator lie) {
+    /* e.g. "p-3". caller has already eaten the 'p' */
+    signed long long exp_adjust;
+
+    if (strit_next_match_inc(li,lie,'-'))
+        exp_adjust = -((signed long long)parse_dec_number(li,lie));
+    else if (strit_next_match_inc(li,lie,'+'))
+        exp_adjust =   (signed long long)parse_dec_number(li,lie);
+    else
+        exp_adjust =   (signed long long)parse_dec_number(li,lie);
+
+    exponent += exp_adjust;
+}
+
+void parse_float_exponent(long double &r,string::iterator &li,const string::iterator lie) {
+    /* e.g. "e-3". caller has already eaten the 'e' */
+    signed long long exp_adjust;
+
+    if (strit_next_match_inc(li,lie,'-'))
+        exp_adjust = -((signed long long)parse_dec_number(li,lie));
+    else if (strit_next_match_inc(li,lie,'+'))
+        exp_adjust =   (signed long long)parse_dec_number(li,lie);
+    else
+        exp_adjust =   (signed long long)parse_dec_number(li,lie);
+
+    if (exp_adjust != 0) {
+        long double m = 1;
+        while (exp_adjust <= -9) {
+            exp_adjust += 9;
+            m /= 1000000000;
+        }
+        while (exp_adjust < 0) {
+            exp_adjust++;
+            m /= 10;
+        }
+
+        while (exp_adjust >= 9) {
+            exp_adjust -= 9;
+            m *= 1000000000;
+        }
+        while (exp_adjust > 0) {
+            exp_adjust--;
+            m *= 10;
+        }
+
+        r *= m;
+    }
+}
+
+void parse_float_suffixes(token &r,string::iterator &li,const string::iterator lie) {
+    if (strit_next_match_inc(li,lie,'f'))
+        r.bsize = 32; /* float */
+    else if (strit_next_match_inc(li,lie,'F'))
+        r.bsize = 32; /* float */
+    else if (strit_next_match_inc(li,lie,'d'))
+        r.bsize = 64; /* double */
+    else if (strit_next_match_inc(li,lie,'D'))
+        r.bsize = 64; /* double */
+    else if (strit_next_match_inc(li,lie,'l'))
+        r.bsize = 80; /* long double */
+    else if (strit_next_match_inc(li,lie,'L'))
+        r.bsize = 80; /* long double */
+}
+
+void parse_int_suffixes(token &r,string::iterator &li,const string::iterator lie) {
+    if (strit_next_match_inc(li,lie,'u'))
+        r.i.sign = false;
+    else if (strit_next_match_inc(li,lie,'U'))
+        r.i.sign = false;
+
+    if (strit_next_match_inc(li,lie,'i','6','4'))
+        r.bsize = 64; /* long long */
+    else if (strit_next_match_inc(li,lie,'I','6','4'))
+        r.bsize = 64; /* long long */
+    else if (strit_next_match_inc(li,lie,'l','l'))
+        r.bsize = 64; /* long long */
+    else if (strit_next_match_inc(li,lie,'L','L'))
+        r.bsize = 64; /* long long */
+    else if (strit_next_match_inc(li,lie,'l'))
+        r.bsize = 32; /* long */
+    else if (strit_next_match_inc(li,lie,'L'))
+        r.bsize = 32; /* long */
+}
+
+token parse_hex_number_float_sub(string::iterator &li,const string::iterator lie) {
+    const unsigned long long tmp_msd = 0xfull << (64ull - 4ull);
+    unsigned long long tmp = 0;
+    int tmpshf = 64;
+    token r;
+
+    if (li != lie) {
+        while (li != lie && isxdigit(*li)) {
+            if (tmpshf >= 4) {
+                tmpshf -= 4;
+                tmp += ((unsigned long long)char2hex_assume(*li)) << (unsigned long long)tmpshf;
+            }
+
+            li++;
+        }
+    }
+
+    if (tmp != 0ull) { /* or else this will loop forever */
+        while ((tmp & tmp_msd) == 0ull) {
+            tmpshf += 4;
+            tmp <<= 4ull;
+        }
+
+        assert(tmpshf <= 64);
+    }
+
+    const int dpshf = tmpshf;
+
+    if (strit_next_match_inc(li,lie,'.')) {
+        while (li != lie && isxdigit(*li)) {
+            if (tmpshf >= 4) {
+                tmpshf -= 4;
+                tmp += ((unsigned long long)char2hex_assume(*li)) << (unsigned long long)tmpshf;
+            }
+
+            li++;
+        }
+    }
+
+    signed long long exponent = -dpshf;
+
+    /* FIXME: GCC behavior suggests the 'p' is mandatory. */
+    if (strit_next_match_inc(li,lie,'p'))
+        parse_float_hexponent(exponent,li,lie);
+    else if (strit_next_match_inc(li,lie,'P'))
+        parse_float_hexponent(exponent,li,lie);
+
+    r.tval = token::FLOAT;
+    r.f.fraction = tmp;
+    r.f.exponent = exponent;
+    return r;
+}
+
+long double parse_dec_number_float_sub(string::iterator &li,const string::iterator lie) {
+    long double r = 0;
+
+    if (li != lie) {
+        unsigned long long tmp = 0,tmpdiv = 1;
+
+        /* NTS: Process digits in batches to allow precision in integer math and reduce cumulative floating point error */
+        while (li != lie && isdigit(*li)) {
+            if (tmpdiv >= 100000000000ull) {
+                r = (r * tmpdiv) + tmp;
+                tmpdiv = 1;
+                tmp = 0;
+            }
+
+            tmp = (tmp * 10ull) + ((unsigned long long)(*(li++) - '0'));
+            tmpdiv *= 10ull;
+        }
+
+        if (tmpdiv > 1ull) {
+            r = (r * tmpdiv) + tmp;
+        }
+    }
+
+    if (li != lie && *li == '.') {
+        unsigned long long tmp = 0,tmpdiv = 1;
+        long double d = 1.0;
+
+        /* skip '.' */
+        li++;
+
+        /* NTS: Process digits in batches to allow precision in integer math and reduce cumulative floating point error */
+        while (li != lie && isdigit(*li)) {
+            if (tmpdiv >= 100000000000ull) {
+                d *= (signed long long)tmpdiv; /* only because on x86 there is only a signed divide by int */
+                r += tmp / d;
+                tmpdiv = 1;
+                tmp = 0;
+            }
+
+            tmp = (tmp * 10ull) + ((unsigned long long)(*(li++) - '0'));
+            tmpdiv *= 10ull;
+        }
+
+        if (tmpdiv > 1ull) {
+            d *= (signed long long)tmpdiv; /* only because on x86 there is only a signed divide by int */
+            r += tmp / d;
+        }
+    }
+
+    if (strit_next_match_inc(li,lie,'e'))
+        parse_float_exponent(r,li,lie);
+    else if (strit_next_match_inc(li,lie,'E'))
+        parse_float_exponent(r,li,lie);
+
+    return r;
+}
+
+void print_token(pp_context &ctx,FILE *fp,const token &t);
+
+bool parse_number_looks_like_float(string::iterator /*does not modify caller copy*/li,const string::iterator lie) {
+    if (strit_next_match_inc(li,lie,'0','x')) {
+        while (li != lie && isxdigit(*li)) li++;
+        if (li != lie) return (*li == '.' || *li == 'p' || *li == 'p');
+    }
+    else {
+        while (li != lie && isdigit(*li)) li++;
+        if (li != lie) return (*li == '.' || *li == 'e' || *li == 'E');
+    }
+
+    return false;
+}
+
+/* will return int or float */
+token parse_number(string::iterator &li,const string::iterator lie) {
+    token r;
+
+    /* at this point isdigit(*li) */
+    if (li == lie) throw invalid_argument("expected number, got end of line");
+    if (!isdigit(*li)) throw invalid_argument(string("expected number, got ") + *li);
+
+    if (parse_number_looks_like_float(li,lie)) {
+        if (strit_next_match_inc(li,lie,'0','x'))
+            r = parse_hex_number_float_sub(li,lie);
+        else
+            r = parse_dec_number_float_sub(li,lie);
+
+        parse_float_suffixes(r,li,lie);
+    }
+    else {
+        if (strit_next_match_inc(li,lie,'0')) {
+            if (strit_next_match_inc(li,lie,'x')) /* hexadecimal integer */
+                r = parse_hex_number(li,lie);
+            else /* octal */
+                r = parse_oct_number(li,lie);
+        }
+        else { /* integer */
+            r = parse_dec_number(li,lie);
+        }
+
+        parse_int_suffixes(r,li,lie);
+    }
+
+    return r;
+}
+
+stringref_t parse_string(pp_context &ctx,string::iterator &li,const string::iterator lie) {
+    /* at this point *li == '\"' */
+    string r;
+    char c;
+
+    if (li == lie) throw invalid_argument("expected string, got end of line");
+    if (*li != '\"') throw invalid_argument("expected string, got " + *li);
+    li++;
+
+    do {
+        if (li == lie) throw invalid_argument("string cut short, expected close quote");
+        if (*li == '\"') { li++; break; }
+        c = parse_string_char(li,lie);
+        r += c;
+    } while (1);
+
+    return ctx.string_store.add(r);
+}
+
+string parse_identifier(string::iterator &li,const string::iterator lie) {
+    string r;
+
+    if (li == lie) throw invalid_argument("expected identifier, got end of line");
+    if (!isidentifier_fc(*li)) throw invalid_argument("expected identifier");
+
+    do {
+        r += *(li++);
+        if (li == lie) break;
+        if (!isidentifier_mc(*li)) break;
+    } while (1);
+
+    return r;
+}
+
+/* standard C++ to_string() always prints 6 digits in GCC.
+ * we want more digits! */
+string a_better_float_to_string(const long double v) {
+    char tmp[40];
+
+    snprintf(tmp,sizeof(tmp),"%.40Lf",v); /* expect overprint, but snprintf to stop at 39 chars + NUL */
+    return tmp;
+}
+
+string to_string(pp_context &ctx,const token &t) {
+    switch (t.tval) {
+        case token::MACRO:
+            return string("[macro]") + t.sval + " ";
+        case token::PREPROC:
+            return "[preprocessordirective] ";
+        case token::MACROSUBST:
+            return string("[macrosubst]\"") + t.sval + "\" ";
+        case token::IDENTIFIER:
+            return string("[identifier]") + t.sval + " ";
         case token::MACROPARAM:
             return string("[macroparam]") + to_string(t.i.u) + " ";
         case token::INTEGER:
@@ -1631,7 +3643,7 @@ string to_string(const token &t) {
         case token::FLOAT:
             return a_better_float_to_string(t.f.get_double()) + " ";
         case token::STRING:
-            return string("\"") + string_store.get_char(t.s.strref) + string("\"") + " ";
+            return string("\"") + ctx.string_store.get_char(t.s.strref) + string("\"") + " ";
         case token::FUNCTIONCALL:
             return string("[functioncall]") + t.sval + " ";;
         case token::TYPECAST:
@@ -1809,1479 +3821,5421 @@ string to_string(const token &t) {
         case token::IF:
             return "if ";
         case token::INT:
-            return "int ";
+            return "int ";
+        case token::LONG:
+            return "long ";
+        case token::REGISTER:
+            return "register ";
+        case token::RETURN:
+            return "return ";
+        case token::SHORT:
+            return "short ";
+        case token::SIGNED:
+            return "signed ";
+        case token::STATIC:
+            return "static ";
+        case token::STRUCT:
+            return "struct ";
+        case token::SWITCH:
+            return "switch ";
+        case token::TYPEDEF:
+            return "typedef ";
+        case token::UNION:
+            return "union ";
+        case token::UNSIGNED:
+            return "unsigned ";
+        case token::VOID:
+            return "void ";
+        case token::VOLATILE:
+            return "volatile ";
+        case token::WHILE:
+            return "while ";
+        case token::STRINGIFY:
+            return "# ";
+        case token::TOKEN_PASTE:
+            return "## ";
+        case token::VA_ARGS:
+            return "__VA_ARGS__ ";
+        case token::VA_OPT:
+            return "__VA_OPT__ ";
+        case token::ELIF:
+            return "elif ";
+        case token::ENDIF:
+            return "endif ";
+        case token::DEFINED:
+            return "defined ";
+        case token::IFDEF:
+            return "ifdef ";
+        case token::IFNDEF:
+            return "ifndef ";
+        case token::DEFINE:
+            return "define ";
+        case token::UNDEF:
+            return "undef ";
+        case token::INCLUDE:
+            return "include ";
+        case token::LINE:
+            return "line ";
+        case token::ERROR:
+            return "error ";
+        case token::TERNARY:
+            return "[ternary] ";
+        case token::NONE:
+            return "[none] ";
+        default:
+            break;
+    };
+
+    return "? ";
+}
+
+string to_string_pp(pp_context &ctx,const token &t) {
+    switch (t.tval) {
+        case token::MACRO:
+            return t.sval + " ";
+        case token::PREPROC:
+            return "";
+        case token::MACROSUBST:
+            return t.sval + " ";
+        case token::IDENTIFIER:
+            return t.sval + " ";
+        case token::MACROPARAM:
+            return "";
+        case token::INTEGER:
+            return to_string(t.i.s) + " ";
+        case token::FLOAT:
+            return a_better_float_to_string(t.f.get_double()) + " ";
+        case token::STRING:
+            return string("\"") + ctx.string_store.get_char(t.s.strref) + string("\"") + " ";
+        default:
+            break;
+    };
+
+    return to_string(ctx,t);
+}
+
+void print_token(pp_context &ctx,FILE *fp,const token &t) {
+    if (fp == NULL)
+        fp = pp_stderr();
+
+    const string s = to_string(ctx,t);
+    fputs(s.c_str(),fp);
+}
+
+/* enables ctx.macro_ref_log for as long as it is in scope */
+class macro_ref_log_scope {
+public:
+                                macro_ref_log_scope(pp_context &c) : ctx(c) { }
+    ~macro_ref_log_scope() {
+        if (active) ctx.macro_ref_log = NULL;
+    }
+    void start(vector< pair<string,uint64_t> > &log) {
+        ctx.macro_ref_log = &log;
+        active = true;
+    }
+private:
+    pp_context&                 ctx;
+    bool                        active = false;
+};
+
+static constexpr size_t         pp_if_memo_max_per_location = 8;
+
+bool pp_if_memo_lookup(pp_context &ctx,const string &source,const int32_t lineno,bool &result) {
+    const auto mi = ctx.if_memo.find(make_pair(source,lineno));
+    if (mi == ctx.if_memo.end())
+        return false;
+
+    for (const auto &e : mi->second) {
+        bool match = true;
+
+        for (const auto &r : e.refs) {
+            if (macro_version(ctx,r.first) != r.second) {
+                match = false;
+                break;
+            }
+        }
+
+        if (match) {
+            result = e.result;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void pp_if_memo_store(pp_context &ctx,pp_if_program &prog,const bool result) {
+    if (!ctx.if_memo_pending.active)
+        return;
+
+    ctx.if_memo_pending.active = false;
+
+    auto &refs = ctx.if_memo_pending.refs;
+    sort(refs.begin(),refs.end());
+    refs.erase(unique(refs.begin(),refs.end()),refs.end());
+
+    auto &list = ctx.if_memo[make_pair(ctx.if_memo_pending.source,ctx.if_memo_pending.lineno)];
+    if (list.size() >= pp_if_memo_max_per_location)
+        list.erase(list.begin());
+
+    list.resize(list.size() + size_t(1));
+    list.back().refs = move(refs);
+    list.back().prog = move(prog);
+    list.back().result = result;
+}
+
+string do_macro_expand_read_invoke_param(string::iterator &li,const string::iterator lie,bool final_variadic=false) {
+    int paren = 0;
+    string r;
+
+    do {
+        if (li == lie)
+            throw invalid_argument("string terminated unexpectedly");
+        if (*li == '(') {
+            paren++;
+        }
+        else if (*li == ')') {
+            if (paren > 0)
+                paren--;
+            else
+                break;
+        }
+        else if (*li == ',' && !final_variadic) {
+            break;
+        }
+
+        r += *(li++);
+    } while (1);
+
+    return r;
+}
+
+static inline bool pp_stringify_needs_escape(const char c) {
+    return c == '\'' || c == '\"' || c == '\\';
+}
+
+/* length of the run of chars at the start of s that do not need escaping */
+static inline size_t pp_stringify_clean_run(const char *s,const size_t len) {
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i q1 = _mm_set1_epi8('\'');
+    const __m128i q2 = _mm_set1_epi8('\"');
+    const __m128i bs = _mm_set1_epi8('\\');
+
+    while ((i + size_t(16)) <= len) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        const __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v,q1),_mm_cmpeq_epi8(v,q2)),_mm_cmpeq_epi8(v,bs));
+        const unsigned int mask = (unsigned int)_mm_movemask_epi8(m);
+
+        if (mask != 0u)
+            return i + size_t(__builtin_ctz(mask));
+
+        i += size_t(16);
+    }
+#endif
+
+    while (i < len && !pp_stringify_needs_escape(s[i])) i++;
+    return i;
+}
+
+/* append s to dst as a quoted string, escaping quotes and backslashes.
+ * the worst case is allocated up front and clean runs are copied in bulk. */
+void pp_stringify_append(string &dst,const char *s,const size_t len) {
+    const size_t base = dst.size();
+
+    dst.resize(base + (len * size_t(2)) + size_t(2));
+
+    char *w = &dst[base];
+    size_t i = 0;
+
+    *w++ = '\"';
+    while (i < len) {
+        const size_t run = pp_stringify_clean_run(s + i,len - i);
+
+        memcpy(w,s + i,run);
+        w += run;
+        i += run;
+
+        if (i < len) {
+            *w++ = '\\';
+            *w++ = s[i++];
+        }
+    }
+    *w++ = '\"';
+
+    dst.resize(size_t(w - &dst[0]));
+}
+
+string pp_stringify(const string &s) {
+    string r;
+
+    pp_stringify_append(r,s.data(),s.size());
+    return r;
+}
+
+static inline bool pp_isspace(const char c) {
+    return c == ' ' || c == '\t';
+}
+
+static inline bool pp_paste_ispunct(const char c) {
+    return c != 0 && strchr("!%&*+-./:<=>^|#",c) != NULL;
+}
+
+/* punctuators that may legitimately result from a ## paste */
+static bool pp_paste_valid_punct(const string &p) {
+    static const char *valid[] = {
+        "->","++","--","<<",">>","<=",">=","==","!=","&&","||","+=","-=","*=","/=","%=",
+        "&=","^=","|=","<<=",">>=","##","...",NULL
+    };
+
+    for (const char **v=valid;*v != NULL;v++) {
+        if (p == *v)
+            return true;
+    }
+
+    return false;
+}
+
+/* first half of a ## paste: drop whitespace at the end of the left hand side, which
+ * starts at lstart. whitespace before it is kept. returns the seam, the offset where
+ * the right hand side will be appended */
+static size_t pp_paste_begin(string &fstr,const size_t lstart) {
+    size_t e = fstr.size();
+
+    while (e > lstart && pp_isspace(fstr[e-size_t(1)])) e--;
+    fstr.resize(e);
+
+    return e;
+}
+
+/* second half of a ## paste, after the right hand side has been appended at the seam.
+ * whitespace at the seam is dropped, and only the joined spelling of the two tokens
+ * around the seam is lexed to check that the result is a single token. the rest of
+ * the expansion is not looked at. */
+static void pp_paste_end(string &fstr,const size_t lstart,const size_t seam) {
+    size_t b = seam;
+
+    while (b < fstr.size() && pp_isspace(fstr[b])) b++;
+    if (b != seam) fstr.erase(seam,b - seam);
+
+    /* pasting with an empty argument is a no-op (placemarker) */
+    if (seam == lstart || seam >= fstr.size())
+        return;
+
+    const char lc = fstr[seam-size_t(1)];
+    const char rc = fstr[seam];
+
+    /* identifier or pp-number on the left, identifier chars on the right: one token */
+    if (isidentifier_mc(lc) && isidentifier_mc(rc))
+        return;
+    if ((isdigit(lc) || lc == '.') && rc == '.')
+        return;
+
+    /* encoding prefix on the left, string or character literal on the right */
+    if (rc == '\"' || rc == '\'') {
+        size_t lb = seam;
+
+        while (lb > lstart && isidentifier_mc(fstr[lb-size_t(1)])) lb--;
+
+        const string p = fstr.substr(lb,seam - lb);
+        if (p == "L" || p == "u" || p == "U" || p == "u8")
+            return;
+    }
+
+    if (pp_paste_ispunct(lc) && pp_paste_ispunct(rc)) {
+        size_t lb = seam,re = seam;
+
+        while (lb > size_t(0) && (seam - lb) < size_t(3) && pp_paste_ispunct(fstr[lb-size_t(1)])) lb--;
+        while (re < fstr.size() && (re - seam) < size_t(3) && pp_paste_ispunct(fstr[re])) re++;
+
+        if (pp_paste_valid_punct(fstr.substr(lb,re - lb)))
+            return;
+    }
+
+    fprintf(pp_stderr(),"WARNING: pasting \"%c\" and \"%c\" does not give a valid preprocessing token\n",lc,rc);
+}
+
+void parse_tokens(pp_context &ctx,token_string &tokens,const string::iterator lib,const string::iterator lie,const int32_t lineno,const string &source);
+
+static inline bool do_macro_expand_val(string &fstr,vector<token>::const_iterator &si,const vector<token>::const_iterator sie,const vector<string> &param,const macro_t &macro,const bool variadic_given) {
+    if (si == sie)
+        throw runtime_error("do_macro_expand_val started with iterator == end");
+
+    if ((*si).tval == token::MACROSUBST) {
+        fstr += (*si).sval;
+        si++;
+        return true;
+    }
+    else if ((*si).tval == token::MACROPARAM) {
+        if ((*si).i.u >= (unsigned long long)param.size())
+            throw invalid_argument("macro parameter index out of range");
+
+        fstr += param[size_t((*si).i.u)];
+        si++;
+        return true;
+    }
+    else if ((*si).tval == token::VA_ARGS) {
+        if (!param.empty() && macro.last_param_variadic && macro.last_param_optional)
+            fstr += param[param.size() - size_t(1)];
+
+        si++;
+        return true;
+    }
+    else if ((*si).tval == token::VA_OPT) {
+        si++;
+
+        if (si == sie)
+            throw invalid_argument("__VA_OPT__ must be followed by (");
+        if ((*si).tval != token::OPEN_PARENS)
+            throw invalid_argument("__VA_OPT__ must be followed by (");
+        si++;
+
+        if (si == sie)
+            throw invalid_argument("__VA_OPT__ must be followed by something to expand to");
+        if ((*si).tval != token::MACROSUBST)
+            throw invalid_argument("__VA_OPT__ must be followed by something to expand to");
+        if (variadic_given)
+            fstr += (*si).sval;
+        si++;
+
+        if (si == sie)
+            throw invalid_argument("__VA_OPT__ must be followed by )");
+        if ((*si).tval != token::CLOSE_PARENS)
+            throw invalid_argument("__VA_OPT__ must be followed by )");
+        si++;
+        return true;
+    }
+
+    return false;
+}
+
+void do_macro_expand(pp_context &ctx,token_string &tokens,const string &ident,string::iterator &li,const string::iterator lie,const int32_t lineno,const string &source) {
+    macro_t *mp = macro_find(ctx,ident);
+    if (mp != NULL) {
+        const uint64_t stats_start_ns = ctx.opt.macro_stats_file.empty() ? 0ull : pp_monotonic_ns();
+        const size_t stats_start_tokens = tokens.size();
+        const unsigned int outer_peak = ctx.budget.expand_peak;
+        macro_t &macro = *mp;
+
+        ctx.budget.expand_peak = 0; /* arguments and the rescan both count */
+
+        macro.materialize(ctx);
+        bool variadic_given = false;
+        vector<string> param;
+        string fstr;
+
+        if (macro.parens) {
+            parse_skip_whitespace(li,lie);
+            if (strit_next_match_inc(li,lie,'(')) {
+                do {
+                    bool variad = macro.last_param_variadic && (param.size()+size_t(1)) == macro.param.size();
+
+                    if (variad)
+                        variadic_given = variad;
+
+                    parse_skip_whitespace(li,lie);
+                    if (li == lie) throw invalid_argument("macro invocation parameter list ended suddenly");
+                    if (strit_next_match_inc(li,lie,')')) break;
+
+                    if (param.size() >= macro.param.size())
+                        throw invalid_argument("macro invocation parameter list with too many parameters");
+                    param.push_back(do_macro_expand_read_invoke_param(li,lie,variad));
+
+                    parse_skip_whitespace(li,lie);
+                    if (li == lie) throw invalid_argument("macro invocation parameter list ended suddenly");
+                    if (strit_next_match_inc(li,lie,')'))
+                        break;
+                    else if (!strit_next_match_inc(li,lie,','))
+                        throw invalid_argument(string("macro invocation parameter list unexpected char ") + *li);
+                } while(1);
+
+                /* enforce required param count. the one for the variadic macro is not required to be present. */
+                size_t reqd_params = macro.param.size();
+                if (macro.last_param_variadic && macro.last_param_optional && reqd_params != size_t(0)) reqd_params--;
+                if (param.size() < reqd_params)
+                    throw invalid_argument("macro invocation parameter list has too few parameters");
+
+                /* fill in the rest with blank */
+                while (param.size() < macro.param.size())
+                    param.push_back(string());
+
+                parse_skip_whitespace(li,lie);
+            }
+            else {
+                throw invalid_argument("macro invoked without parenthesis when defined with parameters");
+            }
+        }
+
+        string tmpr;
+
+        for (vector<token>::const_iterator si=macro.subst.begin();si!=macro.subst.end();) {
+            const size_t lstart = fstr.size(); /* where the left hand side of a ## starts */
+
+            if (do_macro_expand_val(fstr,si,macro.subst.end(),param,macro,variadic_given)) {
+                while (si != macro.subst.end() && (*si).tval == token::TOKEN_PASTE) {
+                    si++;
+                    if (si == macro.subst.end())
+                        throw invalid_argument("token paste must be followed by another token");
+
+                    const size_t seam = pp_paste_begin(fstr,lstart);
+                    if (!do_macro_expand_val(fstr,si,macro.subst.end(),param,macro,variadic_given))
+                        throw invalid_argument("token paste was not followed by expandable value");
+                    pp_paste_end(fstr,lstart,seam);
+                }
+
+                if (si != macro.subst.end())
+                    fstr += " ";
+            }
+            else if ((*si).tval == token::STRINGIFY) {
+                si++;
+                if (si == macro.subst.end())
+                    throw invalid_argument("macro stringify with nothing to stringify");
+
+                tmpr.clear();
+                if (!do_macro_expand_val(tmpr,si,macro.subst.end(),param,macro,variadic_given))
+                    throw invalid_argument("stringify was not followed by expandable value");
+
+                if (!tmpr.empty()) {
+                    pp_stringify_append(fstr,tmpr.data(),tmpr.size());
+                    fstr += ' ';
+                }
+            }
+            else if ((*si).tval == token::COMMA) {
+                si++;
+                auto si2 = si;
+                if (si2 != macro.subst.end() && (*si2).tval == token::TOKEN_PASTE) { /* , ## */
+                    si2++;
+                    if (si2 != macro.subst.end() && (*si2).tval == token::VA_ARGS) { /* , ## __VA_ARGS__ */
+                        si = si2;
+
+                        if (variadic_given) {
+                            fstr += ",";
+                            do_macro_expand_val(fstr,si,macro.subst.end(),param,macro,variadic_given);
+                        }
+                        else {
+                            si++;
+                        }
+
+                        continue;
+                    }
+                }
+
+                fstr += ",";
+            }
+            else {
+                throw invalid_argument("unexpected token in macro expansion");
+            }
+        }
+
+        ctx.budget.check_expand_depth(++ctx.budget.expand_depth);
+        if (ctx.budget.expand_peak < ctx.budget.expand_depth)
+            ctx.budget.expand_peak = ctx.budget.expand_depth;
+        ctx.budget.check_time();
+        try {
+            parse_tokens(ctx,tokens,fstr.begin(),fstr.end(),lineno,source);
+        }
+        catch (...) {
+            ctx.budget.expand_depth--;
+            throw;
+        }
+
+        if (stats_start_ns != 0ull) {
+            macro_stats_t &st = ctx.macro_stats[ident];
+
+            st.calls++;
+            st.tokens += uint64_t(tokens.size() - stats_start_tokens);
+            st.time_ns += pp_monotonic_ns() - stats_start_ns;
+            if (st.max_depth < ctx.budget.expand_peak)
+                st.max_depth = ctx.budget.expand_peak;
+            if (st.def_line != macro.def_line || st.def_source != macro.def_source) {
+                st.def_source = macro.def_source;
+                st.def_line = macro.def_line;
+            }
+        }
+
+        ctx.budget.expand_depth--;
+        if (ctx.budget.expand_peak < outer_peak)
+            ctx.budget.expand_peak = outer_peak;
+        ctx.budget.check_line_tokens(tokens.size());
+    }
+}
+
+void parse_tokens_define(token_string &tokens,string::iterator &li,const string::iterator lie,const int32_t lineno,const string &source) {
+    vector<string> params;
+
+    (void)lineno;
+    (void)source;
+
+    /* parens must follow #define with no space */
+    if (strit_next_match_inc(li,lie,'(')) {
+        /* (params)
+         *
+         * params =
+         * params = identifier
+         * params = identifier identifier
+         * params = identifier ... */
+        tokens.push_back(token::OPEN_PARENS);
+        parse_skip_whitespace(li,lie);
+        while (1) {
+            if (li == lie) {
+                throw invalid_argument("macro param list ended without closing parens");
+            }
+            else if (strit_next_match_inc(li,lie,')')) {
+                tokens.push_back(token::CLOSE_PARENS);
+                break;
+            }
+            else if (strit_next_match_inc(li,lie,',')) {
+                tokens.push_back(token::COMMA);
+            }
+            else if (strit_next_match_inc(li,lie,'.','.','.')) {
+                tokens.push_back(token::DOTDOTDOT);
+            }
+            else if (isidentifier_fc(*li)) {
+                string ident = parse_identifier(li,lie); /* will throw exception otherwise */
+                tokens.push_back(move(token(token::IDENTIFIER,ident)));
+                params.push_back(ident);
+            }
+            else {
+                throw invalid_argument(string("macro param list has unexpected char ") + (*li));
+            }
+
+            parse_skip_whitespace(li,lie);
+        }
+    }
+
+    /* the body is kept as raw text, it is tokenized by macro_t::materialize() the
+     * first time the macro is expanded. most macros in big headers never are. */
+    parse_skip_whitespace(li,lie);
+    if (li != lie) {
+        auto be = lie;
+
+        while (be != li && (*(be-1) == ' ' || *(be-1) == '\t')) be--;
+        tokens.push_back(move(token(token::MACRO,string(li,be))));
+        li = lie;
+    }
+}
+
+void parse_macro_body(token_string &tokens,string::iterator &li,const string::iterator lie,const vector<string> &params) {
+    string r;
+
+    parse_skip_whitespace(li,lie);
+
+    while (li != lie) {
+        if (strit_next_match_inc(li,lie,'#','#')) {
+            if (!r.empty()) {
+                tokens.push_back(move(token(token::MACROSUBST,r)));
+                r.clear();
+            }
+            tokens.push_back(token::TOKEN_PASTE);
+        }
+        else if (strit_next_match_inc(li,lie,'#')) {
+            if (!r.empty()) {
+                tokens.push_back(move(token(token::MACROSUBST,r)));
+                r.clear();
+            }
+            tokens.push_back(token::STRINGIFY);
+        }
+        else if (strit_next_match_inc(li,lie,',')) {
+            if (!r.empty()) {
+                tokens.push_back(move(token(token::MACROSUBST,r)));
+                r.clear();
+            }
+            tokens.push_back(token::COMMA);
+        }
+        else if (isidentifier_fc(*li)) {
+            string ident = parse_identifier(li,lie); /* will throw exception otherwise */
+
+            auto paridx = find(params.begin(),params.end(),ident);
+            if (paridx != params.end()) {
+                if (!r.empty()) {
+                    tokens.push_back(move(token(token::MACROSUBST,r)));
+                    r.clear();
+                }
+                tokens.push_back(move(token(token::MACROPARAM,(unsigned long long)(paridx - params.begin()))));
+            }
+            else if (ident == "__VA_ARGS__") {
+                if (!r.empty()) {
+                    tokens.push_back(move(token(token::MACROSUBST,r)));
+                    r.clear();
+                }
+                tokens.push_back(token::VA_ARGS);
+            }
+            else if (ident == "__VA_OPT__") {
+                if (!r.empty()) {
+                    tokens.push_back(move(token(token::MACROSUBST,r)));
+                    r.clear();
+                }
+                tokens.push_back(token::VA_OPT);
+                parse_skip_whitespace(li,lie);
+                if (strit_next_match_inc(li,lie,'(')) {
+                    int parens = 1;
+
+                    tokens.push_back(token::OPEN_PARENS);
+                    while (li != lie) {
+                        if (*li == '(')
+                            parens++;
+                        else if (*li == ')') {
+                            parens--;
+                            if (parens == 0) {
+                                tokens.push_back(move(token(token::MACROSUBST,r)));
+                                tokens.push_back(token::CLOSE_PARENS);
+                                r.clear();
+                                li++;
+                                break;
+                            }
+                        }
+
+                        r += *li++;
+                    }
+
+                    if (parens != 0)
+                        throw invalid_argument("Mismatched __VA_OPT__ parens");
+                }
+            }
+            else {
+                r += ident;
+            }
+        }
+        else if (*li == ' ' && r.empty()) {
+            li++; /* ignore */
+        }
+        else {
+            r += *(li++);
+        }
+    }
+
+    if (!r.empty()) {
+        tokens.push_back(move(token(token::MACROSUBST,r)));
+        r.clear();
+    }
+}
+
+void macro_t::materialize(pp_context &ctx) {
+    if (body_parsed)
+        return;
+
+    /* __VA_ARGS__ is matched as a keyword, not as a named parameter */
+    vector<string> names(param);
+    if (last_param_variadic && last_param_optional && !names.empty())
+        names.pop_back();
+
+    subst.clear();
+    auto li = body.begin();
+    parse_macro_body(subst,li,body.end(),names);
+
+    /* the tokens from here are MACROSUBST, MACROPARAM, __VA_ARGS__, __VA_OPT__ ( MACROSUBST ), STRINGIFY, AND TOKEN_PASTE.
+     * There will never be an IDENTIFIER because the parameter matching has already been done. */
+    for (const auto &t : subst) {
+        if (t.tval == token::MACROPARAM) {
+            if (t.i.u >= (unsigned long long)param.size()) throw runtime_error("macro param out of range");
+        }
+        else if (!(t.tval == token::MACROSUBST ||
+                   t.tval == token::VA_ARGS ||
+                   t.tval == token::VA_OPT ||
+                   t.tval == token::COMMA ||
+                   t.tval == token::STRINGIFY ||
+                   t.tval == token::TOKEN_PASTE ||
+                   t.tval == token::OPEN_PARENS ||
+                   t.tval == token::CLOSE_PARENS)) {
+            throw invalid_argument(string("unexpected token in the body of a macro ") + to_string(ctx,t));
+        }
+    }
+
+    body_parsed = true;
+}
+
+void parse_tokens(pp_context &ctx,token_string &tokens,const string::iterator lib,const string::iterator lie,const int32_t lineno,const string &source) {
+    auto li = lib;
+
+    (void)lineno;
+    (void)source;
+
+    bool macro_expand = true;
+    bool is_pp = false;
+    macro_ref_log_scope ref_log(ctx);
+
+    /* initial whitespace skip */
+    parse_skip_whitespace(li,lie);
+    if (li == lie) return;
+
+    /* li != lie */
+    if (*li == '#') {
+        /* preprocessor handling */
+        li++;
+        parse_skip_whitespace(li,lie);
+        /* expect identifier, or else */
+        tokens.push_back(token::PREPROC);
+        is_pp = true;
+
+        {
+            string ident = parse_identifier(li,lie); /* will throw exception otherwise */
+            enum token::token_t tk;
+
+            if ((tk=is_pp_keyword(ident)) != token::NONE) {
+                tokens.push_back(tk);
+
+                switch (tk) {
+                    case token::IFDEF:
+                    case token::IFNDEF:
+                    case token::DEFINE:
+                    case token::UNDEF:
+                        parse_skip_whitespace(li,lie);
+                        ident = parse_identifier(li,lie);
+                        tokens.push_back(move(token(token::IDENTIFIER,ident)));
+                        macro_expand = false;
+                        break;
+                    case token::ENDIF:
+                    case token::ELSE:
+                        macro_expand = false;
+                        break;
+                    default:
+                        break;
+                };
+
+                if (tk == token::DEFINE) {
+                    parse_tokens_define(tokens,li,lie,lineno,source);
+                    return;
+                }
+                else if (tk == token::INCLUDE) {
+                    /* "name" and <name> are taken as is, no escapes. anything else is macro expanded */
+                    parse_skip_whitespace(li,lie);
+                    if (li != lie && (*li == '\"' || *li == '<')) {
+                        const bool angled = (*li == '<');
+                        const char close = angled ? '>' : '\"';
+                        const auto nb = ++li;
+
+                        while (li != lie && *li != close) li++;
+                        if (li == lie)
+                            throw invalid_argument("#include missing terminating character");
+
+                        const string name(nb,li);
+                        li++;
+
+                        if (angled) tokens.push_back(token::LESS_THAN);
+                        tokens.push_back(token(ctx.string_store.add(name)));
+                        if (angled) tokens.push_back(token::GREATER_THAN);
+                        macro_expand = false;
+                    }
+                }
+                else if (tk == token::IF || tk == token::ELIF) {
+                    ctx.if_memo_pending.active = false;
+
+                    /* #elif whose result cannot matter, see accept_tokens() */
+                    if (tk == token::ELIF && !ctx.cond_stack.empty() && (!ctx.cond_stack.top().pcond || ctx.cond_stack.top().cond))
+                        return;
+
+                    /* seen this directive before with the same macro definitions? skip expansion and evaluation */
+                    bool r;
+                    if (pp_if_memo_lookup(ctx,source,lineno,r)) {
+                        tokens.push_back(token((long long)(r ? 1 : 0)));
+                        return;
+                    }
+
+                    ctx.if_memo_pending.active = true;
+                    ctx.if_memo_pending.source = source;
+                    ctx.if_memo_pending.lineno = lineno;
+                    ctx.if_memo_pending.refs.clear();
+                    ref_log.start(ctx.if_memo_pending.refs);
+                }
+            }
+            else {
+                throw invalid_argument(string("Invalid preprocessor directive ") + ident);
+            }
+        }
+
+        parse_skip_whitespace(li,lie);
+    }
+
+    /* general parsing. expects code to skip whitespace after doing it's part */
+    while (li != lie) {
+        if (*li == '\"')
+            tokens.push_back(move(parse_string(ctx,li,lie)));
+        else if (*li == '\'')
+            tokens.push_back(move(parse_sq_char(li,lie)));
+        else if (strit_next_match_inc(li,lie,'.','.','.'))
+            tokens.push_back(token::DOTDOTDOT);
+        else if (strit_next_match_inc(li,lie,'.'))
+            tokens.push_back(token::PERIOD);
+        else if (strit_next_match_inc(li,lie,','))
+            tokens.push_back(token::COMMA);
+        else if (strit_next_match_inc(li,lie,'<','<','='))
+            tokens.push_back(token::LEFT_SHIFT_EQUALS);
+        else if (strit_next_match_inc(li,lie,'<','<'))
+            tokens.push_back(token::LEFT_SHIFT);
+        else if (strit_next_match_inc(li,lie,'<','='))
+            tokens.push_back(token::LESS_THAN_OR_EQUAL);
+        else if (strit_next_match_inc(li,lie,'<'))
+            tokens.push_back(token::LESS_THAN);
+        else if (strit_next_match_inc(li,lie,'>','>','='))
+            tokens.push_back(token::RIGHT_SHIFT_EQUALS);
+        else if (strit_next_match_inc(li,lie,'>','>'))
+            tokens.push_back(token::RIGHT_SHIFT);
+        else if (strit_next_match_inc(li,lie,'>','='))
+            tokens.push_back(token::GREATER_THAN_OR_EQUAL);
+        else if (strit_next_match_inc(li,lie,'>'))
+            tokens.push_back(token::GREATER_THAN);
+        else if (strit_next_match_inc(li,lie,'-','>'))
+            tokens.push_back(token::PTRARROW);
+        else if (strit_next_match_inc(li,lie,'-','-'))
+            tokens.push_back(token::DECREMENT);
+        else if (strit_next_match_inc(li,lie,'-','='))
+            tokens.push_back(token::MINUS_EQUALS);
+        else if (strit_next_match_inc(li,lie,'-'))
+            tokens.push_back(token::MINUS);
+        else if (strit_next_match_inc(li,lie,'+','+'))
+            tokens.push_back(token::INCREMENT);
+        else if (strit_next_match_inc(li,lie,'+','='))
+            tokens.push_back(token::PLUS_EQUALS);
+        else if (strit_next_match_inc(li,lie,'+'))
+            tokens.push_back(token::PLUS);
+        else if (strit_next_match_inc(li,lie,'=','='))
+            tokens.push_back(token::EQUALS);
+        else if (strit_next_match_inc(li,lie,'='))
+            tokens.push_back(token::ASSIGNMENT);
+        else if (strit_next_match_inc(li,lie,'~'))
+            tokens.push_back(token::COMPLEMENT);
+        else if (strit_next_match_inc(li,lie,'^','='))
+            tokens.push_back(token::XOR_EQUALS);
+        else if (strit_next_match_inc(li,lie,'^'))
+            tokens.push_back(token::CARET);
+        else if (strit_next_match_inc(li,lie,'?'))
+            tokens.push_back(token::QUESTIONMARK);
+        else if (strit_next_match_inc(li,lie,':'))
+            tokens.push_back(token::COLON);
+        else if (strit_next_match_inc(li,lie,'|','|'))
+            tokens.push_back(token::LOGICAL_OR);
+        else if (strit_next_match_inc(li,lie,'|','='))
+            tokens.push_back(token::OR_EQUALS);
+        else if (strit_next_match_inc(li,lie,'|'))
+            tokens.push_back(token::PIPE);
+        else if (strit_next_match_inc(li,lie,'!','='))
+            tokens.push_back(token::NOT_EQUALS);
+        else if (strit_next_match_inc(li,lie,'!'))
+            tokens.push_back(token::NOT);
+        else if (strit_next_match_inc(li,lie,'&','&'))
+            tokens.push_back(token::LOGICAL_AND);
+        else if (strit_next_match_inc(li,lie,'&','='))
+            tokens.push_back(token::AND_EQUALS);
+        else if (strit_next_match_inc(li,lie,'&'))
+            tokens.push_back(token::AMPERSAND);
+        else if (strit_next_match_inc(li,lie,'*','='))
+            tokens.push_back(token::MULTIPLY_EQUALS);
+        else if (strit_next_match_inc(li,lie,'*'))
+            tokens.push_back(token::STAR);
+        else if (strit_next_match_inc(li,lie,'/','='))
+            tokens.push_back(token::DIVIDE_EQUALS);
+        else if (strit_next_match_inc(li,lie,'/'))
+            tokens.push_back(token::DIVISION);
+        else if (strit_next_match_inc(li,lie,'%','='))
+            tokens.push_back(token::MODULUS_EQUALS);
+        else if (strit_next_match_inc(li,lie,'%'))
+            tokens.push_back(token::MODULUS);
+        else if (strit_next_match_inc(li,lie,'('))
+            tokens.push_back(token::OPEN_PARENS);
+        else if (strit_next_match_inc(li,lie,')'))
+            tokens.push_back(token::CLOSE_PARENS);
+        else if (strit_next_match_inc(li,lie,'['))
+            tokens.push_back(token::OPEN_SBRACKET);
+        else if (strit_next_match_inc(li,lie,']'))
+            tokens.push_back(token::CLOSE_SBRACKET);
+        else if (strit_next_match_inc(li,lie,'{'))
+            tokens.push_back(token::OPEN_CBRACKET);
+        else if (strit_next_match_inc(li,lie,'}'))
+            tokens.push_back(token::CLOSE_CBRACKET);
+        else if (strit_next_match_inc(li,lie,'#','#'))
+            tokens.push_back(token::TOKEN_PASTE);
+        else if (strit_next_match_inc(li,lie,'#'))
+            tokens.push_back(token::STRINGIFY);
+        else if (isdigit(*li))
+            tokens.push_back(move(parse_number(li,lie)));
+        else if (isidentifier_fc(*li)) {
+            string ident = parse_identifier(li,lie); /* will throw exception otherwise */
+            enum token::token_t tk;
+
+            if (is_pp && (tk=is_pp_keyword(ident)) != token::NONE) {
+                tokens.push_back(tk);
+
+                if (tk == token::DEFINED) {
+                    string macro;
+                    int parens = 0;
+
+                    /* macro name must be preserved, do not expand, so the test can be done properly.
+                     * we allow defined x or defined(x) */
+                    parse_skip_whitespace(li,lie);
+                    while (strit_next_match_inc(li,lie,'(')) {
+                        parens++;
+                        parse_skip_whitespace(li,lie);
+                    }
+
+                    macro = parse_identifier(li,lie);
+                    parse_skip_whitespace(li,lie);
+                    tokens.push_back(move(token(token::IDENTIFIER,macro)));
+                    (void)is_macro(ctx,macro); /* so the #if memo records the reference */
+
+                    while (parens > 0) {
+                        if (!strit_next_match_inc(li,lie,')'))
+                            throw invalid_argument("defined() with mismatched parameters");
+
+                        parse_skip_whitespace(li,lie);
+                        parens--;
+                    }
+                }
+            }
+            else if ((tk=is_keyword(ident)) != token::NONE)
+                tokens.push_back(tk);
+            else if (macro_expand && is_macro(ctx,ident))
+                do_macro_expand(ctx,tokens,ident,li,lie,lineno,source);
+            else
+                tokens.push_back(move(token(token::IDENTIFIER,ident)));
+        }
+        else {
+            throw invalid_argument(string("token parser unexpected char ") + *li);
+        }
+
+        parse_skip_whitespace(li,lie);
+    }
+}
+
+static inline bool tokenit_next_match_inc(token_string::iterator &ti,const token_string::iterator tie,const token::token_t c) {
+    if (ti != tie && (*ti).tval == c) {
+        ti++;
+        return true;
+    }
+
+    return false;
+}
+
+const string &tokenit_next_identifier(token_string::iterator &ti,const token_string::iterator tie) {
+    if (ti != tie) {
+        const auto &t = *(ti++);
+        if (t.tval == token::IDENTIFIER)
+            return t.sval;
+    }
+
+    throw invalid_argument("identifier token expected");
+}
+
+bool pp_pass(pp_context &ctx) {
+    if (!ctx.cond_stack.empty())
+        return ctx.cond_stack.top().eval();
+
+    return true;
+}
+
+/* expression tree. nodes and their child links live in two flat arrays that are
+ * reset, not freed, between expressions so that the storage is reused from one
+ * directive to the next. */
+class expression {
+    public:
+        class node {
+            public:
+                using node_t = size_t;
+                static constexpr node_t none = ~node_t(0u);
+            public:
+                token                   tval = token::NONE;
+                size_t                  child_first = 0;    /* range in childlist */
+                size_t                  child_count = 0;
+        };
+    public:
+        vector<node>                    nodelist;   /* only the first nodes_used are valid */
+        vector<node::node_t>            childlist;
+        size_t                          nodes_used = 0;
+        node::node_t                    root = node::none;
+    public:
+        void                            clear();
+        node::node_t                    newnode();
+        node::node_t                    newnode(const token &nt);
+        node::node_t                    newnode(const token &nt,const token::token_t ntval);
+        void                            setchildren(const node::node_t n,const initializer_list<node::node_t> c);
+        void                            setchildren(const node::node_t n,const vector<node::node_t> &c);
+        void                            setchildren(const node::node_t n,const node::node_t first,const size_t count,const node::node_t last);
+    public:
+        /* pending operators while parsing, see parse_expr() */
+        struct parse_frame {
+            enum kind_t {
+                PREFIX,         /* opnode waits for its operand */
+                BINARY,         /* opnode waits for the right hand side of head */
+                TERNARY_T,      /* opnode waits for the true expression */
+                TERNARY_F,      /* opnode waits for the false expression */
+                TYPECAST,       /* opnode waits for the expression, type nodes follow opnode */
+                SUBEXPR         /* waiting for the closing parens */
+            };
+            kind_t                      kind;
+            unsigned int                min_prec;   /* of the enclosing parse, to continue with */
+            node::node_t                opnode;
+            node::node_t                head;
+            node::node_t                tnode;
+            size_t                      count;
+        };
+        vector<parse_frame>             parse_stack;
+    public:
+        inline node& getnode(const node::node_t &n) {
+            if (n < nodes_used)
+                return nodelist[n];
+            else
+                throw runtime_error("node out of range");
+        }
+        inline const node& getnode(const node::node_t &n) const {
+            if (n < nodes_used)
+                return nodelist[n];
+            else
+                throw runtime_error("node out of range");
+        }
+        inline node::node_t child(const node &n,const size_t i) const {
+            if (i < n.child_count)
+                return childlist[n.child_first+i];
+            else
+                throw runtime_error("child out of range");
+        }
+};
+
+void expression::clear() {
+    nodes_used = 0;
+    childlist.clear();
+    parse_stack.clear();
+    root = node::none;
+}
+
+expression::node::node_t expression::newnode() {
+    const node::node_t r = nodes_used++;
+
+    if (r < nodelist.size()) {
+        nodelist[r].tval = token::NONE;
+        nodelist[r].child_first = nodelist[r].child_count = 0;
+    }
+    else {
+        nodelist.resize(r+size_t(1));
+    }
+
+    return r;
+}
+
+expression::node::node_t expression::newnode(const token &nt) {
+    const node::node_t r = newnode();
+    nodelist[r].tval = nt;
+    return r;
+}
+
+expression::node::node_t expression::newnode(const token &nt,const token::token_t ntval) {
+    const node::node_t r = newnode();
+    nodelist[r].tval = nt;
+    nodelist[r].tval.tval = ntval;
+    return r;
+}
+
+void expression::setchildren(const node::node_t n,const initializer_list<node::node_t> c) {
+    node &nd = getnode(n);
+    nd.child_first = childlist.size();
+    nd.child_count = c.size();
+    childlist.insert(childlist.end(),c.begin(),c.end());
+}
+
+void expression::setchildren(const node::node_t n,const vector<node::node_t> &c) {
+    node &nd = getnode(n);
+    nd.child_first = childlist.size();
+    nd.child_count = c.size();
+    childlist.insert(childlist.end(),c.begin(),c.end());
+}
+
+/* children first, first+1, ... first+count-1 and then last */
+void expression::setchildren(const node::node_t n,const node::node_t first,const size_t count,const node::node_t last) {
+    node &nd = getnode(n);
+    nd.child_first = childlist.size();
+    nd.child_count = count + size_t(1);
+    for (size_t i=0;i < count;i++)
+        childlist.push_back(first+i);
+    childlist.push_back(last);
+}
+
+bool is_type_token(token::token_t &repl,const token &t) {
+    switch (t.tval) {
+        case token::INT:
+        case token::CHAR:
         case token::LONG:
-            return "long ";
-        case token::REGISTER:
-            return "register ";
-        case token::RETURN:
-            return "return ";
         case token::SHORT:
-            return "short ";
+        case token::CONST:
         case token::SIGNED:
-            return "signed ";
-        case token::STATIC:
-            return "static ";
-        case token::STRUCT:
-            return "struct ";
-        case token::SWITCH:
-            return "switch ";
-        case token::TYPEDEF:
-            return "typedef ";
-        case token::UNION:
-            return "union ";
         case token::UNSIGNED:
-            return "unsigned ";
-        case token::VOID:
-            return "void ";
-        case token::VOLATILE:
-            return "volatile ";
-        case token::WHILE:
-            return "while ";
-        case token::STRINGIFY:
-            return "# ";
-        case token::TOKEN_PASTE:
-            return "## ";
-        case token::VA_ARGS:
-            return "__VA_ARGS__ ";
-        case token::VA_OPT:
-            return "__VA_OPT__ ";
-        case token::ELIF:
-            return "elif ";
-        case token::ENDIF:
-            return "endif ";
-        case token::DEFINED:
-            return "defined ";
-        case token::IFDEF:
-            return "ifdef ";
-        case token::IFNDEF:
-            return "ifndef ";
-        case token::DEFINE:
-            return "define ";
-        case token::UNDEF:
-            return "undef ";
-        case token::INCLUDE:
-            return "include ";
-        case token::LINE:
-            return "line ";
-        case token::ERROR:
-            return "error ";
-        case token::TERNARY:
-            return "[ternary] ";
-        case token::NONE:
-            return "[none] ";
+            repl = t.tval;
+            return true;
+        case token::AMPERSAND:
+            repl = token::ADDRESSOF;
+            return true;
+        case token::STAR:
+            repl = token::DEREFERENCE;
+            return true;
         default:
             break;
     };
 
-    return "? ";
+    return false;
+}
+
+/* "(type)" at ti. The type nodes are created right after the returned node and their count is
+ * returned in ntypes. For a TYPESPEC they are made its children. For a TYPECAST the caller
+ * parses the expression that follows and links the children once it has it. */
+expression::node::node_t parse_expr_typecast(expression &expr,token_string::iterator &ti,const token_string::iterator &tie,const bool exprfollow,size_t &ntypes) {
+    token::token_t repl;
+    auto tmpti = ti;
+
+    if (tmpti != tie && (*tmpti).tval == token::OPEN_PARENS) {
+        tmpti++;
+        if (tmpti != tie && is_type_token(/*&*/repl,*tmpti)) {
+            ti = tmpti;
+
+            const expression::node::node_t opnode = expr.newnode(exprfollow ? token::TYPECAST : token::TYPESPEC);
+            vector<expression::node::node_t> children;
+
+            /* NTS: Treat LOGICAL_AND as if two ADDRESSOF so && works properly here */
+            while (ti != tie && (is_type_token(/*&*/repl,*ti) || (*ti).tval == token::LOGICAL_AND)) {
+                if ((*ti).tval == token::LOGICAL_AND) {
+                    children.push_back(expr.newnode(token::ADDRESSOF));
+                    children.push_back(expr.newnode(token::ADDRESSOF));
+                    ti++;
+                }
+                else {
+                    children.push_back(expr.newnode(*(ti++),repl));
+                }
+            }
+
+            if (ti == tie)
+                throw invalid_argument("missing closing parens");
+            if ((*ti).tval != token::CLOSE_PARENS)
+                throw invalid_argument("missing closing parens");
+            ti++;
+
+            ntypes = children.size();
+            if (!exprfollow)
+                expr.setchildren(opnode,children);
+
+            return opnode;
+        }
+    }
+
+    return expression::node::none;
+}
+
+expression::node::node_t parse_expr_sizeof(expression &expr,token_string::iterator &ti,const token_string::iterator &tie) {
+    if (ti != tie && (*ti).tval == token::SIZEOF) {
+        ti++;
+
+        const expression::node::node_t opnode = expr.newnode(token::SIZEOF);
+
+        expression::node::node_t arg;
+        size_t ntypes;
+        if (ti != tie && (*ti).tval == token::OPEN_PARENS) {
+            arg = parse_expr_typecast(expr,ti,tie,/*follows*/false,ntypes);
+        }
+        else {
+            if (ti == tie)
+                throw invalid_argument("sizeof without argument");
+
+            arg = expr.newnode(*(ti++));
+        }
+
+        expr.setchildren(opnode,{arg});
+
+        return opnode;
+    }
+
+    return expression::node::none;
+}
+
+/* Operator precedence parsing with an explicit stack (expr.parse_stack) instead of recursion, so
+ * that very long or deeply nested expressions cost linear time and no call stack. Each frame
+ * is an operator waiting for an operand, the same place the recursive form would have called
+ * itself. Precedence numbers come from token_op_table, lower binds tighter. */
+expression::node::node_t parse_expr(expression &expr,token_string::iterator &ti,const token_string::iterator &tie,unsigned int min_prec = (~0u)) {
+    typedef expression::parse_frame frame;
+    const size_t base = expr.parse_stack.size();
+    expression::node::node_t headnode = expression::node::none;
+    bool need_operand = true;
+
+    while (true) {
+        if (need_operand) {
+            if (ti == tie)
+                throw invalid_argument("expected token for expr parse");
+
+            size_t ntypes = 0;
+            const expression::node::node_t tcnode = parse_expr_typecast(expr,ti,tie,/*follows*/true,ntypes);
+
+            /* (typecast) expression, which takes the whole remaining expression */
+            if (tcnode != expression::node::none) {
+                expr.parse_stack.push_back({frame::TYPECAST,min_prec,tcnode,expression::node::none,expression::node::none,ntypes});
+                min_prec = ~0u;
+                continue;
+            }
+
+            /* (expression) */
+            if ((*ti).tval == token::OPEN_PARENS) {
+                ti++;
+                expr.parse_stack.push_back({frame::SUBEXPR,min_prec,expression::node::none,expression::node::none,expression::node::none,0});
+                min_prec = ~0u;
+                continue;
+            }
+
+            /* sizeof(type) */
+            headnode = parse_expr_sizeof(expr,ti,tie);
+
+            /* ~expression, -expression, defined X, etc. */
+            if (headnode == expression::node::none) {
+                const token_op_t &op = token_op((*ti).tval);
+
+                if (op.prefix_node != token::NONE && op.prefix_prec <= min_prec) {
+                    const expression::node::node_t opnode = expr.newnode(*(ti++),op.prefix_node);
+
+                    if (ti == tie)
+                        throw invalid_argument("missing rvalue");
+
+                    expr.parse_stack.push_back({frame::PREFIX,min_prec,opnode,expression::node::none,expression::node::none,0});
+                    min_prec = op.prefix_prec;
+                    continue;
+                }
+            }
+
+            /* number */
+            if (headnode == expression::node::none)
+                headnode = expr.newnode(*(ti++));
+
+            need_operand = false;
+        }
+
+        /* expression ++ . -> * / % + - << >> etc ?: = , expression */
+        while (ti != tie) {
+            const token_op_t &op = token_op((*ti).tval);
+            if (op.infix_form == token_op_form_t::NONE || op.infix_prec > min_prec)
+                break;
+
+            const expression::node::node_t opnode = expr.newnode(*(ti++),op.infix_node);
+
+            if (op.infix_form == token_op_form_t::POSTFIX) {
+                expr.setchildren(opnode,{headnode});
+                headnode = opnode;
+                continue;
+            }
+
+            if (ti == tie)
+                throw invalid_argument("missing rvalue");
+
+            if (op.infix_form == token_op_form_t::TERNARY) {
+                expr.parse_stack.push_back({frame::TERNARY_T,min_prec,opnode,headnode,expression::node::none,0});
+                min_prec = op.infix_prec;
+            }
+            else {
+                expr.parse_stack.push_back({frame::BINARY,min_prec,opnode,headnode,expression::node::none,0});
+                min_prec = (op.infix_form == token_op_form_t::LTR) ? (op.infix_prec - 1u) : op.infix_prec;
+            }
+
+            need_operand = true;
+            break;
+        }
+
+        if (need_operand)
+            continue;
+
+        /* headnode is a complete operand, hand it to whatever was waiting for it */
+        if (expr.parse_stack.size() == base)
+            return headnode;
+
+        const frame f = expr.parse_stack.back();
+        expr.parse_stack.pop_back();
+        min_prec = f.min_prec;
+
+        switch (f.kind) {
+            case frame::PREFIX:
+                expr.setchildren(f.opnode,{headnode});
+                headnode = f.opnode;
+                break;
+            case frame::BINARY:
+                expr.setchildren(f.opnode,{f.head,headnode});
+                headnode = f.opnode;
+                break;
+            case frame::TERNARY_T:
+                if (ti == tie)
+                    throw invalid_argument("Ternary ? expected :");
+                if ((*ti).tval != token::COLON)
+                    throw invalid_argument("Ternary ? expected :");
+                ti++;
+
+                expr.parse_stack.push_back({frame::TERNARY_F,f.min_prec,f.opnode,f.head,headnode,0});
+                min_prec = token_op(token::QUESTIONMARK).infix_prec;
+                need_operand = true;
+                break;
+            case frame::TERNARY_F:
+                expr.setchildren(f.opnode,{f.head,f.tnode,headnode});
+                headnode = f.opnode;
+                break;
+            case frame::TYPECAST:
+                expr.setchildren(f.opnode,f.opnode+size_t(1),f.count,headnode);
+                headnode = f.opnode;
+                break;
+            case frame::SUBEXPR:
+                if (ti == tie)
+                    throw invalid_argument("missing closing parens");
+                if ((*ti).tval != token::CLOSE_PARENS)
+                    throw invalid_argument("missing closing parens");
+                ti++;
+                break;
+        };
+    }
+}
+
+void dump_expr_node(pp_context &ctx,FILE *fp,const expression &expr,const expression::node::node_t node,unsigned int depth) {
+    vector< pair<expression::node::node_t,unsigned int> > todo;
+
+    if (fp == NULL)
+        fp = pp_stderr();
+
+    todo.push_back(make_pair(node,depth));
+    while (!todo.empty()) {
+        const auto ent = todo.back();
+        todo.pop_back();
+
+        for (unsigned int c=0;c < ent.second;c++)
+            fprintf(fp,"| ");
+
+        const auto &n = expr.getnode(ent.first);
+        fprintf(fp,"node[%zu]: %s\n",ent.first,to_string(ctx,n.tval).c_str());
+        for (size_t i=n.child_count;i > 0;i--)
+            todo.push_back(make_pair(expr.child(n,i-size_t(1)),ent.second+1u));
+    }
+}
+
+void dump_expr(pp_context &ctx,FILE *fp,const expression &expr) {
+    if (fp == NULL)
+        fp = pp_stderr();
+
+    fprintf(fp,"expression:\n");
+    if (expr.root != expression::node::none)
+        dump_expr_node(ctx,fp,expr,expr.root,1);
+    fprintf(fp,"END\n");
+}
+
+void pp_if_program::clear() {
+    code.clear();
+    names.clear();
+    max_stack = 0;
+}
+
+size_t pp_if_program::emit(const opcode_t op,const signed long long v) {
+    const size_t r = code.size();
+    code.push_back({op,v});
+    return r;
+}
+
+/* point the jump at 'at' to the next instruction to be emitted */
+void pp_if_program::patch(const size_t at) {
+    code.at(at).v = (signed long long)code.size();
+}
+
+static inline signed long long pp_if_program_pop(vector<signed long long> &stk) {
+    if (stk.empty())
+        throw runtime_error("#if program stack underflow");
+
+    const signed long long r = stk.back();
+    stk.pop_back();
+    return r;
+}
+
+signed long long pp_if_program::run(pp_context &ctx) const {
+    vector<signed long long> stk;
+    size_t pc = 0;
+
+    stk.reserve(max_stack);
+    while (pc < code.size()) {
+        const op_t &o = code[pc++];
+
+        switch (o.op) {
+            case PUSH:
+                stk.push_back(o.v);
+                break;
+            case DEFINED:
+                stk.push_back(is_macro(ctx,names.at(size_t(o.v))) ? 1 : 0);
+                break;
+            case POP:
+                pp_if_program_pop(stk);
+                break;
+            case NEG:
+                stk.push_back(-pp_if_program_pop(stk));
+                break;
+            case NOT:
+                stk.push_back((pp_if_program_pop(stk) == 0ll) ? 1 : 0);
+                break;
+            case COMPL:
+                stk.push_back(~pp_if_program_pop(stk));
+                break;
+            case BOOL:
+                stk.push_back((pp_if_program_pop(stk) != 0ll) ? 1 : 0);
+                break;
+            case JZ:
+                if (pp_if_program_pop(stk) == 0ll) pc = size_t(o.v);
+                break;
+            case JMP:
+                pc = size_t(o.v);
+                break;
+            case ANDJ:
+                if (pp_if_program_pop(stk) == 0ll) { stk.push_back(0); pc = size_t(o.v); }
+                break;
+            case ORJ:
+                if (pp_if_program_pop(stk) != 0ll) { stk.push_back(1); pc = size_t(o.v); }
+                break;
+            case IDENT:
+                stk.push_back(0);
+                break;
+            case SEL: {
+                const signed long long f = pp_if_program_pop(stk);
+                const signed long long t = pp_if_program_pop(stk);
+                stk.push_back((pp_if_program_pop(stk) != 0ll) ? t : f);
+                break; }
+            default: {
+                const signed long long b = pp_if_program_pop(stk);
+                const signed long long a = pp_if_program_pop(stk);
+                signed long long r;
+
+                switch (o.op) {
+                    case ADD:   r = a + b; break;
+                    case SUB:   r = a - b; break;
+                    case MUL:   r = a * b; break;
+                    case DIV:
+                    case MOD:
+                        if (b == 0ll)
+                            throw invalid_argument("division by zero in preprocessor expression");
+                        if (b == -1ll && a == LLONG_MIN)
+                            throw invalid_argument("integer overflow in preprocessor expression");
+                        r = (o.op == DIV) ? (a / b) : (a % b);
+                        break;
+                    case SHL:   r = a << b; break;
+                    case SHR:   r = a >> b; break;
+                    case LT:    r = (a <  b) ? 1 : 0; break;
+                    case LE:    r = (a <= b) ? 1 : 0; break;
+                    case GT:    r = (a >  b) ? 1 : 0; break;
+                    case GE:    r = (a >= b) ? 1 : 0; break;
+                    case EQ:    r = (a == b) ? 1 : 0; break;
+                    case NE:    r = (a != b) ? 1 : 0; break;
+                    case BAND:  r = a & b; break;
+                    case BXOR:  r = a ^ b; break;
+                    case BOR:   r = a | b; break;
+                    case LAND:  r = (a != 0ll && b != 0ll) ? 1 : 0; break;
+                    case LOR:   r = (a != 0ll || b != 0ll) ? 1 : 0; break;
+                    default:    throw runtime_error("#if program invalid opcode");
+                };
+
+                stk.push_back(r);
+                break; }
+        };
+    }
+
+    if (stk.size() != size_t(1))
+        throw runtime_error("#if program did not leave exactly one value");
+
+    return stk.back();
+}
+
+/* value and whether it is known */
+typedef pair<signed long long,bool> pp_if_value3;
+
+static inline pp_if_value3 pp_if_program_pop3(vector<pp_if_value3> &stk) {
+    if (stk.empty())
+        throw runtime_error("#if program stack underflow");
+
+    const pp_if_value3 r = stk.back();
+    stk.pop_back();
+    return r;
+}
+
+/* three-valued evaluation for --unifdef. identifiers and defined() of macros not named by
+ * -D or -U are unknown, and unknown propagates except where the other operand of && || ?:
+ * decides the result. the program must be compiled with tristate set. */
+pp_tristate_t pp_if_program::run3(pp_context &ctx,signed long long &v) const {
+    vector<pp_if_value3> stk;
+
+    stk.reserve(max_stack);
+    for (const op_t &o : code) {
+        switch (o.op) {
+            case PUSH:
+                stk.push_back(make_pair(o.v,true));
+                break;
+            case DEFINED: {
+                const string &name = names.at(size_t(o.v));
+                if (is_macro(ctx,name))
+                    stk.push_back(make_pair(1ll,true));
+                else
+                    stk.push_back(make_pair(0ll,ctx.unifdef_undefined.find(name) != ctx.unifdef_undefined.end()));
+                break; }
+            case IDENT:
+                stk.push_back(make_pair(0ll,ctx.unifdef_undefined.find(names.at(size_t(o.v))) != ctx.unifdef_undefined.end()));
+                break;
+            case POP:
+                pp_if_program_pop3(stk);
+                break;
+            case NEG:
+            case NOT:
+            case COMPL:
+            case BOOL: {
+                pp_if_value3 a = pp_if_program_pop3(stk);
+                if (o.op == NEG)        a.first = -a.first;
+                else if (o.op == NOT)   a.first = (a.first == 0ll) ? 1 : 0;
+                else if (o.op == COMPL) a.first = ~a.first;
+                else                    a.first = (a.first != 0ll) ? 1 : 0;
+                stk.push_back(a);
+                break; }
+            case LAND:
+            case LOR: {
+                const pp_if_value3 b = pp_if_program_pop3(stk);
+                const pp_if_value3 a = pp_if_program_pop3(stk);
+                const signed long long decide = (o.op == LAND) ? 0ll : 1ll; /* value of one operand that decides the result */
+
+                if ((a.second && (a.first != 0ll) == (decide != 0ll)) || (b.second && (b.first != 0ll) == (decide != 0ll)))
+                    stk.push_back(make_pair(decide,true));
+                else if (a.second && b.second)
+                    stk.push_back(make_pair(1ll - decide,true));
+                else
+                    stk.push_back(make_pair(0ll,false));
+                break; }
+            case SEL: {
+                const pp_if_value3 f = pp_if_program_pop3(stk);
+                const pp_if_value3 t = pp_if_program_pop3(stk);
+                const pp_if_value3 c = pp_if_program_pop3(stk);
+
+                if (c.second)
+                    stk.push_back((c.first != 0ll) ? t : f);
+                else if (t.second && f.second && t.first == f.first)
+                    stk.push_back(t);
+                else
+                    stk.push_back(make_pair(0ll,false));
+                break; }
+            case JZ:
+            case JMP:
+            case ANDJ:
+            case ORJ:
+                throw runtime_error("#if program with jumps cannot be evaluated three-valued");
+            default: {
+                const pp_if_value3 b = pp_if_program_pop3(stk);
+                const pp_if_value3 a = pp_if_program_pop3(stk);
+
+                if (!a.second || !b.second) {
+                    stk.push_back(make_pair(0ll,false));
+                }
+                else if ((o.op == DIV || o.op == MOD) && (b.first == 0ll || (b.first == -1ll && a.first == LLONG_MIN))) {
+                    stk.push_back(make_pair(0ll,false)); /* leave it to the compiler to complain */
+                }
+                else {
+                    /* reuse the two-valued arithmetic */
+                    pp_if_program p;
+                    p.code.push_back({PUSH,a.first});
+                    p.code.push_back({PUSH,b.first});
+                    p.code.push_back(o);
+                    stk.push_back(make_pair(p.run(ctx),true));
+                }
+                break; }
+        };
+    }
+
+    if (stk.size() != size_t(1))
+        throw runtime_error("#if program did not leave exactly one value");
+
+    v = stk.back().first;
+    if (!stk.back().second)
+        return pp_tristate_t::UNKNOWN;
+
+    return (v != 0ll) ? pp_tristate_t::YES : pp_tristate_t::NO;
+}
+
+void pp_if_program::dump(FILE *fp) const {
+    static const char *opnames[] = {
+        "push","defined","pop","neg","not","compl","bool","add","sub","mul","div","mod","shl","shr",
+        "lt","le","gt","ge","eq","ne","band","bxor","bor","jz","jmp","andj","orj",
+        "ident","land","lor","sel"
+    };
+
+    if (fp == NULL)
+        fp = pp_stderr();
+
+    fprintf(fp,"program (max stack %zu):\n",max_stack);
+    for (size_t i=0;i < code.size();i++) {
+        fprintf(fp,"  %zu: %s",i,opnames[code[i].op]);
+        if (code[i].op == DEFINED || code[i].op == IDENT)
+            fprintf(fp," %s",names.at(size_t(code[i].v)).c_str());
+        else if (code[i].op == PUSH || code[i].op == JZ || code[i].op == JMP || code[i].op == ANDJ || code[i].op == ORJ)
+            fprintf(fp," %lld",code[i].v);
+        fprintf(fp,"\n");
+    }
+}
+
+/* one step of compiling an expression tree, see pp_if_compile() */
+struct pp_if_compile_step {
+    enum kind_t {
+        NODE,           /* compile node, with depth values already on the stack */
+        EMIT,           /* emit op */
+        EMITJ,          /* emit jump op, to be patched later */
+        PATCH,          /* point the most recent unpatched jump here */
+        PATCH_UNDER     /* point the unpatched jump before the most recent one here */
+    };
+    kind_t                      kind;
+    expression::node::node_t    node;
+    size_t                      depth;
+    pp_if_program::opcode_t     op;
+};
+
+/* queue steps to run in the order given */
+static void pp_if_compile_push(vector<pp_if_compile_step> &todo,const initializer_list<pp_if_compile_step> seq) {
+    for (auto i=seq.end();i != seq.begin();)
+        todo.push_back(*(--i));
+}
+
+/* compile the expression tree rooted at root, appending to prog. Works from an explicit
+ * list of steps rather than recursion so that very deep trees are no problem. */
+void pp_if_compile(pp_context &ctx,pp_if_program &prog,const expression &expr,const expression::node::node_t root) {
+    typedef pp_if_compile_step step;
+    vector<step> todo;
+    vector<size_t> jumps; /* emitted, not yet patched */
+
+    if (root == expression::node::none)
+        throw invalid_argument("expression tree with no root");
+
+    todo.push_back({step::NODE,root,0,pp_if_program::PUSH});
+    while (!todo.empty()) {
+        const step st = todo.back();
+        todo.pop_back();
+
+        switch (st.kind) {
+            case step::EMIT:
+                prog.emit(st.op);
+                continue;
+            case step::EMITJ:
+                jumps.push_back(prog.emit(st.op));
+                continue;
+            case step::PATCH:
+                prog.patch(jumps.back());
+                jumps.pop_back();
+                continue;
+            case step::PATCH_UNDER:
+                prog.patch(jumps.at(jumps.size()-size_t(2)));
+                jumps.erase(jumps.end()-2);
+                continue;
+            case step::NODE:
+                break;
+        };
+
+        const size_t depth = st.depth;
+        if (prog.max_stack < (depth + size_t(1)))
+            prog.max_stack = depth + size_t(1);
+
+        const auto &n = expr.getnode(st.node);
+        pp_if_program::opcode_t bop;
+
+        switch (n.tval.tval) {
+            case token::INTEGER:
+                prog.emit(pp_if_program::PUSH,n.tval.i.s);
+                continue;
+            case token::FLOAT:
+                throw invalid_argument("Floating point not allowed in expressions at preprocessor level");
+            case token::STRING:
+                throw invalid_argument("Strings not allowed in expressions at preprocessor level");
+            case token::ASSIGNMENT:
+                throw invalid_argument("Assignment not permitted in macro preprocessor");
+            case token::POSTINCREMENT:
+            case token::POSTDECREMENT:
+            case token::PREINCREMENT:
+            case token::PREDECREMENT:
+                throw invalid_argument("increment/decrement not allowed in macro preprocessor");
+            case token::DEREFERENCE:
+            case token::STRUCTREF:
+            case token::ADDRESSOF:
+                throw invalid_argument("struct/pointer ref not allowed in macro preprocessor");
+            case token::SIZEOF:
+                throw invalid_argument("sizeof not allowed in macro preprocessor");
+            case token::COMMA: /* a,b -> b */
+                pp_if_compile_push(todo,{{step::NODE,expr.child(n,0),depth,pp_if_program::PUSH},{step::EMIT,0,0,pp_if_program::POP},{step::NODE,expr.child(n,1),depth,pp_if_program::PUSH}});
+                continue;
+            case token::PLUS:
+                if (n.child_count == 1) { /* +a -> a */
+                    pp_if_compile_push(todo,{{step::NODE,expr.child(n,0),depth,pp_if_program::PUSH}});
+                    continue;
+                }
+                bop = pp_if_program::ADD;
+                break;
+            case token::NEGATE:
+                pp_if_compile_push(todo,{{step::NODE,expr.child(n,0),depth,pp_if_program::PUSH},{step::EMIT,0,0,pp_if_program::NEG}});
+                continue;
+            case token::NOT:
+                pp_if_compile_push(todo,{{step::NODE,expr.child(n,0),depth,pp_if_program::PUSH},{step::EMIT,0,0,pp_if_program::NOT}});
+                continue;
+            case token::COMPLEMENT:
+                pp_if_compile_push(todo,{{step::NODE,expr.child(n,0),depth,pp_if_program::PUSH},{step::EMIT,0,0,pp_if_program::COMPL}});
+                continue;
+            case token::MINUS:                  bop = pp_if_program::SUB; break;
+            case token::MULTIPLY:               bop = pp_if_program::MUL; break;
+            case token::DIVISION:               bop = pp_if_program::DIV; break;
+            case token::MODULUS:                bop = pp_if_program::MOD; break;
+            case token::LEFT_SHIFT:             bop = pp_if_program::SHL; break;
+            case token::RIGHT_SHIFT:            bop = pp_if_program::SHR; break;
+            case token::BINARY_AND:             bop = pp_if_program::BAND; break;
+            case token::BINARY_XOR:             bop = pp_if_program::BXOR; break;
+            case token::BINARY_OR:              bop = pp_if_program::BOR; break;
+            case token::EQUALS:                 bop = pp_if_program::EQ; break;
+            case token::NOT_EQUALS:             bop = pp_if_program::NE; break;
+            case token::LESS_THAN:              bop = pp_if_program::LT; break;
+            case token::LESS_THAN_OR_EQUAL:     bop = pp_if_program::LE; break;
+            case token::GREATER_THAN:           bop = pp_if_program::GT; break;
+            case token::GREATER_THAN_OR_EQUAL:  bop = pp_if_program::GE; break;
+            case token::LOGICAL_AND:
+            case token::LOGICAL_OR:
+                if (prog.tristate) { /* both sides evaluated, see run3() */
+                    bop = (n.tval.tval == token::LOGICAL_AND) ? pp_if_program::LAND : pp_if_program::LOR;
+                }
+                else {
+                    const pp_if_program::opcode_t jop = (n.tval.tval == token::LOGICAL_AND) ? pp_if_program::ANDJ : pp_if_program::ORJ;
+                    pp_if_compile_push(todo,{{step::NODE,expr.child(n,0),depth,pp_if_program::PUSH},{step::EMITJ,0,0,jop},{step::NODE,expr.child(n,1),depth,pp_if_program::PUSH},{step::EMIT,0,0,pp_if_program::BOOL},{step::PATCH,0,0,pp_if_program::PUSH}});
+                    continue;
+                }
+                break;
+            case token::TERNARY: {
+                if (prog.tristate) {
+                    if (prog.max_stack < (depth + size_t(3)))
+                        prog.max_stack = depth + size_t(3);
+
+                    pp_if_compile_push(todo,{{step::NODE,expr.child(n,0),depth,pp_if_program::PUSH},{step::NODE,expr.child(n,1),depth + size_t(1),pp_if_program::PUSH},{step::NODE,expr.child(n,2),depth + size_t(2),pp_if_program::PUSH},{step::EMIT,0,0,pp_if_program::SEL}});
+                    continue;
+                }
+
+                pp_if_compile_push(todo,{{step::NODE,expr.child(n,0),depth,pp_if_program::PUSH},{step::EMITJ,0,0,pp_if_program::JZ},{step::NODE,expr.child(n,1),depth,pp_if_program::PUSH},{step::EMITJ,0,0,pp_if_program::JMP},{step::PATCH_UNDER,0,0,pp_if_program::PUSH},{step::NODE,expr.child(n,2),depth,pp_if_program::PUSH},{step::PATCH,0,0,pp_if_program::PUSH}});
+                continue; }
+            case token::IDENTIFIER:
+                if (prog.tristate) { /* zero, or unknown if not named by -U */
+                    prog.names.push_back(n.tval.sval);
+                    prog.emit(pp_if_program::IDENT,(signed long long)(prog.names.size() - size_t(1)));
+                    continue;
+                }
+
+                prog.emit(pp_if_program::PUSH,0); /* if the macro expansion did not replace the identifier with a value then it is zero */
+                continue;
+            case token::DEFINED:
+                {
+                    const auto &c = expr.getnode(expr.child(n,0));
+                    if (c.tval.tval == token::IDENTIFIER) {
+                        prog.names.push_back(c.tval.sval);
+                        prog.emit(pp_if_program::DEFINED,(signed long long)(prog.names.size() - size_t(1)));
+                        continue;
+                    }
+                    else {
+                        throw invalid_argument("defined() used with a non-identifier");
+                    }
+                }
+            case token::TYPECAST: /* .at(0)=type tokens .at(1)=expression to typecast */
+                fprintf(pp_stderr(),"WARNING: Typecasts are ignored by the macro processor\n");
+                pp_if_compile_push(todo,{{step::NODE,expr.child(n,n.child_count-size_t(1)),depth,pp_if_program::PUSH}});
+                continue;
+            default:
+                throw invalid_argument(string("unsupported expression in preprocessor level, token ")+to_string(ctx,n.tval));
+        };
+
+        /* binary operators */
+        pp_if_compile_push(todo,{{step::NODE,expr.child(n,0),depth,pp_if_program::PUSH},{step::NODE,expr.child(n,1),depth + size_t(1),pp_if_program::PUSH},{step::EMIT,0,0,bop}});
+    }
+}
+
+bool pp_if_eval(pp_context &ctx,token_string::iterator &ti,const token_string::iterator &tie) {
+    if (ti == tie)
+        throw invalid_argument("macro if condition requires something to evaluate");
+
+    expression &expr = *ctx.expr;
+
+    expr.clear();
+    expr.root = parse_expr(expr,ti,tie);
+
+    if (ctx.opt.ppt_only)
+        dump_expr(ctx,NULL,expr);
+
+    if (ti != tie)
+        throw invalid_argument("if condition did not fully parse");
+
+    pp_if_program prog;
+    pp_if_compile(ctx,prog,expr,expr.root);
+
+    if (ctx.opt.ppt_only)
+        prog.dump(NULL);
+
+    signed long long v = prog.run(ctx);
+    if (ctx.opt.ppt_only)
+        fprintf(pp_stderr(),"#if eval result %lld\n",v);
+
+    pp_if_memo_store(ctx,prog,v != 0ll);
+    return v != 0ll;
+}
+
+/* preprocessing stage */
+static bool pp_is_file(const string &path) {
+    struct stat st;
+    return stat(path.c_str(),&st) == 0 && S_ISREG(st.st_mode);
+}
+
+/* caller holds pp_shared_lock */
+pp_dir_listing &pp_get_dir_listing(const string &dir) {
+    const string key = pp_path_key(dir);
+    auto di = pp_dir_listings.find(key);
+    if (di != pp_dir_listings.end() && di->second.kept)
+        return di->second;
+
+    pp_dir_listing &dl = pp_dir_listings[key];
+    dl = pp_dir_listing();
+    dl.kept = pp_watch_dir(key);
+
+    DIR *d = opendir(dir.c_str());
+    if (d != NULL) {
+        struct dirent *de;
+
+        dl.exists = true;
+        while ((de=readdir(d)) != NULL) {
+            /* symlinks and file systems that do not report the type get stat()ed on first use */
+            const unsigned char t = (de->d_type == DT_REG || de->d_type == DT_DIR) ? (unsigned char)de->d_type : (unsigned char)DT_UNKNOWN;
+            dl.entries[de->d_name] = t;
+        }
+
+        closedir(d);
+    }
+
+    return dl;
+}
+
+/* pp_is_file() through the directory listing cache. files created after the
+ * directory was first listed are not seen */
+static bool pp_is_file_cached(const string &path) {
+    const size_t p = path.find_last_of('/');
+    const string dir = (p != string::npos) ? path.substr(0,p+size_t(1)) : string("./");
+    const string name = (p != string::npos) ? path.substr(p+size_t(1)) : path;
+    lock_guard<mutex> lock(pp_shared_lock);
+
+    pp_dir_listing &dl = pp_get_dir_listing(dir);
+    if (!dl.exists)
+        return false;
+
+    auto ei = dl.entries.find(name);
+    if (ei == dl.entries.end())
+        return false;
+
+    if (ei->second == DT_UNKNOWN)
+        ei->second = pp_is_file(path) ? DT_REG : DT_DIR;
+
+    return ei->second == DT_REG;
+}
+
+string pp_realpath(const string &path) {
+    const string key = pp_path_key(path);
+    lock_guard<mutex> lock(pp_shared_lock);
+    auto ri = pp_realpaths.find(key);
+    if (ri == pp_realpaths.end()) {
+        char *r = realpath(path.c_str(),NULL);
+        ri = pp_realpaths.insert(make_pair(key,(r != NULL) ? string(r) : path)).first;
+        if (r != NULL) ::free(r);
+    }
+
+    return ri->second;
+}
+
+/* where "name" looks first, the directory of the including file */
+static string pp_include_dir(const string &includer,const bool angled) {
+    const size_t p = includer.find_last_of('/');
+    return (!angled && p != string::npos) ? includer.substr(0,p+size_t(1)) : string();
+}
+
+/* the paths an #include of name tries, in order */
+static void pp_include_candidates(vector<string> &v,pp_context &ctx,const string &name,const bool angled,const string &includer_dir) {
+    if (name[0] == '/') {
+        v.push_back(name);
+        return;
+    }
+
+    if (!angled)
+        v.push_back(includer_dir + name);
+
+    for (const auto &dir : ctx.opt.include_paths) {
+        string path = dir;
+        if (!path.empty() && path.back() != '/') path += '/';
+        path += name;
+        v.push_back(move(path));
+    }
+}
+
+static string pp_include_search(pp_context &ctx,const string &name,const bool angled,const string &includer_dir) {
+    vector<string> v;
+
+    pp_include_candidates(v,ctx,name,angled,includer_dir);
+    for (const auto &path : v) {
+        if (pp_is_file_cached(path))
+            return path;
+    }
+
+    return string();
+}
+
+/* "name" looks next to the including file first, then the -I paths. <name> only the -I paths.
+ * results, including misses, are cached for the rest of the run */
+string pp_include_lookup(pp_context &ctx,const string &name,const bool angled,const string &includer) {
+    const string includer_dir = pp_include_dir(includer,angled);
+
+    string key;
+    key.reserve(ctx.include_paths_key.size() + includer_dir.size() + name.size() + size_t(2));
+    key += ctx.include_paths_key;
+    key += angled ? '<' : '\"';
+    key += includer_dir;
+    key += '\0';
+    key += name;
+
+    uint64_t generation;
+    {
+        lock_guard<mutex> lock(pp_shared_lock);
+        auto ci = pp_include_cache.find(key);
+        if (ci != pp_include_cache.end())
+            return ci->second;
+
+        generation = pp_cache_generation;
+    }
+
+    const string r = pp_include_search(ctx,name,angled,includer_dir);
+
+    lock_guard<mutex> lock(pp_shared_lock);
+    if (generation == pp_cache_generation)
+        pp_include_cache[key] = r;
+    return r;
+}
+
+/* queue the files the #include lines of src name, unless their include guard is defined */
+static void pp_prefetch_scan(pp_context &ctx,const FileSource &src) {
+    const char *p = src.memory();
+    const char *end = p + src.memory_size();
+    vector<string> keys;
+
+    if (p == NULL)
+        return;
+
+    while (p < end) {
+        const char *le = (const char*)memchr(p,'\n',size_t(end - p));
+        if (le == NULL) le = end;
+
+        const char *q = p;
+        p = le + 1;
+
+        while (q < le && (*q == ' ' || *q == '\t')) q++;
+        if (q == le || *q != '#') continue;
+        q++;
+        while (q < le && (*q == ' ' || *q == '\t')) q++;
+        if (size_t(le - q) < size_t(8) || memcmp(q,"include",7) != 0) continue;
+        q += 7;
+        while (q < le && (*q == ' ' || *q == '\t')) q++;
+        if (q == le || (*q != '\"' && *q != '<')) continue;
+
+        const bool angled = (*q == '<');
+        const char *ne = (const char*)memchr(q + 1,angled ? '>' : '\"',size_t(le - q - 1));
+        if (ne == NULL || ne == q + 1) continue;
+
+        const string path = pp_include_lookup(ctx,string(q + 1,ne),angled,src.get_path());
+        if (path.empty())
+            continue;
+
+        string guard;
+        {
+            lock_guard<mutex> lock(pp_shared_lock);
+            const auto gi = pp_include_guards.find(pp_path_key(path));
+            if (gi != pp_include_guards.end())
+                guard = gi->second;
+        }
+        if (!guard.empty() && is_macro(ctx,guard))
+            continue;
+
+        keys.push_back(pp_path_key(path));
+    }
+
+    if (keys.empty())
+        return;
+
+    lock_guard<mutex> lock(pp_prefetch_lock);
+    for (const auto &key : keys) {
+        if (pp_prefetch_files.find(key) != pp_prefetch_files.end())
+            continue;
+
+        if (pp_prefetch_files.size() >= pp_prefetch_max_files) { /* guesses nobody took */
+            for (auto fi=pp_prefetch_files.begin();fi != pp_prefetch_files.end();) {
+                if (fi->second->done)
+                    fi = pp_prefetch_files.erase(fi);
+                else
+                    fi++;
+            }
+            if (pp_prefetch_files.size() >= pp_prefetch_max_files)
+                break;
+        }
+
+        pp_prefetch_files[key] = make_shared<pp_prefetch_entry>();
+        pp_prefetch_queue.push_back(key);
+    }
+
+    pp_prefetch_work.notify_all();
+}
+
+/* how a token from a macro expanded <...> header name is spelled */
+string pp_include_spelling(pp_context &ctx,const token &t) {
+    if (t.tval == token::STRING)
+        return ctx.string_store.get_char(t.s.strref);
+
+    string r = to_string_pp(ctx,t);
+    while (!r.empty() && r.back() == ' ') r.pop_back();
+    return r;
+}
+
+/* cache files: integers are in host byte order, strings are length + bytes */
+static void pp_bin_put(string &b,const uint32_t v) {
+    b.append((const char*)(&v),sizeof(v));
+}
+
+static void pp_bin_put64(string &b,const uint64_t v) {
+    b.append((const char*)(&v),sizeof(v));
+}
+
+static void pp_bin_put(string &b,const string &s) {
+    pp_bin_put(b,uint32_t(s.size()));
+    b += s;
+}
+
+class pp_bin_reader {
+public:
+                                pp_bin_reader(const string &_b) : b(_b) { }
+public:
+    void read(void *p,const size_t len) {
+        if (len > b.size() - pos)
+            throw runtime_error("truncated");
+        memcpy(p,b.data() + pos,len);
+        pos += len;
+    }
+    uint32_t u32() {
+        uint32_t v;
+        read(&v,sizeof(v));
+        return v;
+    }
+    uint64_t u64() {
+        uint64_t v;
+        read(&v,sizeof(v));
+        return v;
+    }
+    string str() {
+        const uint32_t len = u32();
+        if (len > b.size() - pos)
+            throw runtime_error("truncated");
+        pos += len;
+        return b.substr(pos - len,len);
+    }
+private:
+    const string&               b;
+    size_t                      pos = 0;
+};
+
+/* read all of fp, and close it */
+static void pp_file_slurp(string &b,FILE *fp) {
+    char buf[16384];
+    size_t rd;
+
+    while ((rd=fread(buf,1,sizeof(buf),fp)) > 0)
+        b.append(buf,rd);
+
+    fclose(fp);
+}
+
+/* write path as a whole, so that readers in other processes see the old or the new file */
+static bool pp_file_replace(const string &path,const string &b) {
+    const string tmp = path + ".tmp" + to_string((long)getpid()) + "." + to_string(hash<thread::id>()(this_thread::get_id()));
+    FILE *fp = fopen(tmp.c_str(),"wb");
+
+    if (fp != NULL) {
+        const bool ok = b.empty() || fwrite(b.data(),b.size(),1,fp) == 1;
+        if (fclose(fp) == 0 && ok && rename(tmp.c_str(),path.c_str()) == 0)
+            return true;
+
+        remove(tmp.c_str());
+    }
+
+    return false;
+}
+
+/* pp_file_replace() into a cache directory, which is created the first time it is missing */
+static bool pp_cache_file_replace(const string &dir,const string &path,const string &b) {
+    if (pp_file_replace(path,b))
+        return true;
+    if (errno != ENOENT || (mkdir(dir.c_str(),0755) != 0 && errno != EEXIST))
+        return false;
+
+    return pp_file_replace(path,b);
+}
+
+static bool pp_file_content_hash(uint64_t &h,const string &path) {
+    unsigned char buf[16384];
+    size_t rd;
+
+    FILE *fp = fopen(path.c_str(),"rb");
+    if (fp == NULL)
+        return false;
+
+    h = fnv1a64_init;
+    while ((rd=fread(buf,1,sizeof(buf),fp)) > 0)
+        h = fnv1a64(h,buf,rd);
+
+    fclose(fp);
+    return true;
+}
+
+/* --header-cache: the cache directory holds one file per (include paths, header), with
+ * every entry for it */
+static const char               pp_hdr_magic[8] = {'H','A','X','H','D','R','4','\n'};
+
+static string pp_hdr_file(const string &dir,const string &key) {
+    char tmp[32];
+    snprintf(tmp,sizeof(tmp),"%016llx.hdr",(unsigned long long)fnv1a64(fnv1a64_init,key));
+    return dir + "/" + tmp;
+}
+
+static string pp_hdr_serialize(const string &key,const vector< shared_ptr<const pp_hdr_entry> > &v) {
+    string b(pp_hdr_magic,sizeof(pp_hdr_magic));
+
+    pp_bin_put(b,key);
+    pp_bin_put(b,uint32_t(v.size()));
+    for (const auto &e : v) {
+        pp_bin_put(b,e->path);
+        pp_bin_put(b,uint32_t(e->refs.size()));
+        for (const auto &r : e->refs) {
+            pp_bin_put(b,r.first);
+            pp_bin_put64(b,r.second);
+        }
+        pp_bin_put(b,uint32_t(e->defs.size()));
+        for (const auto &d : e->defs) {
+            pp_bin_put(b,d.first);
+            pp_bin_put(b,uint32_t(d.second ? 1u : 0u));
+            if (d.second) {
+                const macro_t &m = *d.second;
+                pp_bin_put(b,m.body);
+                pp_bin_put(b,uint32_t(m.param.size()));
+                for (const auto &p : m.param)
+                    pp_bin_put(b,p);
+                pp_bin_put(b,uint32_t((m.parens ? 1u : 0u) | (m.last_param_variadic ? 2u : 0u) | (m.last_param_optional ? 4u : 0u)));
+                pp_bin_put64(b,m.fingerprint);
+                pp_bin_put(b,m.def_source);
+                pp_bin_put(b,uint32_t(m.def_line));
+            }
+        }
+        pp_bin_put(b,uint32_t(e->once.size()));
+        for (const auto &o : e->once)
+            pp_bin_put(b,o);
+        pp_bin_put(b,uint32_t(e->once_refs.size()));
+        for (const auto &o : e->once_refs) {
+            pp_bin_put(b,o.first);
+            pp_bin_put(b,uint32_t(o.second ? 1u : 0u));
+        }
+        pp_bin_put(b,uint32_t(e->absent.size()));
+        for (const auto &a : e->absent)
+            pp_bin_put(b,a);
+        pp_bin_put(b,uint32_t(e->inputs.size()));
+        for (const auto &in : e->inputs) {
+            pp_bin_put(b,in.path);
+            pp_bin_put64(b,uint64_t(in.mtime));
+            pp_bin_put64(b,uint64_t(in.mtime_nsec));
+            pp_bin_put64(b,uint64_t(in.size));
+            pp_bin_put64(b,in.content_hash);
+        }
+        pp_bin_put(b,e->text);
+    }
+
+    return b;
+}
+
+static bool pp_hdr_stat(pp_hdr_input &in,const string &path) {
+    struct stat st;
+
+    if (stat(path.c_str(),&st) != 0)
+        return false;
+
+    in.path = path;
+    in.mtime = int64_t(st.st_mtim.tv_sec);
+    in.mtime_nsec = int64_t(st.st_mtim.tv_nsec);
+    in.size = int64_t(st.st_size);
+    return true;
+}
+
+/* a file is unchanged if its size and mtime are, or else if its content is */
+static bool pp_hdr_input_valid(const pp_hdr_input &in) {
+    pp_hdr_input now;
+    uint64_t ch;
+
+    if (!pp_hdr_stat(now,in.path) || now.size != in.size)
+        return false;
+    if (now.mtime == in.mtime && now.mtime_nsec == in.mtime_nsec)
+        return true;
+
+    return pp_file_content_hash(ch,in.path) && ch == in.content_hash;
+}
+
+/* entries whose files have not changed since they were recorded */
+static void pp_hdr_load(vector< shared_ptr<const pp_hdr_entry> > &v,const string &dir,const string &key) {
+    const string path = pp_hdr_file(dir,key);
+    FILE *fp = fopen(path.c_str(),"rb");
+    string b;
+
+    if (fp == NULL)
+        return;
+
+    pp_file_slurp(b,fp);
+
+    try {
+        pp_bin_reader r(b);
+        char magic[sizeof(pp_hdr_magic)];
+
+        r.read(magic,sizeof(magic));
+        if (memcmp(magic,pp_hdr_magic,sizeof(magic)) != 0)
+            throw runtime_error("not a header cache file");
+        if (r.str() != key)
+            return; /* another key with the same hash */
+
+        for (uint32_t count=r.u32();count != 0u;count--) {
+            auto e = make_shared<pp_hdr_entry>();
+            bool valid = true;
+
+            e->path = r.str();
+            for (uint32_t i=r.u32();i != 0u;i--) {
+                const string name = r.str();
+                e->refs.push_back(make_pair(name,r.u64()));
+            }
+            for (uint32_t i=r.u32();i != 0u;i--) {
+                const string name = r.str();
+                shared_ptr<macro_t> m;
+
+                if (r.u32() != 0u) {
+                    m = make_shared<macro_t>();
+                    m->body = r.str();
+                    for (uint32_t j=r.u32();j != 0u;j--)
+                        m->param.push_back(r.str());
+
+                    const uint32_t flags = r.u32();
+                    m->parens = (flags & 1u) != 0;
+                    m->last_param_variadic = (flags & 2u) != 0;
+                    m->last_param_optional = (flags & 4u) != 0;
+                    m->fingerprint = r.u64();
+                    m->def_source = r.str();
+                    m->def_line = int32_t(r.u32());
+                }
+
+                e->defs.push_back(make_pair(name,shared_ptr<const macro_t>(m)));
+            }
+            for (uint32_t i=r.u32();i != 0u;i--)
+                e->once.push_back(r.str());
+            for (uint32_t i=r.u32();i != 0u;i--) {
+                const string name = r.str();
+                e->once_refs.push_back(make_pair(name,r.u32() != 0u));
+            }
+            for (uint32_t i=r.u32();i != 0u;i--) {
+                const string a = r.str();
+                if (pp_is_file(a))
+                    valid = false;
+                e->absent.insert(a);
+            }
+            for (uint32_t i=r.u32();i != 0u;i--) {
+                pp_hdr_input in;
+
+                in.path = r.str();
+                in.mtime = int64_t(r.u64());
+                in.mtime_nsec = int64_t(r.u64());
+                in.size = int64_t(r.u64());
+                in.content_hash = r.u64();
+                if (valid && !pp_hdr_input_valid(in))
+                    valid = false;
+
+                e->inputs.push_back(move(in));
+            }
+            e->text = r.str();
+
+            if (valid)
+                v.push_back(e);
+        }
+    }
+    catch (const exception &e) {
+        fprintf(pp_stderr(),"WARNING: header cache %s not used: %s\n",path.c_str(),e.what());
+        v.clear();
+    }
+}
+
+static void pp_hdr_write(const string &dir,const string &key,const string &b) {
+    const string path = pp_hdr_file(dir,key);
+
+    if (!pp_cache_file_replace(dir,path,b))
+        fprintf(pp_stderr(),"WARNING: cannot write header cache %s\n",path.c_str());
+}
+
+/* an entry for path whose consulted macros all have the same definitions now, and
+ * whose #includes would find the same #pragma once files already read */
+static shared_ptr<const pp_hdr_entry> pp_hdr_lookup(pp_context &ctx,const string &path) {
+    const string key = ctx.include_paths_key + path;
+    vector< shared_ptr<const pp_hdr_entry> > v;
+
+    {
+        lock_guard<mutex> lock(pp_shared_lock);
+        if (!ctx.opt.header_cache_dir.empty() && pp_hdr_cache_loaded.insert(key).second)
+            pp_hdr_load(pp_hdr_cache[key],ctx.opt.header_cache_dir,key);
+
+        const auto ci = pp_hdr_cache.find(key);
+        if (ci != pp_hdr_cache.end())
+            v = ci->second;
+    }
+
+    for (auto ei=v.rbegin();ei != v.rend();ei++) {
+        bool match = true;
+
+        for (const auto &r : (*ei)->refs) {
+            const macro_t *m = macro_find(ctx,r.first);
+            if ((m != NULL ? m->fingerprint : uint64_t(0)) != r.second) {
+                match = false;
+                break;
+            }
+        }
+        for (const auto &o : (*ei)->once_refs) {
+            if (!match)
+                break;
+            if ((ctx.once_files.find(o.first) != ctx.once_files.end()) != o.second)
+                match = false;
+        }
+
+        if (match)
+            return *ei;
+    }
+
+    return shared_ptr<const pp_hdr_entry>();
+}
+
+static void pp_hdr_store(pp_context &ctx,const shared_ptr<const pp_hdr_entry> &e,const uint64_t generation) {
+    const string key = ctx.include_paths_key + e->path;
+    string b;
+
+    {
+        lock_guard<mutex> lock(pp_shared_lock);
+        if (generation != pp_cache_generation) /* a file it read may have changed */
+            return;
+
+        auto &v = pp_hdr_cache[key];
+
+        for (auto ei=v.begin();ei != v.end();) {
+            if ((*ei)->refs == e->refs && (*ei)->once_refs == e->once_refs)
+                ei = v.erase(ei);
+            else
+                ei++;
+        }
+
+        v.push_back(e);
+        if (v.size() > pp_hdr_max_per_file)
+            v.erase(v.begin());
+
+        if (!ctx.opt.header_cache_dir.empty())
+            b = pp_hdr_serialize(key,v);
+    }
+
+    if (!b.empty())
+        pp_hdr_write(ctx.opt.header_cache_dir,key,b);
+}
+
+/* do what the header did, its output is written after the #include line */
+static void pp_hdr_apply(pp_context &ctx,const shared_ptr<const pp_hdr_entry> &e) {
+    for (const auto &d : e->defs) {
+        if (d.second) {
+            const macro_t *m = ctx.macro_store.find(d.first);
+            if (m == NULL || m->fingerprint != d.second->fingerprint) {
+                macro_t nm(*d.second);
+                nm.version = ctx.macro_version_next++;
+                ctx.macro_store.define(d.first,move(nm));
+            }
+        }
+        else {
+            ctx.macro_store.undef(d.first);
+            if (ctx.pch && ctx.pch->find(d.first) != NULL)
+                ctx.macro_pch_hidden.insert(d.first);
+        }
+
+        pp_hdr_note_def(ctx,d.first);
+    }
+
+    for (const auto &o : e->once)
+        ctx.once_files.insert(o);
+    for (const auto &in : e->inputs)
+        pp_note_input(ctx,in.path);
+    for (const auto &a : e->absent)
+        pp_note_absent(ctx,a);
+
+    if (!ctx.hdr_recs.empty()) {
+        pp_hdr_rec &rec = ctx.hdr_recs.back();
+        for (const auto &o : e->once_refs)
+            pp_hdr_note_once(ctx,o.first,o.second);
+        rec.e.once.insert(rec.e.once.end(),e->once.begin(),e->once.end());
+        rec.e.inputs.insert(rec.e.inputs.end(),e->inputs.begin(),e->inputs.end());
+    }
+
+    ctx.hdr_replay = e;
+}
+
+static void pp_hdr_start(pp_context &ctx,FileSource &fs) {
+    pp_hdr_rec rec;
+    pp_hdr_input in;
+
+    rec.e.path = fs.get_path();
+    rec.text_start = ctx.out_text.size();
+    rec.generation = pp_cache_generation;
+    if (pp_hdr_stat(in,rec.e.path) && pp_file_content_hash(in.content_hash,rec.e.path))
+        rec.e.inputs.push_back(move(in));
+    else
+        rec.cacheable = false;
+
+    ctx.hdr_recs.push_back(move(rec));
+    ctx.out_dst.capture = &ctx.out_text;
+    fs.hdr_record = true;
+}
+
+/* the recorded header on top of in_src_stk ended */
+static void pp_hdr_finish(pp_context &ctx) {
+    pp_hdr_rec rec(move(ctx.hdr_recs.back()));
+
+    ctx.hdr_recs.pop_back();
+    rec.e.text = ctx.out_text.substr(rec.text_start);
+
+    for (const auto &name : rec.touched) {
+        const macro_t *m = ctx.macro_store.find(name);
+        shared_ptr<macro_t> d;
+
+        if (m != NULL) { /* the tokens may refer to this context's string_store */
+            d = make_shared<macro_t>(*m);
+            d->subst.clear();
+            d->body_parsed = false;
+            d->version = 0;
+        }
+
+        rec.e.defs.push_back(make_pair(name,shared_ptr<const macro_t>(d)));
+    }
+
+    if (!ctx.hdr_recs.empty()) {
+        pp_hdr_rec &parent = ctx.hdr_recs.back();
+
+        for (const auto &r : rec.e.refs) {
+            if (parent.seen.insert(r.first).second)
+                parent.e.refs.push_back(r);
+        }
+        for (const auto &name : rec.touched) {
+            parent.seen.insert(name);
+            parent.touched.insert(name);
+        }
+        for (const auto &o : rec.e.once_refs)
+            pp_hdr_note_once(ctx,o.first,o.second);
+
+        parent.e.once.insert(parent.e.once.end(),rec.e.once.begin(),rec.e.once.end());
+        parent.e.inputs.insert(parent.e.inputs.end(),rec.e.inputs.begin(),rec.e.inputs.end());
+        parent.e.absent.insert(rec.e.absent.begin(),rec.e.absent.end());
+        if (!rec.cacheable)
+            parent.cacheable = false;
+    }
+    else if (!ctx.result_cache) {
+        ctx.out_text.clear();
+        ctx.out_dst.capture = NULL;
+    }
+
+    if (rec.cacheable)
+        pp_hdr_store(ctx,make_shared<const pp_hdr_entry>(move(rec.e)),rec.generation);
+}
+
+/* #include. pushes the file on in_src_stk unless it is known to contribute nothing */
+void pp_include(pp_context &ctx,token_string::iterator &ti,const token_string::iterator &tie,const string &source) {
+    bool angled = false;
+    string name;
+
+    if (ti != tie && (*ti).tval == token::STRING) {
+        name = ctx.string_store.get_char((*ti).s.strref);
+        ti++;
+    }
+    else if (ti != tie && (*ti).tval == token::LESS_THAN) {
+        ti++;
+        while (ti != tie && (*ti).tval != token::GREATER_THAN)
+            name += pp_include_spelling(ctx,*(ti++));
+        if (ti == tie)
+            throw invalid_argument("#include expects \"FILENAME\" or <FILENAME>");
+        ti++;
+        angled = true;
+    }
+    else {
+        throw invalid_argument("#include expects \"FILENAME\" or <FILENAME>");
+    }
+
+    if (ti != tie)
+        fprintf(pp_stderr(),"WARNING: extra tokens at end of #include directive\n");
+    if (name.empty())
+        throw invalid_argument("empty filename in #include");
+
+    shared_ptr<const string> text;
+    string path;
+
+    if (ctx.include_hook) {
+        string t;
+        if (ctx.include_hook(name,angled,source,path,t))
+            text = make_shared<const string>(move(t));
+    }
+
+    if (!text)
+        path = pp_include_lookup(ctx,name,angled,source);
+    if (path.empty())
+        throw runtime_error(string("#include file not found: ") + name);
+
+    /* files created at the paths tried first would be found instead */
+    if (!text && (!ctx.hdr_recs.empty() || ctx.result_cache)) {
+        vector<string> v;
+
+        pp_include_candidates(v,ctx,name,angled,pp_include_dir(source,angled));
+        for (const auto &p : v) {
+            if (p == path)
+                break;
+            pp_note_absent(ctx,p);
+        }
+    }
+
+    /* include guard already defined, or #pragma once: nothing to read */
+    {
+        string guard;
+        {
+            lock_guard<mutex> lock(pp_shared_lock);
+            const auto gi = pp_include_guards.find(pp_path_key(path));
+            if (gi != pp_include_guards.end())
+                guard = gi->second;
+        }
+        if (!guard.empty() && is_macro(ctx,guard))
+            return;
+    }
+    if (!ctx.once_files.empty() || !ctx.hdr_recs.empty()) {
+        const string rpath = pp_realpath(path);
+        const bool once = ctx.once_files.find(rpath) != ctx.once_files.end();
+
+        if (!ctx.hdr_recs.empty())
+            pp_hdr_note_once(ctx,rpath,once);
+        if (once)
+            return;
+    }
+
+    if (ctx.include_defer != NULL) {
+        *ctx.include_defer = path;
+        return;
+    }
+
+    if (text) {
+        pp_hdr_uncacheable(ctx);
+    }
+    else if (ctx.hdr_cache) {
+        const auto e = pp_hdr_lookup(ctx,path);
+        if (e) {
+            pp_hdr_apply(ctx,e);
+            return;
+        }
+    }
+
+    if (size_t(ctx.in_src_stk.stkpos + 1) >= ctx.in_src_stk.src.size())
+        throw runtime_error("#include nested too deeply");
+
+    ctx.in_src_stk.push();
+
+    FileSource &fs = ctx.in_src_stk.top();
+    if (text)
+        fs.set(path,text);
+    else
+        fs.set(path);
+    fs.open();
+    if (!fs.is_open()) {
+        ctx.in_src_stk.pop();
+        throw runtime_error(string("Unable to open include file ") + path);
+    }
+
+    fs.cond_depth = ctx.cond_stack.size();
+    if (!text) { /* the index, PCH inputs and header cache are about files on disk */
+        pp_directive_index_attach(ctx,fs);
+        pp_note_input(ctx,path);
+        if (ctx.hdr_cache)
+            pp_hdr_start(ctx,fs);
+        if (ctx.opt.prefetch)
+            pp_prefetch_scan(ctx,fs);
+    }
+}
+
+bool accept_tokens(pp_context &ctx,const token_string::iterator &tib,const token_string::iterator &tie,const int32_t lineno,const string &source) {
+    bool pass = pp_pass(ctx);
+    auto ti = tib;
+
+    /* we're only looking for #preprocessor directives here that control conditional inclusion */
+    if (ti != tie && tokenit_next_match_inc(ti,tie,token::PREPROC)) {
+        if (tokenit_next_match_inc(ti,tie,token::IF)) {
+            pp_cond_t pc; pc.on_if(pp_if_eval(ctx,ti,tie),pass);
+            ctx.cond_stack.push(move(pc));
+        }
+        else if (tokenit_next_match_inc(ti,tie,token::ELIF)) {
+            if (!ctx.cond_stack.empty()) {
+                pp_cond_t &pc = ctx.cond_stack.top();
+
+                /* the condition only matters if the enclosing block is active and no branch was taken yet */
+                if (pc.pcond && !pc.cond)
+                    pc.on_elif(pp_if_eval(ctx,ti,tie));
+                else
+                    pc.on_elif(false);
+            }
+            else {
+                throw invalid_argument("#else not allowed here");
+            }
+        }
+        else if (tokenit_next_match_inc(ti,tie,token::IFDEF)) {
+            const string &ident = tokenit_next_identifier(ti,tie); /* will throw exception if not! */
+            pp_cond_t pc; pc.on_ifdef(is_macro(ctx,ident),pass);
+            ctx.cond_stack.push(move(pc));
+        }
+        else if (tokenit_next_match_inc(ti,tie,token::IFNDEF)) {
+            const string &ident = tokenit_next_identifier(ti,tie); /* will throw exception if not! */
+            pp_cond_t pc; pc.on_ifdef(!is_macro(ctx,ident),pass);
+            ctx.cond_stack.push(move(pc));
+        }
+        else if (tokenit_next_match_inc(ti,tie,token::DEFINE)) { /* some preprocessing done by the parse token code */
+            const string &ident = tokenit_next_identifier(ti,tie); /* will throw exception if not! */
+            macro_t macro;
+
+            macro.def_source = source;
+            macro.def_line = lineno;
+
+            if (tokenit_next_match_inc(ti,tie,token::OPEN_PARENS)) {
+                macro.parens = true;
+                /* parameter list, IDENTIFIER. Final one may be __VA_ARGS__ */
+                do {
+                    if (ti == tie) throw invalid_argument("#define macro param list expected close parens");
+                    if ((*ti).tval == token::IDENTIFIER) {
+                        if (find(macro.param.begin(),macro.param.end(),(*ti).sval) == macro.param.end()) {
+                            macro.param.push_back((*ti).sval);
+                            ti++;
+                        }
+                        else {
+                            throw invalid_argument(string("parameter specified more than once ") + (*ti).sval);
+                        }
+
+                        if (ti == tie) throw invalid_argument("#define macro param cut off suddenly");
+
+                        /* allow older style param... */
+                        if (tokenit_next_match_inc(ti,tie,token::DOTDOTDOT)) {
+                            macro.last_param_variadic = true;
+                            macro.last_param_optional = false;
+
+                            /* this must be the last param! */
+                            if (!tokenit_next_match_inc(ti,tie,token::CLOSE_PARENS))
+                                throw invalid_argument("#define macro param list expected close parens after ...");
+
+                            break;
+                        }
+                        else if (tokenit_next_match_inc(ti,tie,token::CLOSE_PARENS)) {
+                            break;
+                        }
+                        else if (tokenit_next_match_inc(ti,tie,token::COMMA)) {
+                            /* OK */
+                        }
+                    }
+                    else if (tokenit_next_match_inc(ti,tie,token::DOTDOTDOT)) {
+                        macro.param.push_back("__VA_ARGS__");
+                        macro.last_param_variadic = true;
+                        macro.last_param_optional = true;
+
+                        /* this must be the last param! */
+                        if (!tokenit_next_match_inc(ti,tie,token::CLOSE_PARENS))
+                            throw invalid_argument("#define macro param list expected close parens after ...");
+
+                        break;
+                    }
+                    else if (tokenit_next_match_inc(ti,tie,token::CLOSE_PARENS)) {
+                        break;
+                    }
+                    else {
+                        throw invalid_argument(string("unexpected token in macro parameter list ") + to_string(ctx,*ti));
+                    }
+                } while (1);
+            }
+
+            /* the body arrives as one MACRO token of raw text, tokenized on first use */
+            if (ti != tie) {
+                if ((*ti).tval != token::MACRO)
+                    throw invalid_argument(string("unexpected token in the body of a macro ") + to_string(ctx,*ti));
+
+                macro.body = (*ti).sval;
+                ti++;
+            }
+
+            if (ti != tie)
+                throw invalid_argument(string("unexpected token in the body of a macro ") + to_string(ctx,*ti));
+
+            macro.update_fingerprint();
+
+            {
+                const macro_t *mp = macro_find(ctx,ident);
+                if (mp != NULL) {
+                    /* identical redefinition is a no-op, nothing to copy */
+                    if (*mp != macro)
+                        fprintf(pp_stderr(),"WARNING: Macro '%s' redefinition\n",ident.c_str());
+                }
+                else {
+                    macro.version = ctx.macro_version_next++;
+                    ctx.macro_store.define(ident,move(macro));
+                    pp_hdr_note_def(ctx,ident);
+                }
+            }
+        }
+        else if (tokenit_next_match_inc(ti,tie,token::UNDEF)) {
+            const string &ident = tokenit_next_identifier(ti,tie); /* will throw exception if not! */
+
+            {
+                ctx.macro_store.undef(ident);
+                if (ctx.pch && ctx.pch->find(ident) != NULL)
+                    ctx.macro_pch_hidden.insert(ident);
+                pp_hdr_note_def(ctx,ident);
+            }
+        }
+        else if (tokenit_next_match_inc(ti,tie,token::ELSE)) {
+            if (!ctx.cond_stack.empty()) {
+                ctx.cond_stack.top().on_else();
+            }
+            else {
+                throw invalid_argument("#else not allowed here");
+            }
+        }
+        else if (tokenit_next_match_inc(ti,tie,token::INCLUDE)) {
+            if (pass)
+                pp_include(ctx,ti,tie,source);
+        }
+        else if (tokenit_next_match_inc(ti,tie,token::PRAGMA)) {
+            if (pass && ti != tie && (*ti).tval == token::IDENTIFIER) {
+                const string &what = (*ti).sval;
+
+                if (what == "once" && !source.empty()) {
+                    ctx.once_files.insert(pp_realpath(source));
+                    if (!ctx.hdr_recs.empty())
+                        ctx.hdr_recs.back().e.once.push_back(pp_realpath(source));
+                }
+                else if (what == "push_macro" || what == "pop_macro") {
+                    pp_hdr_uncacheable(ctx); /* depends on, and changes, the push_macro stack */
+                    ti++;
+                    if (!tokenit_next_match_inc(ti,tie,token::OPEN_PARENS) || ti == tie || (*ti).tval != token::STRING)
+                        throw invalid_argument("#pragma " + what + " expects (\"name\")");
+
+                    const string name = ctx.string_store.get_char((*ti).s.strref);
+                    ti++;
+                    if (!tokenit_next_match_inc(ti,tie,token::CLOSE_PARENS))
+                        throw invalid_argument("#pragma " + what + " expects (\"name\")");
+
+                    /* the definition itself is shared, not copied */
+                    (void)macro_find(ctx,name);
+                    vector<macro_table::ref_t> &st = ctx.macro_push_stack[name];
+                    if (what == "push_macro") {
+                        st.push_back(ctx.macro_store.get(name));
+                    }
+                    else if (!st.empty()) {
+                        if (!st.back() && ctx.pch && ctx.pch->find(name) != NULL)
+                            ctx.macro_pch_hidden.insert(name);
+                        ctx.macro_store.set(name,st.back());
+                        st.pop_back();
+                    }
+                }
+            }
+        }
+        else if (tokenit_next_match_inc(ti,tie,token::ENDIF)) {
+            /* an #endif cannot close a conditional of the file that included this one */
+            if (!ctx.cond_stack.empty() && (ctx.in_src_stk.empty() || ctx.cond_stack.size() > ctx.in_src_stk.top().cond_depth)) {
+                ctx.cond_stack.pop();
+                pass = pp_pass(ctx);
+            }
+            else {
+                throw invalid_argument("too many #endif");
+            }
+        }
+    }
+
+    return pass;
+}
+
+static string json_escape(const string &s) {
+    string r;
+
+    for (const auto c : s) {
+        if (c == '\"' || c == '\\') {
+            r += '\\';
+            r += c;
+        }
+        else if ((unsigned char)c < 0x20u) {
+            char tmp[8];
+            snprintf(tmp,sizeof(tmp),"\\u%04x",(unsigned int)((unsigned char)c));
+            r += tmp;
+        }
+        else {
+            r += c;
+        }
+    }
+
+    return r;
+}
+
+/* one line per macro, tab separated with a header line, so that the text form
+ * can be re-sorted with sort(1) as well */
+void write_macro_stats(pp_context &ctx) {
+    if (ctx.opt.macro_stats_file.empty())
+        return;
+
+    /* macros that are still defined but were never invoked are reported too */
+    map<string,const macro_t*> defined;
+    ctx.macro_store.list(defined);
+    for (const auto &m : defined) {
+        auto si = ctx.macro_stats.find(m.first);
+        if (si == ctx.macro_stats.end()) {
+            macro_stats_t &st = ctx.macro_stats[m.first];
+            st.def_source = m.second->def_source;
+            st.def_line = m.second->def_line;
+        }
+    }
+
+    vector< pair<string,macro_stats_t>* > order;
+    vector< pair<string,macro_stats_t> > list(ctx.macro_stats.begin(),ctx.macro_stats.end());
+
+    for (auto &e : list)
+        order.push_back(&e);
+
+    stable_sort(order.begin(),order.end(),[&ctx](const pair<string,macro_stats_t> *a,const pair<string,macro_stats_t> *b) {
+        switch (ctx.opt.macro_stats_sort) {
+            case macro_stats_sort_t::TIME:      return a->second.time_ns > b->second.time_ns;
+            case macro_stats_sort_t::CALLS:     return a->second.calls > b->second.calls;
+            case macro_stats_sort_t::TOKENS:    return a->second.tokens > b->second.tokens;
+            case macro_stats_sort_t::DEPTH:     return a->second.max_depth > b->second.max_depth;
+            case macro_stats_sort_t::NAME:      return a->first < b->first;
+        };
+        return false;
+    });
+
+    FILE *fp;
+
+    if (ctx.opt.macro_stats_file == "-")
+        fp = pp_stderr();
+    else if ((fp=fopen(ctx.opt.macro_stats_file.c_str(),"w")) == NULL) {
+        fprintf(pp_stderr(),"Unable to write macro statistics to %s\n",ctx.opt.macro_stats_file.c_str());
+        return;
+    }
+
+    if (ctx.opt.macro_stats_json) {
+        fprintf(fp,"[\n");
+        for (size_t i=0;i < order.size();i++) {
+            const auto &e = *order[i];
+            fprintf(fp,"  {\"name\":\"%s\",\"calls\":%llu,\"tokens\":%llu,\"max_depth\":%u,\"time_ns\":%llu,\"file\":\"%s\",\"line\":%ld}%s\n",
+                json_escape(e.first).c_str(),
+                (unsigned long long)e.second.calls,
+                (unsigned long long)e.second.tokens,
+                e.second.max_depth,
+                (unsigned long long)e.second.time_ns,
+                json_escape(e.second.def_source).c_str(),
+                (long)e.second.def_line,
+                (i+size_t(1)) < order.size() ? "," : "");
+        }
+        fprintf(fp,"]\n");
+    }
+    else {
+        fprintf(fp,"#time_ns\tcalls\ttokens\tmax_depth\tmacro\tdefined_at\n");
+        for (const auto *ep : order) {
+            const auto &e = *ep;
+            fprintf(fp,"%llu\t%llu\t%llu\t%u\t%s\t%s:%ld\n",
+                (unsigned long long)e.second.time_ns,
+                (unsigned long long)e.second.calls,
+                (unsigned long long)e.second.tokens,
+                e.second.max_depth,
+                e.first.c_str(),
+                e.second.def_source.empty() ? "-" : e.second.def_source.c_str(),
+                (long)e.second.def_line);
+        }
+    }
+
+    if (fp != pp_stderr())
+        fclose(fp);
+}
+
+bool pp_allow_token_display(const token_string &tokens) {
+    auto ti = tokens.begin();
+    const auto tie = tokens.end();
+
+    if (ti != tie) {
+        if ((*ti).tval == token::PREPROC) {
+            ti++;
+
+            return false;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+/* write one line of tokens in the -ET or -E format, preceded by #line if the output lost track */
+void emit_tokens_line(pp_context &ctx,FileDest &dst,bool &emit_line,int32_t &lineno_expect,const token_string &tokens,const int32_t lineno,const string &source) {
+    if (ctx.opt.pp_only && !pp_allow_token_display(tokens))
+        return;
+
+    if (lineno_expect != lineno)
+        emit_line = true;
+
+    if (emit_line) {
+        dst.puts(string("#line ") + to_string(lineno) + " " + source + "\n");
+        emit_line = false;
+    }
+
+    for (const auto &t : tokens)
+        dst.puts(ctx.opt.ppt_only ? to_string(ctx,t) : to_string_pp(ctx,t));
+
+    dst.putc('\n');
+    lineno_expect = lineno + int32_t(1);
+}
+
+void pp_pch_file::close() {
+    if (base != MAP_FAILED) {
+        munmap(base,size);
+        base = MAP_FAILED;
+    }
+
+    size = 0;
+    hdr = NULL;
+    inputs = NULL;
+    macros = NULL;
+    params = NULL;
+    guards = NULL;
+    once = NULL;
+    strtab = NULL;
+}
+
+/* map the file and check that it is intact and that none of its inputs changed.
+ * throws if the file is unusable, the caller decides whether that is fatal */
+void pp_pch_file::load(const string &path) {
+    struct stat st;
+
+    close();
+
+    const int fd = open(path.c_str(),O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("cannot open");
+    if (fstat(fd,&st) != 0 || size_t(st.st_size) < sizeof(pp_pch_header)) {
+        ::close(fd);
+        throw runtime_error("not a PCH file");
+    }
+
+    size = size_t(st.st_size);
+    base = mmap(NULL,size,PROT_READ,MAP_PRIVATE,fd,0);
+    ::close(fd);
+    if (base == MAP_FAILED)
+        throw runtime_error("cannot map");
+
+    const char *b = (const char*)base;
+    const pp_pch_header *h = (const pp_pch_header*)b;
+
+    if (memcmp(h->magic,"HAXPCH2",8) != 0 || h->header_size != sizeof(pp_pch_header)) {
+        close();
+        throw runtime_error("not a PCH file, or from a different build");
+    }
+    if (fnv1a64(fnv1a64_init,b+sizeof(pp_pch_header),size-sizeof(pp_pch_header)) != h->hash) {
+        close();
+        throw runtime_error("corrupt");
+    }
+
+    /* every table must lie inside the file */
+    const auto inside = [this](const uint32_t off,const size_t count,const size_t esz) {
+        return off <= size && count <= (size - off) / esz;
+    };
+    if (!inside(h->inputs_off,h->input_count,sizeof(pp_pch_input)) ||
+        !inside(h->macros_off,h->macro_count,sizeof(pp_pch_macro)) ||
+        !inside(h->params_off,h->param_count,sizeof(pp_pch_str)) ||
+        !inside(h->guards_off,h->guard_count,sizeof(pp_pch_guard)) ||
+        !inside(h->once_off,h->once_count,sizeof(pp_pch_str)) ||
+        !inside(h->strtab_off,h->strtab_size,1)) {
+        close();
+        throw runtime_error("corrupt");
+    }
+
+    inputs = (const pp_pch_input*)(b + h->inputs_off);
+    macros = (const pp_pch_macro*)(b + h->macros_off);
+    params = (const pp_pch_str*)(b + h->params_off);
+    guards = (const pp_pch_guard*)(b + h->guards_off);
+    once = (const pp_pch_str*)(b + h->once_off);
+    strtab = b + h->strtab_off;
+
+    /* and every string and parameter list inside its table, str() and to_macro() trust them */
+    const auto str_ok = [h](const pp_pch_str &s) {
+        return s.off <= h->strtab_size && s.len <= h->strtab_size - s.off;
+    };
+    bool ok = true;
+    for (uint32_t i=0;ok && i < h->input_count;i++)
+        ok = str_ok(inputs[i].path);
+    for (uint32_t i=0;ok && i < h->macro_count;i++) {
+        const pp_pch_macro &pm = macros[i];
+        ok = str_ok(pm.name) && str_ok(pm.body) && str_ok(pm.def_source) &&
+            pm.param_first <= h->param_count && pm.param_count <= h->param_count - pm.param_first;
+    }
+    for (uint32_t i=0;ok && i < h->param_count;i++)
+        ok = str_ok(params[i]);
+    for (uint32_t i=0;ok && i < h->guard_count;i++)
+        ok = str_ok(guards[i].path) && str_ok(guards[i].macro);
+    for (uint32_t i=0;ok && i < h->once_count;i++)
+        ok = str_ok(once[i]);
+    if (!ok) {
+        close();
+        throw runtime_error("corrupt");
+    }
+
+    hdr = h;
+    this->path = path;
+
+    /* size and mtime unchanged is taken as unchanged, otherwise the content decides */
+    for (uint32_t i=0;i < h->input_count;i++) {
+        const pp_pch_input &in = inputs[i];
+        const string ipath = str(in.path);
+        uint64_t ch;
+
+        if (stat(ipath.c_str(),&st) != 0 || uint64_t(st.st_size) != in.size) {
+            close();
+            throw runtime_error(ipath + " changed");
+        }
+        if (int64_t(st.st_mtime) != in.mtime && (!pp_file_content_hash(ch,ipath) || ch != in.content_hash)) {
+            close();
+            throw runtime_error(ipath + " changed");
+        }
+    }
+}
+
+const pp_pch_macro *pp_pch_file::find(const string &name) const {
+    size_t lo = 0,hi = hdr->macro_count;
+
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / size_t(2);
+        const pp_pch_str &n = macros[mid].name;
+        int c = memcmp(strtab + n.off,name.data(),min(size_t(n.len),name.size()));
+        if (c == 0) c = (size_t(n.len) < name.size()) ? -1 : (size_t(n.len) > name.size() ? 1 : 0);
+
+        if (c == 0)
+            return &macros[mid];
+        else if (c < 0)
+            lo = mid + size_t(1);
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+void pp_pch_file::to_macro(macro_t &m,const pp_pch_macro &pm) const {
+    m.body = str(pm.body);
+    m.body_parsed = false;
+    m.subst.clear();
+    m.param.clear();
+    for (uint32_t i=0;i < pm.param_count;i++)
+        m.param.push_back(str(params[pm.param_first+i]));
+    m.parens = (pm.flags & 1u) != 0;
+    m.last_param_variadic = (pm.flags & 2u) != 0;
+    m.last_param_optional = (pm.flags & 4u) != 0;
+    m.fingerprint = pm.fingerprint;
+    m.def_source = str(pm.def_source);
+    m.def_line = pm.def_line;
+}
+
+/* the options the macro table depends on. a PCH saved with -DFOO=1 would otherwise
+ * go on expanding FOO to 1 under -DFOO=2 */
+static uint64_t pp_pch_options_hash(const pp_context &ctx) {
+    uint64_t h = fnv1a64_init;
+
+    for (const auto &m : ctx.opt.cmdline_macros) {
+        h = fnv1a64(h,&m.first,sizeof(m.first));
+        h = fnv1a64(h,m.second.c_str(),m.second.size() + size_t(1));
+    }
+    h = fnv1a64(h,ctx.include_paths_key);
+
+    return h;
+}
+
+/* --pch: map the file and copy its include guards, which are shared by every context.
+ * returns NULL, after a warning, if the file cannot be used */
+static shared_ptr<const pp_pch_file> pp_pch_load(const string &path) {
+    auto pch = make_shared<pp_pch_file>();
+
+    try {
+        pch->load(path);
+    }
+    catch (const exception &e) {
+        fprintf(pp_stderr(),"WARNING: PCH %s not used: %s\n",path.c_str(),e.what());
+        return shared_ptr<const pp_pch_file>();
+    }
+
+    lock_guard<mutex> lock(pp_shared_lock);
+    for (uint32_t i=0;i < pch->hdr->guard_count;i++)
+        pp_include_guards[pp_path_key(pch->str(pch->guards[i].path))] = pch->str(pch->guards[i].macro);
+
+    return pch;
 }
 
-string to_string_pp(const token &t) {
-    switch (t.tval) {
-        case token::MACRO:
-            return t.sval + " ";
-        case token::PREPROC:
-            return "";
-        case token::MACROSUBST:
-            return t.sval + " ";
-        case token::IDENTIFIER:
-            return t.sval + " ";
-        case token::MACROPARAM:
-            return "";
-        case token::INTEGER:
-            return to_string(t.i.s) + " ";
-        case token::FLOAT:
-            return a_better_float_to_string(t.f.get_double()) + " ";
-        case token::STRING:
-            return string("\"") + string_store.get_char(t.s.strref) + string("\"") + " ";
-        default:
-            break;
-    };
+/* --pch: macros stay in the mapping until used, #pragma once files are copied.
+ * the file is loaded unless the context was given one already (other --batch units) */
+void pp_pch_apply(pp_context &ctx) {
+    if (!ctx.pch && !ctx.opt.pch_load_file.empty())
+        ctx.pch = pp_pch_load(ctx.opt.pch_load_file);
+
+    if (!ctx.pch)
+        return;
+
+    /* checked per context, --batch units can add their own -D and -I */
+    if (ctx.pch->hdr->options_hash != pp_pch_options_hash(ctx)) {
+        fprintf(pp_stderr(),"WARNING: PCH %s not used: saved with different -D, -U or -I options\n",ctx.pch->path.c_str());
+        ctx.pch.reset();
+        return;
+    }
 
-    return to_string(t);
+    for (uint32_t i=0;i < ctx.pch->hdr->once_count;i++)
+        ctx.once_files.insert(ctx.pch->str(ctx.pch->once[i]));
+    for (uint32_t i=0;i < ctx.pch->hdr->input_count;i++)
+        pp_note_input(ctx,ctx.pch->str(ctx.pch->inputs[i].path));
 }
 
-void print_token(FILE *fp,const token &t) {
-    if (fp == NULL)
-        fp = stderr;
+template <class T> static uint32_t pp_pch_append(string &buf,const vector<T> &v) {
+    while (buf.size() % size_t(8)) buf += char(0);
 
-    const string s = to_string(t);
-    fputs(s.c_str(),fp);
+    const uint32_t off = uint32_t(buf.size());
+    if (!v.empty())
+        buf.append((const char*)v.data(),v.size() * sizeof(T));
+
+    return off;
 }
 
-string do_macro_expand_read_invoke_param(string::iterator &li,const string::iterator lie,bool final_variadic=false) {
-    int paren = 0;
-    string r;
+void pp_pch_save(pp_context &ctx) {
+    map<string,uint32_t> strs;
+    string strtab;
 
-    do {
-        if (li == lie)
-            throw invalid_argument("string terminated unexpectedly");
-        if (*li == '(') {
-            paren++;
+    const auto addstr = [&strs,&strtab](const string &x) {
+        pp_pch_str r;
+        auto si = strs.find(x);
+
+        if (si == strs.end()) {
+            si = strs.insert(make_pair(x,uint32_t(strtab.size()))).first;
+            strtab += x;
         }
-        else if (*li == ')') {
-            if (paren > 0)
-                paren--;
+
+        r.off = si->second;
+        r.len = uint32_t(x.size());
+        return r;
+    };
+
+    vector<pp_pch_input> inputs;
+    for (const auto &path : ctx.inputs) {
+        struct stat st;
+        pp_pch_input in;
+
+        if (stat(path.c_str(),&st) != 0 || !pp_file_content_hash(in.content_hash,path))
+            throw runtime_error("cannot read " + path + " for --pch-save");
+
+        in.path = addstr(path);
+        in.size = uint64_t(st.st_size);
+        in.mtime = int64_t(st.st_mtime);
+        inputs.push_back(in);
+    }
+
+    /* macros still only in a loaded PCH are carried over */
+    if (ctx.pch) {
+        for (uint32_t i=0;i < ctx.pch->hdr->macro_count;i++)
+            (void)macro_find(ctx,ctx.pch->str(ctx.pch->macros[i].name));
+    }
+
+    vector<pp_pch_macro> macros;
+    vector<pp_pch_str> params;
+    map<string,const macro_t*> defined;
+    ctx.macro_store.list(defined);
+    for (const auto &me : defined) { /* map order is the sorted order find() expects */
+        const macro_t &m = *me.second;
+        pp_pch_macro pm;
+
+        pm.name = addstr(me.first);
+        pm.body = addstr(m.body);
+        pm.def_source = addstr(m.def_source);
+        pm.def_line = m.def_line;
+        pm.param_first = uint32_t(params.size());
+        pm.param_count = uint32_t(m.param.size());
+        pm.flags = (m.parens ? 1u : 0u) + (m.last_param_variadic ? 2u : 0u) + (m.last_param_optional ? 4u : 0u);
+        pm.fingerprint = m.fingerprint;
+        for (const auto &p : m.param)
+            params.push_back(addstr(p));
+
+        macros.push_back(pm);
+    }
+
+    vector<pp_pch_guard> guards;
+    for (const auto &g : pp_include_guards) {
+        pp_pch_guard pg;
+
+        pg.path = addstr(g.first);
+        pg.macro = addstr(g.second);
+        guards.push_back(pg);
+    }
+
+    vector<pp_pch_str> once;
+    for (const auto &o : ctx.once_files)
+        once.push_back(addstr(o));
+
+    pp_pch_header h;
+    string buf(sizeof(h),char(0));
+
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,"HAXPCH2",8);
+    h.header_size = sizeof(h);
+    h.input_count = uint32_t(inputs.size());
+    h.macro_count = uint32_t(macros.size());
+    h.param_count = uint32_t(params.size());
+    h.guard_count = uint32_t(guards.size());
+    h.once_count = uint32_t(once.size());
+    h.inputs_off = pp_pch_append(buf,inputs);
+    h.macros_off = pp_pch_append(buf,macros);
+    h.params_off = pp_pch_append(buf,params);
+    h.guards_off = pp_pch_append(buf,guards);
+    h.once_off = pp_pch_append(buf,once);
+    h.strtab_off = uint32_t(buf.size());
+    h.strtab_size = uint32_t(strtab.size());
+    h.options_hash = pp_pch_options_hash(ctx);
+    buf += strtab;
+    h.hash = fnv1a64(fnv1a64_init,buf.data()+sizeof(h),buf.size()-sizeof(h));
+    memcpy(&buf[0],&h,sizeof(h));
+
+    /* write then rename, so that a reader never maps a half written file */
+    const string tmp = ctx.opt.pch_save_file + ".tmp";
+    FILE *fp = fopen(tmp.c_str(),"wb");
+    if (fp == NULL)
+        throw runtime_error("cannot write " + tmp);
+
+    const bool ok = fwrite(buf.data(),buf.size(),1,fp) == 1;
+    if (fclose(fp) != 0 || !ok || rename(tmp.c_str(),ctx.opt.pch_save_file.c_str()) != 0) {
+        remove(tmp.c_str());
+        throw runtime_error("cannot write " + ctx.opt.pch_save_file);
+    }
+}
+
+/* -D and -U, applied as if they were #define and #undef lines */
+void apply_cmdline_macros(pp_context &ctx,const vector< pair<char,string> > &macros) {
+    token_string tokens;
+
+    for (const auto &cm : macros) {
+        string line;
+
+        if (cm.first == 'D') {
+            const size_t eq = cm.second.find('=');
+            if (eq != string::npos)
+                line = string("#define ") + cm.second.substr(0,eq) + " " + cm.second.substr(eq+size_t(1));
             else
-                break;
+                line = string("#define ") + cm.second + " 1";
+
+            ctx.unifdef_undefined.erase(cm.second.substr(0,eq));
         }
-        else if (*li == ',' && !final_variadic) {
+        else {
+            line = string("#undef ") + cm.second;
+            ctx.unifdef_undefined.insert(cm.second);
+        }
+
+        tokens.clear();
+        parse_tokens(ctx,tokens,line.begin(),line.end(),0,"<command-line>");
+        accept_tokens(ctx,tokens.begin(),tokens.end(),0,"<command-line>");
+    }
+}
+
+/* --unifdef state of one conditional */
+class unifdef_cond_t {
+public:
+    bool                        parent_out = true;  /* the enclosing block is copied to the output */
+    bool                        out = true;         /* the current branch is copied to the output */
+    bool                        keep = false;       /* this conditional's directives are copied to the output */
+    bool                        taken = false;      /* a branch was known to be true */
+};
+
+pp_tristate_t unifdef_eval(pp_context &ctx,const string &line,const int32_t lineno,const string &source) {
+    token_string tokens;
+
+    parse_tokens(ctx,tokens,const_cast<string&>(line).begin(),const_cast<string&>(line).end(),lineno,source);
+
+    auto ti = tokens.begin();
+    const auto tie = tokens.end();
+
+    if (!tokenit_next_match_inc(ti,tie,token::PREPROC))
+        throw runtime_error("unifdef_eval called on non-directive");
+
+    if (tokenit_next_match_inc(ti,tie,token::IFDEF) || tokenit_next_match_inc(ti,tie,token::IFNDEF)) {
+        const bool ifndef = (tokens[1].tval == token::IFNDEF);
+        const string &ident = tokenit_next_identifier(ti,tie);
+
+        if (is_macro(ctx,ident))
+            return ifndef ? pp_tristate_t::NO : pp_tristate_t::YES;
+        if (ctx.unifdef_undefined.find(ident) != ctx.unifdef_undefined.end())
+            return ifndef ? pp_tristate_t::YES : pp_tristate_t::NO;
+
+        return pp_tristate_t::UNKNOWN;
+    }
+
+    if (!tokenit_next_match_inc(ti,tie,token::IF) && !tokenit_next_match_inc(ti,tie,token::ELIF))
+        throw runtime_error("unifdef_eval called on non-conditional");
+    if (ti == tie)
+        throw invalid_argument("macro if condition requires something to evaluate");
+
+    expression &expr = *ctx.expr;
+
+    expr.clear();
+    expr.root = parse_expr(expr,ti,tie);
+    if (ti != tie)
+        throw invalid_argument("if condition did not fully parse");
+
+    pp_if_program prog;
+    signed long long v;
+
+    prog.tristate = true;
+    pp_if_compile(ctx,prog,expr,expr.root);
+    return prog.run3(ctx,v);
+}
+
+/* turn the raw text of an #elif into an #if */
+string unifdef_elif_to_if(const string &raw,const string &rest) {
+    size_t i = raw.find('#');
+
+    if (i != string::npos) {
+        i++;
+        while (i < raw.size() && (raw[i] == ' ' || raw[i] == '\t')) i++;
+        if (raw.compare(i,4,"elif") == 0)
+            return raw.substr(0,i) + raw.substr(i+size_t(2));
+    }
+
+    return string("#if") + rest + "\n";
+}
+
+/* --unifdef: copy the file to the output, resolving the conditionals whose value is fixed
+ * by -D and -U. every other line, including the directives of conditionals that could go
+ * either way, is copied as written */
+void unifdef_file(pp_context &ctx,FileSource &src,FileDest &dst) {
+    vector<unifdef_cond_t> conds;
+    string line,raw;
+
+    src.capture = &raw;
+    while (true) {
+        const int32_t lineno = src.current_line();
+
+        raw.clear();
+        if (!read_line(ctx,line,src) && raw.empty())
             break;
+
+        const bool out = conds.empty() || conds.back().out;
+
+        /* directive? */
+        size_t i = 0;
+        while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) i++;
+        if (i >= line.size() || line[i] != '#') {
+            if (out) dst.puts(raw);
+            continue;
         }
 
-        r += *(li++);
-    } while (1);
+        i++;
+        while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) i++;
+        const size_t kb = i;
+        while (i < line.size() && isidentifier_mc(line[i])) i++;
+        const token::token_t kind = is_pp_keyword(line.substr(kb,i-kb));
 
-    return r;
+        if (kind == token::IF || kind == token::IFDEF || kind == token::IFNDEF) {
+            unifdef_cond_t c;
+
+            c.parent_out = out;
+            if (!out) {
+                c.out = false;
+                c.taken = true;
+            }
+            else {
+                const pp_tristate_t r = unifdef_eval(ctx,line,lineno,src.get_path());
+
+                c.out = (r != pp_tristate_t::NO);
+                c.keep = (r == pp_tristate_t::UNKNOWN);
+                c.taken = (r == pp_tristate_t::YES);
+                if (c.keep) dst.puts(raw);
+            }
+
+            conds.push_back(c);
+        }
+        else if (kind == token::ELIF) {
+            if (conds.empty())
+                throw invalid_argument("#elif not allowed here");
+
+            unifdef_cond_t &c = conds.back();
+            if (!c.parent_out)
+                continue;
+
+            if (c.taken) {
+                c.out = false;
+                continue;
+            }
+
+            const pp_tristate_t r = unifdef_eval(ctx,line,lineno,src.get_path());
+            if (r == pp_tristate_t::YES) {
+                c.out = c.taken = true;
+                if (c.keep) dst.puts("#else\n"); /* the rest of the branches cannot be taken */
+            }
+            else if (r == pp_tristate_t::NO) {
+                c.out = false;
+            }
+            else {
+                c.out = true;
+                if (c.keep) {
+                    dst.puts(raw);
+                }
+                else { /* every branch before this was false, so this one starts the conditional */
+                    dst.puts(unifdef_elif_to_if(raw,line.substr(i)));
+                    c.keep = true;
+                }
+            }
+        }
+        else if (kind == token::ELSE) {
+            if (conds.empty())
+                throw invalid_argument("#else not allowed here");
+
+            unifdef_cond_t &c = conds.back();
+            if (!c.parent_out)
+                continue;
+
+            if (c.taken) {
+                c.out = false;
+            }
+            else {
+                c.out = true;
+                if (c.keep) dst.puts(raw);
+                else c.taken = true;
+            }
+        }
+        else if (kind == token::ENDIF) {
+            if (conds.empty())
+                throw invalid_argument("too many #endif");
+
+            if (conds.back().parent_out && conds.back().keep)
+                dst.puts(raw);
+
+            conds.pop_back();
+        }
+        else if (out) {
+            dst.puts(raw);
+        }
+    }
+    src.capture = NULL;
+
+    if (!conds.empty())
+        throw invalid_argument("unterminated conditional at end of file");
 }
 
-string pp_stringify(const string &s) {
-    string r;
+/* make configuration i the current one, or put it back */
+void pp_config_swap(pp_context &ctx,pp_config_t &cfg) {
+    swap(ctx.macro_store,cfg.macro_store);
+    swap(ctx.cond_stack,cfg.cond_stack);
+    swap(ctx.once_files,cfg.once_files);
+    swap(ctx.macro_pch_hidden,cfg.pch_hidden);
+    swap(ctx.macro_push_stack,cfg.push_stack);
+}
+
+/* the macros a line consulted, with the fingerprint each had (0 if not defined) */
+typedef vector< pair<string,uint64_t> > pp_config_refs_t;
+
+bool pp_config_refs_match(pp_context &ctx,const pp_config_refs_t &refs) {
+    for (const auto &r : refs) {
+        const macro_t *m = macro_find(ctx,r.first);
+        if ((m != NULL ? m->fingerprint : uint64_t(0)) != r.second)
+            return false;
+    }
+
+    return true;
+}
+
+/* --config: read and split the input into lines once, and run every line through each
+ * configuration that is reading the file. a text line is tokenized once for every group
+ * of configurations in which the macros it consults are defined the same way */
+void pp_config_run(pp_context &ctx,int32_t &err_lineno,string &err_source) {
+    const uint64_t all = (ctx.configs.size() >= pp_configs_max) ? ~uint64_t(0) : ((uint64_t(1) << ctx.configs.size()) - uint64_t(1));
+    vector< pair<pp_config_refs_t,token_string> > shared;
+    pp_config_refs_t log;
+    token_string tokens;
+    string include;
+    string line;
+
+    /* the common -D/-U once, then each configuration forks the macro table */
+    apply_cmdline_macros(ctx,ctx.opt.cmdline_macros);
+    for (auto &cfg : ctx.configs) {
+        cfg.once_files = ctx.once_files; /* from --pch */
+        cfg.macro_store = ctx.macro_store.snapshot();
+        cfg.pch_hidden = ctx.macro_pch_hidden;
+        pp_config_swap(ctx,cfg);
+        apply_cmdline_macros(ctx,cfg.macros);
+        pp_config_swap(ctx,cfg);
+        cfg.cond_depths.push_back(0);
+    }
+
+    ctx.in_src_stk.top().configs = all;
+    ctx.include_defer = &include;
+
+    while (!ctx.in_src_stk.empty()) {
+        FileSource &src = ctx.in_src_stk.top();
+        const int32_t lineno = src.current_line();
+        const string source = src.get_path();
+        const uint64_t configs = src.configs;
+        uint64_t includers = 0;
+        string include_path;
+
+        err_lineno = lineno;
+        err_source = source;
+        ctx.budget.check_time();
+
+        const long offset = pp_directive_index_building(src) ? src.tell() : -1l;
+        if (!read_line(ctx,/*&*/line,src)) {
+            if (!src.eof())
+                continue;
+
+            for (size_t i=0;i < ctx.configs.size();i++) {
+                if (!(configs & (uint64_t(1) << i))) continue;
+                pp_config_t &cfg = ctx.configs[i];
+
+                if (cfg.cond_stack.size() > cfg.cond_depths.back())
+                    throw invalid_argument("unterminated conditional at end of file (" + cfg.out_file + ")");
+
+                cfg.cond_depths.pop_back();
+                cfg.emit_line = true;
+            }
+
+            pp_directive_index_detach(src);
+            ctx.in_src_stk.pop();
+            continue;
+        }
+        pp_directive_index_note_line(src,offset,lineno,line);
+
+        size_t p = 0;
+        while (p < line.size() && (line[p] == ' ' || line[p] == '\t')) p++;
+        const bool directive = (p < line.size() && line[p] == '#');
+
+        shared.clear();
+        for (size_t i=0;i < ctx.configs.size();i++) {
+            if (!(configs & (uint64_t(1) << i))) continue;
+            pp_config_t &cfg = ctx.configs[i];
+
+            /* text lines only matter where they are active */
+            if (!directive && !(cfg.cond_stack.empty() || cfg.cond_stack.top().eval()))
+                continue;
+
+            pp_config_swap(ctx,cfg);
+            try {
+                token_string *use = &tokens;
+
+                src.cond_depth = cfg.cond_depths.back();
+                if (directive) {
+                    tokens.clear();
+                    parse_tokens(ctx,tokens,line.begin(),line.end(),lineno,source);
+                }
+                else {
+                    use = NULL;
+                    for (auto &sh : shared) {
+                        if (pp_config_refs_match(ctx,sh.first)) {
+                            use = &sh.second;
+                            break;
+                        }
+                    }
+
+                    if (use == NULL) {
+                        tokens.clear();
+                        log.clear();
+                        ctx.macro_ref_log = &log;
+                        parse_tokens(ctx,tokens,line.begin(),line.end(),lineno,source);
+                        ctx.macro_ref_log = NULL;
+
+                        pp_config_refs_t refs;
+                        for (const auto &r : log) {
+                            const macro_t *m = macro_find(ctx,r.first);
+                            refs.push_back(make_pair(r.first,m != NULL ? m->fingerprint : uint64_t(0)));
+                        }
+
+                        shared.push_back(make_pair(move(refs),tokens));
+                        use = &shared.back().second;
+                    }
+                }
+
+                src.token_count += use->size();
+                ctx.budget.check_file_tokens(src.token_count);
+
+                include.clear();
+                const bool pass = accept_tokens(ctx,use->begin(),use->end(),lineno,source);
+
+                if (!include.empty()) {
+                    if (includers != 0 && include != include_path)
+                        throw runtime_error("configurations #include different files here: " + include_path + ", " + include);
+
+                    include_path = include;
+                    includers |= uint64_t(1) << i;
+                    cfg.cond_depths.push_back(ctx.cond_stack.size());
+                    cfg.emit_line = true;
+                }
+
+                if (pass)
+                    emit_tokens_line(ctx,cfg.out,cfg.emit_line,cfg.lineno_expect,*use,lineno,source);
+            }
+            catch (const exception &e) {
+                ctx.macro_ref_log = NULL;
+                pp_config_swap(ctx,cfg);
+                throw runtime_error(string(e.what()) + " (" + cfg.out_file + ")");
+            }
+            pp_config_swap(ctx,cfg);
+        }
+
+        /* one push for every configuration that included the file */
+        if (includers != 0) {
+            if (size_t(ctx.in_src_stk.stkpos + 1) >= ctx.in_src_stk.src.size())
+                throw runtime_error("#include nested too deeply");
+
+            ctx.in_src_stk.push();
+
+            FileSource &fs = ctx.in_src_stk.top();
+            fs.set(include_path);
+            fs.open();
+            if (!fs.is_open()) {
+                ctx.in_src_stk.pop();
+                throw runtime_error(string("Unable to open include file ") + include_path);
+            }
+
+            fs.configs = includers;
+            pp_directive_index_attach(ctx,fs);
+            pp_note_input(ctx,include_path);
+        }
+    }
+
+    ctx.include_defer = NULL;
+}
+
+pp_context::pp_context(const pp_options &o) : opt(o), budget(o.budget), configs(o.configs), expr(new expression()) {
+    if (!pp_cwd.empty()) { /* --daemon: relative -I paths depend on the client's directory */
+        include_paths_key += pp_cwd;
+        include_paths_key += '\0';
+    }
+    for (const auto &ip : opt.include_paths) {
+        include_paths_key += ip;
+        include_paths_key += '\0';
+    }
+    include_paths_key += '\1';
+}
+
+pp_context::~pp_context() {
+}
+
+/* preprocess the source on top of ctx.in_src_stk to ctx.out_dst, or ctx.line_hook */
+static int preprocess_run(pp_context &ctx) {
+    string line;
+    bool emit_line = false;
+    int32_t lineno_expect = -1;
+    int32_t err_lineno = 0;
+    string err_source;
+    token_string tokens;
+
+    ctx.budget.start();
+
+    /* replaying a header's output is only exact for -E, and other output paths do not record it */
+    if (ctx.opt.header_cache) {
+        ctx.hdr_cache = ctx.opt.pp_only && !ctx.opt.ppt_only && !ctx.opt.ppp_only && !ctx.opt.unifdef && ctx.configs.empty() &&
+            !ctx.line_hook && ctx.opt.macro_stats_file.empty() && ctx.opt.pch_save_file.empty();
+        if (!ctx.hdr_cache)
+            fprintf(pp_stderr(),"WARNING: --header-cache only works with -E, without --config, --unifdef, --macro-stats or --pch-save\n");
+    }
+
+    try {
+    pp_pch_apply(ctx);
+
+    if (!ctx.configs.empty()) {
+        pp_config_run(ctx,/*&*/err_lineno,/*&*/err_source);
+        write_macro_stats(ctx);
+        return 0;
+    }
+
+    apply_cmdline_macros(ctx,ctx.opt.cmdline_macros);
+
+    if (ctx.opt.unifdef) {
+        unifdef_file(ctx,ctx.in_src_stk.top(),ctx.out_dst);
+        ctx.in_src_stk.pop();
+    }
+
+    while (!ctx.in_src_stk.empty()) {
+        int32_t lineno = ctx.in_src_stk.top().current_line();
+        const string &source = ctx.in_src_stk.top().get_path();
+        bool got_line;
+
+        err_lineno = lineno;
+        err_source = source;
+        ctx.budget.check_time();
+
+        /* inside an inactive conditional block, only look for the directive that ends it */
+        if (!ctx.opt.ppp_only && !pp_pass(ctx)) {
+            got_line = read_line_skip_inactive(ctx,/*&*/line,ctx.in_src_stk.top(),/*&*/lineno);
+        }
+        else {
+            const long offset = pp_directive_index_building(ctx.in_src_stk.top()) ? ctx.in_src_stk.top().tell() : -1l;
+
+            got_line = read_line(ctx,/*&*/line,ctx.in_src_stk.top());
+            if (got_line)
+                pp_directive_index_note_line(ctx.in_src_stk.top(),offset,lineno,line);
+        }
+
+        err_lineno = lineno;
+
+        if (got_line) {
+            if (ctx.opt.ppp_only) {
+                if (lineno_expect != lineno)
+                    emit_line = true;
+
+                if (emit_line) {
+                    ctx.out_dst.puts(string("#line ") + to_string(lineno) + " " + source + "\n");
+                    emit_line = false;
+                }
+
+                ctx.out_dst.puts(line);
+                ctx.out_dst.putc('\n');
+                lineno_expect = lineno + int32_t(1);
+            }
+            else {
+                const ssize_t stkpos = ctx.in_src_stk.stkpos;
+
+                tokens.clear();
+                parse_tokens(ctx,tokens,line.begin(),line.end(),lineno,source);
+                ctx.in_src_stk.top().token_count += tokens.size();
+                ctx.budget.check_file_tokens(ctx.in_src_stk.top().token_count);
+
+                const bool pass = accept_tokens(ctx,tokens.begin(),tokens.end(),lineno,source);
+                if (ctx.in_src_stk.stkpos != stkpos) /* #include */
+                    emit_line = true;
+
+                if (pass && ctx.line_hook) {
+                    if (pp_allow_token_display(tokens))
+                        ctx.line_hook(ctx,tokens,lineno,source);
+                }
+                else if (pass && (ctx.opt.ppt_only || ctx.opt.pp_only)) {
+                    emit_tokens_line(ctx,ctx.out_dst,emit_line,lineno_expect,tokens,lineno,source);
+                }
+
+                if (ctx.hdr_replay) { /* --header-cache: the #include was answered from the cache */
+                    ctx.out_dst.puts(ctx.hdr_replay->text);
+                    ctx.hdr_replay.reset();
+                    emit_line = true;
+                }
+            }
+        }
+        else if (ctx.in_src_stk.top().eof()) {
+            if (!ctx.opt.ppp_only && ctx.cond_stack.size() > ctx.in_src_stk.top().cond_depth)
+                throw invalid_argument("unterminated conditional at end of file");
+
+            emit_line = true;
+            if (ctx.in_src_stk.top().hdr_record)
+                pp_hdr_finish(ctx);
+            pp_directive_index_detach(ctx.in_src_stk.top());
+            ctx.in_src_stk.pop();
+        }
+    }
 
-    r += '\"';
-    for (auto si=s.begin();si!=s.end();si++) {
-        if (*si == '\'' || *si == '\"' || *si == '\\') r += '\\';
-        r += *si;
+    if (!ctx.opt.pch_save_file.empty())
+        pp_pch_save(ctx);
+    }
+    catch (const exception &e) {
+        ctx.error = string(err_source.empty() ? "-" : err_source.c_str()) + ":" + to_string((long)err_lineno) + ": error: " + e.what();
+        write_macro_stats(ctx);
+        ctx.out_dst.close();
+        return 1;
     }
-    r += '\"';
 
-    return r;
+    write_macro_stats(ctx);
+    ctx.out_dst.close();
+    return 0;
 }
 
-void parse_tokens(token_string &tokens,const string::iterator lib,const string::iterator lie,const int32_t lineno,const string &source);
-
-static inline bool do_macro_expand_val(string &fstr,vector<token>::const_iterator &si,const vector<token>::const_iterator sie,const vector<string> &param,const macro_t &macro,const bool variadic_given) {
-    if (si == sie)
-        throw runtime_error("do_macro_expand_val started with iterator == end");
+} /* namespace haxpp_impl */
 
-    if ((*si).tval == token::MACROSUBST) {
-        fstr += (*si).sval;
-        si++;
-        return true;
-    }
-    else if ((*si).tval == token::MACROPARAM) {
-        if ((*si).i.u >= (unsigned long long)param.size())
-            throw invalid_argument("macro parameter index out of range");
+using namespace haxpp_impl;
 
-        fstr += param[size_t((*si).i.u)];
-        si++;
-        return true;
-    }
-    else if ((*si).tval == token::VA_ARGS) {
-        if (!param.empty() && macro.last_param_variadic && macro.last_param_optional)
-            fstr += param[param.size() - size_t(1)];
+/* library: what a haxpp object keeps from one run to the next */
+class __attribute__((visibility("hidden"))) haxpp_state {
+public:
+    pp_options                  opt;
+    map<string,string>          files;              /* add_file() */
+    map<string,pp_directive_index> directive_indexes;
+    string                      error;
+};
 
-        si++;
-        return true;
-    }
-    else if ((*si).tval == token::VA_OPT) {
-        si++;
+haxpp::haxpp() : st(new haxpp_state()) {
+    st->opt.pp_only = true;
+}
 
-        if (si == sie)
-            throw invalid_argument("__VA_OPT__ must be followed by (");
-        if ((*si).tval != token::OPEN_PARENS)
-            throw invalid_argument("__VA_OPT__ must be followed by (");
-        si++;
+haxpp::~haxpp() {
+}
 
-        if (si == sie)
-            throw invalid_argument("__VA_OPT__ must be followed by something to expand to");
-        if ((*si).tval != token::MACROSUBST)
-            throw invalid_argument("__VA_OPT__ must be followed by something to expand to");
-        if (variadic_given)
-            fstr += (*si).sval;
-        si++;
+void haxpp::define(const string &name,const string &value) {
+    st->opt.cmdline_macros.push_back(make_pair('D',name + "=" + value));
+}
 
-        if (si == sie)
-            throw invalid_argument("__VA_OPT__ must be followed by )");
-        if ((*si).tval != token::CLOSE_PARENS)
-            throw invalid_argument("__VA_OPT__ must be followed by )");
-        si++;
-        return true;
-    }
+void haxpp::undef(const string &name) {
+    st->opt.cmdline_macros.push_back(make_pair('U',name));
+}
 
-    return false;
+void haxpp::include_path(const string &dir) {
+    st->opt.include_paths.push_back(dir);
 }
 
-void do_macro_expand(token_string &tokens,const string &ident,string::iterator &li,const string::iterator lie,const int32_t lineno,const string &source) {
-    auto mi = macro_store.find(ident);
-    if (mi != macro_store.end()) {
-        const macro_t &macro = mi->second;
-        bool variadic_given = false;
-        vector<string> param;
-        string fstr;
+/* a file #include can name, found by its spelling before the include paths are searched */
+void haxpp::add_file(const string &name,const string &text) {
+    st->files[name] = text;
+}
 
-        if (macro.parens) {
-            parse_skip_whitespace(li,lie);
-            if (strit_next_match_inc(li,lie,'(')) {
-                do {
-                    bool variad = macro.last_param_variadic && (param.size()+size_t(1)) == macro.param.size();
+const string& haxpp::error() const {
+    return st->error;
+}
 
-                    if (variad)
-                        variadic_given = variad;
+static haxpp_token::kind_t haxpp_token_kind(const token::token_t t) {
+    switch (t) {
+        case token::IDENTIFIER:
+        case token::MACRO:
+        case token::MACROSUBST:
+            return haxpp_token::IDENTIFIER;
+        case token::INTEGER:
+        case token::FLOAT:
+            return haxpp_token::NUMBER;
+        case token::STRING:
+            return haxpp_token::STRING;
+        default:
+            break;
+    };
 
-                    parse_skip_whitespace(li,lie);
-                    if (li == lie) throw invalid_argument("macro invocation parameter list ended suddenly");
-                    if (strit_next_match_inc(li,lie,')')) break;
+    return haxpp_token::OTHER;
+}
 
-                    if (param.size() >= macro.param.size())
-                        throw invalid_argument("macro invocation parameter list with too many parameters");
-                    param.push_back(do_macro_expand_read_invoke_param(li,lie,variad));
+/* run one source through a fresh context set up from st, text == NULL to read path from disk */
+static int haxpp_run(haxpp &pp,haxpp_state &st,const string &path,const shared_ptr<const string> &text) {
+    pp_context ctx(st.opt);
 
-                    parse_skip_whitespace(li,lie);
-                    if (li == lie) throw invalid_argument("macro invocation parameter list ended suddenly");
-                    if (strit_next_match_inc(li,lie,')'))
-                        break;
-                    else if (!strit_next_match_inc(li,lie,','))
-                        throw invalid_argument(string("macro invocation parameter list unexpected char ") + *li);
-                } while(1);
+    st.error.clear();
+    ctx.in_src_stk.alloc();
+    ctx.in_src_stk.push();
 
-                /* enforce required param count. the one for the variadic macro is not required to be present. */
-                size_t reqd_params = macro.param.size();
-                if (macro.last_param_variadic && macro.last_param_optional && reqd_params != size_t(0)) reqd_params--;
-                if (param.size() < reqd_params)
-                    throw invalid_argument("macro invocation parameter list has too few parameters");
+    FileSource &fs = ctx.in_src_stk.top();
+    if (text)
+        fs.set(path,text);
+    else
+        fs.set(path);
 
-                /* fill in the rest with blank */
-                while (param.size() < macro.param.size())
-                    param.push_back(string());
+    fs.open();
+    if (!fs.is_open()) {
+        st.error = "Unable to open source " + path;
+        return 1;
+    }
 
-                parse_skip_whitespace(li,lie);
-            }
-            else {
-                throw invalid_argument("macro invoked without parenthesis when defined with parameters");
-            }
-        }
+    ctx.directive_indexes.swap(st.directive_indexes);
+    if (!text)
+        pp_directive_index_attach(ctx,fs);
 
-        for (vector<token>::const_iterator si=macro.subst.begin();si!=macro.subst.end();) {
-            if (do_macro_expand_val(fstr,si,macro.subst.end(),param,macro,variadic_given)) {
-                while (si != macro.subst.end() && (*si).tval == token::TOKEN_PASTE) {
-                    si++;
-                    if (si == macro.subst.end())
-                        throw invalid_argument("token paste must be followed by another token");
-                    if (!do_macro_expand_val(fstr,si,macro.subst.end(),param,macro,variadic_given))
-                        throw invalid_argument("token paste was not followed by expandable value");
-                }
+    if (pp.on_include || !st.files.empty()) {
+        ctx.include_hook = [&pp,&st](const string &name,const bool angled,const string &includer,string &ipath,string &itext) {
+            if (pp.on_include && pp.on_include(name,angled,includer,ipath,itext))
+                return true;
 
-                if (si != macro.subst.end())
-                    fstr += " ";
-            }
-            else if ((*si).tval == token::STRINGIFY) {
-                si++;
-                if (si == macro.subst.end())
-                    throw invalid_argument("macro stringify with nothing to stringify");
+            const auto fi = st.files.find(name);
+            if (fi == st.files.end())
+                return false;
 
-                string tmpr;
-                if (!do_macro_expand_val(tmpr,si,macro.subst.end(),param,macro,variadic_given))
-                    throw invalid_argument("stringify was not followed by expandable value");
+            ipath = fi->first;
+            itext = fi->second;
+            return true;
+        };
+    }
 
-                if (!tmpr.empty())
-                    fstr += pp_stringify(tmpr) + " ";
+    if (pp.on_token) {
+        ctx.line_hook = [&pp](pp_context &ctx,const token_string &tokens,const int32_t lineno,const string &source) {
+            haxpp_token ht;
+
+            ht.line = lineno;
+            ht.source = &source;
+            ht.first = true;
+            for (const auto &t : tokens) {
+                ht.text = to_string_pp(ctx,t);
+                if (ht.text.empty())
+                    continue;
+                if (ht.text.back() == ' ')
+                    ht.text.pop_back();
+
+                ht.kind = haxpp_token_kind(t.tval);
+                pp.on_token(ht);
+                ht.first = false;
             }
-            else if ((*si).tval == token::COMMA) {
-                si++;
-                auto si2 = si;
-                if (si2 != macro.subst.end() && (*si2).tval == token::TOKEN_PASTE) { /* , ## */
-                    si2++;
-                    if (si2 != macro.subst.end() && (*si2).tval == token::VA_ARGS) { /* , ## __VA_ARGS__ */
-                        si = si2;
-
-                        if (variadic_given) {
-                            fstr += ",";
-                            do_macro_expand_val(fstr,si,macro.subst.end(),param,macro,variadic_given);
-                        }
-                        else {
-                            si++;
-                        }
-
-                        continue;
-                    }
-                }
+        };
+    }
+    else if (pp.on_text) {
+        ctx.out_dst.set(pp.on_text);
+    }
 
-                fstr += ",";
-            }
-            else {
-                throw invalid_argument("unexpected token in macro expansion");
-            }
-        }
+    const int r = preprocess_run(ctx);
 
-        parse_tokens(tokens,fstr.begin(),fstr.end(),lineno,source);
-    }
+    st.error = ctx.error;
+    ctx.directive_indexes.swap(st.directive_indexes);
+    return r;
 }
 
-void parse_tokens_define(token_string &tokens,string::iterator &li,const string::iterator lie,const int32_t lineno,const string &source) {
-    vector<string> params;
+/* source text from memory, name is what __FILE__ and #line report */
+int haxpp::preprocess(const string &name,const string &text) {
+    return haxpp_run(*this,*st,name,make_shared<const string>(text));
+}
 
-    (void)lineno;
-    (void)source;
+int haxpp::preprocess_file(const string &path) {
+    return haxpp_run(*this,*st,path,shared_ptr<const string>());
+}
 
-    /* parens must follow #define with no space */
-    if (strit_next_match_inc(li,lie,'(')) {
-        /* (params)
-         *
-         * params =
-         * params = identifier
-         * params = identifier identifier
-         * params = identifier ... */
-        tokens.push_back(token::OPEN_PARENS);
-        parse_skip_whitespace(li,lie);
-        while (1) {
-            if (li == lie) {
-                throw invalid_argument("macro param list ended without closing parens");
-            }
-            else if (strit_next_match_inc(li,lie,')')) {
-                tokens.push_back(token::CLOSE_PARENS);
-                break;
-            }
-            else if (strit_next_match_inc(li,lie,',')) {
-                tokens.push_back(token::COMMA);
-            }
-            else if (strit_next_match_inc(li,lie,'.','.','.')) {
-                tokens.push_back(token::DOTDOTDOT);
-            }
-            else if (isidentifier_fc(*li)) {
-                string ident = parse_identifier(li,lie); /* will throw exception otherwise */
-                tokens.push_back(move(token(token::IDENTIFIER,ident)));
-                params.push_back(ident);
-            }
-            else {
-                throw invalid_argument(string("macro param list has unexpected char ") + (*li));
-            }
+#ifndef HAXPP_LIBRARY /* the command line program */
+/* --result-cache: whole runs, keyed by everything but the files they read. DIR/<key>.man
+ * lists the runs seen for a key, newest first, with the files each one read. DIR/<hash>.out
+ * is the output of a run, named by its own hash, and shared by every run that produced it */
+static const char               pp_res_magic[8] = {'H','A','X','R','E','S','2','\n'};
+static const char               pp_res_version[] = "haxpp " __DATE__ " " __TIME__; /* any rebuild invalidates the cache */
+static constexpr size_t         pp_res_max_per_key = 16;
 
-            parse_skip_whitespace(li,lie);
-        }
-    }
+class pp_res_dep {
+public:
+    string                      path;
+    int64_t                     mtime = 0;
+    int64_t                     size = 0;
+    uint64_t                    content_hash = 0;
+};
 
-    string r;
+class pp_res_entry {
+public:
+    vector<pp_res_dep>          deps;
+    vector<string>              absent;         /* paths #include tried before the file it found, must not exist */
+    uint64_t                    out_hash = 0;
+    uint64_t                    out_size = 0;
+};
 
-    parse_skip_whitespace(li,lie);
+static string pp_res_file(const string &dir,const uint64_t h,const char *ext) {
+    char tmp[32];
+    snprintf(tmp,sizeof(tmp),"%016llx.%s",(unsigned long long)h,ext);
+    return dir + "/" + tmp;
+}
 
-    while (li != lie) {
-        if (strit_next_match_inc(li,lie,'#','#')) {
-            if (!r.empty()) {
-                tokens.push_back(move(token(token::MACROSUBST,r)));
-                r.clear();
-            }
-            tokens.push_back(token::TOKEN_PASTE);
-        }
-        else if (strit_next_match_inc(li,lie,'#')) {
-            if (!r.empty()) {
-                tokens.push_back(move(token(token::MACROSUBST,r)));
-                r.clear();
-            }
-            tokens.push_back(token::STRINGIFY);
-        }
-        else if (strit_next_match_inc(li,lie,',')) {
-            if (!r.empty()) {
-                tokens.push_back(move(token(token::MACROSUBST,r)));
-                r.clear();
-            }
-            tokens.push_back(token::COMMA);
-        }
-        else if (isidentifier_fc(*li)) {
-            string ident = parse_identifier(li,lie); /* will throw exception otherwise */
+/* the options, the working directory and the main file. false if the main file cannot be read */
+static bool pp_res_key(pp_context &ctx,uint64_t &key,const string &in_path) {
+    uint64_t h = fnv1a64(fnv1a64_init,pp_res_version,sizeof(pp_res_version));
+    const pp_options &o = ctx.opt;
+    char cwd[PATH_MAX];
+    uint64_t ch;
 
-            auto paridx = find(params.begin(),params.end(),ident);
-            if (paridx != params.end()) {
-                if (!r.empty()) {
-                    tokens.push_back(move(token(token::MACROSUBST,r)));
-                    r.clear();
-                }
-                tokens.push_back(move(token(token::MACROPARAM,(unsigned long long)(paridx - params.begin()))));
-            }
-            else if (ident == "__VA_ARGS__") {
-                if (!r.empty()) {
-                    tokens.push_back(move(token(token::MACROSUBST,r)));
-                    r.clear();
-                }
-                tokens.push_back(token::VA_ARGS);
-            }
-            else if (ident == "__VA_OPT__") {
-                if (!r.empty()) {
-                    tokens.push_back(move(token(token::MACROSUBST,r)));
-                    r.clear();
-                }
-                tokens.push_back(token::VA_OPT);
-                parse_skip_whitespace(li,lie);
-                if (strit_next_match_inc(li,lie,'(')) {
-                    int parens = 1;
+    if (!pp_file_content_hash(ch,in_path))
+        return false;
 
-                    tokens.push_back(token::OPEN_PARENS);
-                    while (li != lie) {
-                        if (*li == '(')
-                            parens++;
-                        else if (*li == ')') {
-                            parens--;
-                            if (parens == 0) {
-                                tokens.push_back(move(token(token::MACROSUBST,r)));
-                                tokens.push_back(token::CLOSE_PARENS);
-                                r.clear();
-                                li++;
-                                break;
-                            }
-                        }
+    const uint32_t flags = (o.ppp_only ? 1u : 0u) | (o.ppt_only ? 2u : 0u) | (o.pp_only ? 4u : 0u) | (o.unifdef ? 8u : 0u);
+    h = fnv1a64(h,&flags,sizeof(flags));
+    for (const auto &m : o.cmdline_macros) {
+        h = fnv1a64(h,&m.first,sizeof(m.first));
+        h = fnv1a64(h,m.second.c_str(),m.second.size() + size_t(1));
+    }
+    h = fnv1a64(h,ctx.include_paths_key);
+    const uint64_t limits[5] = { o.budget.max_expand_depth, o.budget.max_line_tokens, o.budget.max_file_tokens,
+        o.budget.max_comment_depth, o.budget.time_limit_ms };
+    h = fnv1a64(h,limits,sizeof(limits));
+    if (ctx.pch) /* --batch loads it once for every unit */
+        h = fnv1a64(h,&ctx.pch->hdr->hash,sizeof(ctx.pch->hdr->hash));
+    h = fnv1a64(h,o.pch_load_file.c_str(),o.pch_load_file.size() + size_t(1));
+    if (getcwd(cwd,sizeof(cwd)) != NULL)
+        h = fnv1a64(h,string(cwd));
+    h = fnv1a64(h,in_path.c_str(),in_path.size() + size_t(1));
+    h = fnv1a64(h,&ch,sizeof(ch));
+
+    key = h;
+    return true;
+}
 
-                        r += *li++;
-                    }
+static void pp_res_load(vector<pp_res_entry> &v,const string &path,const uint64_t key) {
+    FILE *fp = fopen(path.c_str(),"rb");
+    string b;
 
-                    if (parens != 0)
-                        throw invalid_argument("Mismatched __VA_OPT__ parens");
-                }
-            }
-            else {
-                r += ident;
+    if (fp == NULL)
+        return;
+
+    pp_file_slurp(b,fp);
+
+    try {
+        pp_bin_reader r(b);
+        char magic[sizeof(pp_res_magic)];
+
+        r.read(magic,sizeof(magic));
+        if (memcmp(magic,pp_res_magic,sizeof(magic)) != 0 || r.u64() != key)
+            throw runtime_error("not a result cache file");
+
+        for (uint32_t count=r.u32();count != 0u;count--) {
+            pp_res_entry e;
+
+            for (uint32_t i=r.u32();i != 0u;i--) {
+                pp_res_dep d;
+                d.path = r.str();
+                d.mtime = int64_t(r.u64());
+                d.size = int64_t(r.u64());
+                d.content_hash = r.u64();
+                e.deps.push_back(move(d));
             }
+            for (uint32_t i=r.u32();i != 0u;i--)
+                e.absent.push_back(r.str());
+            e.out_hash = r.u64();
+            e.out_size = r.u64();
+            v.push_back(move(e));
         }
-        else if (*li == ' ' && r.empty()) {
-            li++; /* ignore */
+    }
+    catch (const exception &e) {
+        fprintf(pp_stderr(),"WARNING: result cache %s not used: %s\n",path.c_str(),e.what());
+        v.clear();
+    }
+}
+
+static string pp_res_serialize(const vector<pp_res_entry> &v,const uint64_t key) {
+    string b(pp_res_magic,sizeof(pp_res_magic));
+
+    pp_bin_put64(b,key);
+    pp_bin_put(b,uint32_t(v.size()));
+    for (const auto &e : v) {
+        pp_bin_put(b,uint32_t(e.deps.size()));
+        for (const auto &d : e.deps) {
+            pp_bin_put(b,d.path);
+            pp_bin_put64(b,uint64_t(d.mtime));
+            pp_bin_put64(b,uint64_t(d.size));
+            pp_bin_put64(b,d.content_hash);
         }
-        else {
-            r += *(li++);
+        pp_bin_put(b,uint32_t(e.absent.size()));
+        for (const auto &a : e.absent)
+            pp_bin_put(b,a);
+        pp_bin_put64(b,e.out_hash);
+        pp_bin_put64(b,e.out_size);
+    }
+
+    return b;
+}
+
+/* a file is unchanged if its size and mtime are, or else if its content is */
+static bool pp_res_dep_valid(const pp_res_dep &d) {
+    struct stat st;
+    uint64_t ch;
+
+    if (stat(d.path.c_str(),&st) != 0 || int64_t(st.st_size) != d.size)
+        return false;
+    if (int64_t(st.st_mtime) == d.mtime)
+        return true;
+
+    return pp_file_content_hash(ch,d.path) && ch == d.content_hash;
+}
+
+/* write the output of an earlier run whose files all read the same now. touching the
+ * files is what keeps them from eviction */
+static bool pp_res_lookup(pp_context &ctx,const uint64_t key) {
+    const string &dir = ctx.opt.result_cache_dir;
+    const string man = pp_res_file(dir,key,"man");
+    vector<pp_res_entry> v;
+
+    pp_res_load(v,man,key);
+    for (const auto &e : v) {
+        bool valid = true;
+
+        for (const auto &d : e.deps) {
+            if (!pp_res_dep_valid(d)) {
+                valid = false;
+                break;
+            }
+        }
+        for (const auto &a : e.absent) {
+            if (!valid)
+                break;
+            if (pp_is_file(a))
+                valid = false;
         }
+        if (!valid)
+            continue;
+
+        const string out = pp_res_file(dir,e.out_hash,"out");
+        FILE *fp = fopen(out.c_str(),"rb");
+        string b;
+
+        if (fp == NULL)
+            continue; /* evicted */
+
+        pp_file_slurp(b,fp);
+        if (b.size() != e.out_size || fnv1a64(fnv1a64_init,b) != e.out_hash)
+            continue;
+
+        ctx.out_dst.puts(b);
+        utime(man.c_str(),NULL);
+        utime(out.c_str(),NULL);
+        return true;
     }
 
-    if (!r.empty()) {
-        tokens.push_back(move(token(token::MACROSUBST,r)));
-        r.clear();
+    return false;
+}
+
+/* remove the least recently used files until the directory is back under 90% of the limit */
+static void pp_res_evict(const string &dir,const uint64_t limit) {
+    vector< pair<time_t, pair<string,uint64_t> > > files;
+    uint64_t total = 0;
+    struct dirent *d;
+    struct stat st;
+
+    DIR *dp = opendir(dir.c_str());
+    if (dp == NULL)
+        return;
+
+    while ((d=readdir(dp)) != NULL) {
+        const size_t len = strlen(d->d_name);
+        if (len < 4 || (strcmp(d->d_name+len-4,".man") != 0 && strcmp(d->d_name+len-4,".out") != 0))
+            continue;
+
+        const string path = dir + "/" + d->d_name;
+        if (stat(path.c_str(),&st) != 0)
+            continue;
+
+        files.push_back(make_pair(st.st_mtime,make_pair(path,uint64_t(st.st_size))));
+        total += uint64_t(st.st_size);
+    }
+    closedir(dp);
+
+    if (total <= limit)
+        return;
+
+    sort(files.begin(),files.end());
+    for (const auto &f : files) {
+        if (total <= limit - limit / uint64_t(10))
+            break;
+        if (remove(f.second.first.c_str()) == 0)
+            total -= f.second.second;
     }
 }
 
-void parse_tokens(token_string &tokens,const string::iterator lib,const string::iterator lie,const int32_t lineno,const string &source) {
-    auto li = lib;
+/* remember the output of a successful run. files that changed while it ran are
+ * not trusted to be unchanged by mtime, so the run is not stored */
+static void pp_res_store(pp_context &ctx,const uint64_t key,const time_t started) {
+    const string &dir = ctx.opt.result_cache_dir;
+    const string man = pp_res_file(dir,key,"man");
+    vector<pp_res_entry> v;
+    pp_res_entry e;
+
+    for (const auto &path : ctx.inputs) {
+        struct stat st;
+        pp_res_dep d;
+
+        if (stat(path.c_str(),&st) != 0 || st.st_mtime >= started || !pp_file_content_hash(d.content_hash,path))
+            return;
+
+        d.path = path;
+        d.mtime = int64_t(st.st_mtime);
+        d.size = int64_t(st.st_size);
+        e.deps.push_back(move(d));
+    }
+    e.absent.assign(ctx.absent.begin(),ctx.absent.end());
+    e.out_hash = fnv1a64(fnv1a64_init,ctx.out_text);
+    e.out_size = uint64_t(ctx.out_text.size());
+
+    const string out = pp_res_file(dir,e.out_hash,"out");
+    if (access(out.c_str(),F_OK) == 0)
+        utime(out.c_str(),NULL);
+    else if (!pp_cache_file_replace(dir,out,ctx.out_text)) {
+        fprintf(pp_stderr(),"WARNING: cannot write result cache %s\n",out.c_str());
+        return;
+    }
 
-    (void)lineno;
-    (void)source;
+    pp_res_load(v,man,key);
+    for (auto ei=v.begin();ei != v.end();) {
+        bool same = ei->deps.size() == e.deps.size() && ei->absent == e.absent;
+        for (size_t i=0;same && i < e.deps.size();i++)
+            same = ei->deps[i].path == e.deps[i].path && ei->deps[i].content_hash == e.deps[i].content_hash;
 
-    bool macro_expand = true;
-    bool is_pp = false;
+        if (same)
+            ei = v.erase(ei);
+        else
+            ei++;
+    }
+    v.insert(v.begin(),move(e));
+    if (v.size() > pp_res_max_per_key)
+        v.resize(pp_res_max_per_key);
 
-    /* initial whitespace skip */
-    parse_skip_whitespace(li,lie);
-    if (li == lie) return;
+    if (!pp_cache_file_replace(dir,man,pp_res_serialize(v,key)))
+        fprintf(pp_stderr(),"WARNING: cannot write result cache %s\n",man.c_str());
 
-    /* li != lie */
-    if (*li == '#') {
-        /* preprocessor handling */
-        li++;
-        parse_skip_whitespace(li,lie);
-        /* expect identifier, or else */
-        tokens.push_back(token::PREPROC);
-        is_pp = true;
+    pp_res_evict(dir,ctx.opt.result_cache_size);
+}
 
-        {
-            string ident = parse_identifier(li,lie); /* will throw exception otherwise */
-            enum token::token_t tk;
+/* preprocess one translation unit with a fresh context */
+static int preprocess_unit(pp_context &ctx,const string &in_path,const string &out_path) {
+    uint64_t res_key = 0;
 
-            if ((tk=is_pp_keyword(ident)) != token::NONE) {
-                tokens.push_back(tk);
+    if (!ctx.opt.result_cache_dir.empty()) {
+        ctx.result_cache = in_path != "-" && ctx.configs.empty() && ctx.opt.macro_stats_file.empty() && ctx.opt.pch_save_file.empty();
+        if (!ctx.result_cache)
+            fprintf(pp_stderr(),"WARNING: --result-cache does not work with stdin, --config, --macro-stats or --pch-save\n");
+    }
 
-                switch (tk) {
-                    case token::IFDEF:
-                    case token::IFNDEF:
-                    case token::DEFINE:
-                    case token::UNDEF:
-                        parse_skip_whitespace(li,lie);
-                        ident = parse_identifier(li,lie);
-                        tokens.push_back(move(token(token::IDENTIFIER,ident)));
-                        macro_expand = false;
-                        break;
-                    case token::ENDIF:
-                    case token::ELSE:
-                        macro_expand = false;
-                        break;
-                    default:
-                        break;
-                };
+    ctx.in_src_stk.alloc();
+    ctx.in_src_stk.push();
+    if (in_path == "-")
+        ctx.in_src_stk.top().set(pp_stdin());
+    else
+        ctx.in_src_stk.top().set(in_path);
 
-                if (tk == token::DEFINE) {
-                    parse_tokens_define(tokens,li,lie,lineno,source);
-                    return;
-                }
-            }
-            else {
-                throw invalid_argument(string("Invalid preprocessor directive ") + ident);
+    ctx.in_src_stk.top().open();
+    if (!ctx.in_src_stk.top().is_open()) {
+        fprintf(pp_stderr(),"Unable to open source %s\n",in_path.c_str());
+        return 1;
+    }
+    pp_directive_index_attach(ctx,ctx.in_src_stk.top());
+    pp_note_input(ctx,ctx.in_src_stk.top().get_path());
+    if (ctx.opt.prefetch)
+        pp_prefetch_scan(ctx,ctx.in_src_stk.top());
+
+    if (!ctx.configs.empty()) {
+        if (!ctx.opt.pch_save_file.empty()) {
+            fprintf(pp_stderr(),"--pch-save cannot be used with --config\n");
+            return 1;
+        }
+        if (!ctx.opt.pp_only && !ctx.opt.ppt_only) {
+            fprintf(pp_stderr(),"--config requires -E or -ET\n");
+            return 1;
+        }
+
+        for (auto &cfg : ctx.configs) {
+            if (cfg.out_file == "-")
+                cfg.out.set(pp_stdout());
+            else
+                cfg.out.set(cfg.out_file);
+
+            cfg.out.open();
+            if (!cfg.out.is_open()) {
+                fprintf(pp_stderr(),"Unable to open dest %s\n",cfg.out_file.c_str());
+                return 1;
             }
         }
+    }
+    else {
+        if (out_path == "-")
+            ctx.out_dst.set(pp_stdout());
+        else
+            ctx.out_dst.set(out_path);
 
-        parse_skip_whitespace(li,lie);
+        ctx.out_dst.open();
+        if (!ctx.out_dst.is_open()) {
+            fprintf(pp_stderr(),"Unable to open dest %s\n",out_path.c_str());
+            return 1;
+        }
     }
 
-    /* general parsing. expects code to skip whitespace after doing it's part */
-    while (li != lie) {
-        if (*li == '\"')
-            tokens.push_back(move(parse_string(li,lie)));
-        else if (*li == '\'')
-            tokens.push_back(move(parse_sq_char(li,lie)));
-        else if (strit_next_match_inc(li,lie,'.','.','.'))
-            tokens.push_back(token::DOTDOTDOT);
-        else if (strit_next_match_inc(li,lie,'.'))
-            tokens.push_back(token::PERIOD);
-        else if (strit_next_match_inc(li,lie,','))
-            tokens.push_back(token::COMMA);
-        else if (strit_next_match_inc(li,lie,'<','<','='))
-            tokens.push_back(token::LEFT_SHIFT_EQUALS);
-        else if (strit_next_match_inc(li,lie,'<','<'))
-            tokens.push_back(token::LEFT_SHIFT);
-        else if (strit_next_match_inc(li,lie,'<','='))
-            tokens.push_back(token::LESS_THAN_OR_EQUAL);
-        else if (strit_next_match_inc(li,lie,'<'))
-            tokens.push_back(token::LESS_THAN);
-        else if (strit_next_match_inc(li,lie,'>','>','='))
-            tokens.push_back(token::RIGHT_SHIFT_EQUALS);
-        else if (strit_next_match_inc(li,lie,'>','>'))
-            tokens.push_back(token::RIGHT_SHIFT);
-        else if (strit_next_match_inc(li,lie,'>','='))
-            tokens.push_back(token::GREATER_THAN_OR_EQUAL);
-        else if (strit_next_match_inc(li,lie,'>'))
-            tokens.push_back(token::GREATER_THAN);
-        else if (strit_next_match_inc(li,lie,'-','>'))
-            tokens.push_back(token::PTRARROW);
-        else if (strit_next_match_inc(li,lie,'-','-'))
-            tokens.push_back(token::DECREMENT);
-        else if (strit_next_match_inc(li,lie,'-','='))
-            tokens.push_back(token::MINUS_EQUALS);
-        else if (strit_next_match_inc(li,lie,'-'))
-            tokens.push_back(token::MINUS);
-        else if (strit_next_match_inc(li,lie,'+','+'))
-            tokens.push_back(token::INCREMENT);
-        else if (strit_next_match_inc(li,lie,'+','='))
-            tokens.push_back(token::PLUS_EQUALS);
-        else if (strit_next_match_inc(li,lie,'+'))
-            tokens.push_back(token::PLUS);
-        else if (strit_next_match_inc(li,lie,'=','='))
-            tokens.push_back(token::EQUALS);
-        else if (strit_next_match_inc(li,lie,'='))
-            tokens.push_back(token::ASSIGNMENT);
-        else if (strit_next_match_inc(li,lie,'~'))
-            tokens.push_back(token::COMPLEMENT);
-        else if (strit_next_match_inc(li,lie,'^','='))
-            tokens.push_back(token::XOR_EQUALS);
-        else if (strit_next_match_inc(li,lie,'^'))
-            tokens.push_back(token::CARET);
-        else if (strit_next_match_inc(li,lie,'?'))
-            tokens.push_back(token::QUESTIONMARK);
-        else if (strit_next_match_inc(li,lie,':'))
-            tokens.push_back(token::COLON);
-        else if (strit_next_match_inc(li,lie,'|','|'))
-            tokens.push_back(token::LOGICAL_OR);
-        else if (strit_next_match_inc(li,lie,'|','='))
-            tokens.push_back(token::OR_EQUALS);
-        else if (strit_next_match_inc(li,lie,'|'))
-            tokens.push_back(token::PIPE);
-        else if (strit_next_match_inc(li,lie,'!','='))
-            tokens.push_back(token::NOT_EQUALS);
-        else if (strit_next_match_inc(li,lie,'!'))
-            tokens.push_back(token::NOT);
-        else if (strit_next_match_inc(li,lie,'&','&'))
-            tokens.push_back(token::LOGICAL_AND);
-        else if (strit_next_match_inc(li,lie,'&','='))
-            tokens.push_back(token::AND_EQUALS);
-        else if (strit_next_match_inc(li,lie,'&'))
-            tokens.push_back(token::AMPERSAND);
-        else if (strit_next_match_inc(li,lie,'*','='))
-            tokens.push_back(token::MULTIPLY_EQUALS);
-        else if (strit_next_match_inc(li,lie,'*'))
-            tokens.push_back(token::STAR);
-        else if (strit_next_match_inc(li,lie,'/','='))
-            tokens.push_back(token::DIVIDE_EQUALS);
-        else if (strit_next_match_inc(li,lie,'/'))
-            tokens.push_back(token::DIVISION);
-        else if (strit_next_match_inc(li,lie,'%','='))
-            tokens.push_back(token::MODULUS_EQUALS);
-        else if (strit_next_match_inc(li,lie,'%'))
-            tokens.push_back(token::MODULUS);
-        else if (strit_next_match_inc(li,lie,'('))
-            tokens.push_back(token::OPEN_PARENS);
-        else if (strit_next_match_inc(li,lie,')'))
-            tokens.push_back(token::CLOSE_PARENS);
-        else if (strit_next_match_inc(li,lie,'['))
-            tokens.push_back(token::OPEN_SBRACKET);
-        else if (strit_next_match_inc(li,lie,']'))
-            tokens.push_back(token::CLOSE_SBRACKET);
-        else if (strit_next_match_inc(li,lie,'{'))
-            tokens.push_back(token::OPEN_CBRACKET);
-        else if (strit_next_match_inc(li,lie,'}'))
-            tokens.push_back(token::CLOSE_CBRACKET);
-        else if (strit_next_match_inc(li,lie,'#','#'))
-            tokens.push_back(token::TOKEN_PASTE);
-        else if (strit_next_match_inc(li,lie,'#'))
-            tokens.push_back(token::STRINGIFY);
-        else if (isdigit(*li))
-            tokens.push_back(move(parse_number(li,lie)));
-        else if (isidentifier_fc(*li)) {
-            string ident = parse_identifier(li,lie); /* will throw exception otherwise */
-            enum token::token_t tk;
+    if (ctx.result_cache) {
+        if (!pp_res_key(ctx,res_key,in_path))
+            ctx.result_cache = false;
+        else if (pp_res_lookup(ctx,res_key))
+            return 0;
+        else
+            ctx.out_dst.capture = &ctx.out_text;
+    }
+
+    if (ctx.result_cache && !ctx.opt.pch_load_file.empty()) /* not loaded yet, see pp_res_key() */
+        pp_note_input(ctx,ctx.opt.pch_load_file);
+
+    const time_t started = time(NULL);
+    const int r = preprocess_run(ctx);
+    if (r != 0)
+        fprintf(pp_stderr(),"%s\n",ctx.error.c_str());
+    else if (ctx.result_cache)
+        pp_res_store(ctx,res_key,started);
+
+    return r;
+}
+
+/* --batch: one entry of the compile database */
+class pp_batch_unit {
+public:
+    string                      in_file;
+    string                      out_file;
+    vector< pair<char,string> > macros;
+    vector<string>              include_paths;
+    int                         result = -1;
+};
 
-            if (is_pp && (tk=is_pp_keyword(ident)) != token::NONE) {
-                tokens.push_back(tk);
+/* just enough JSON for compile_commands.json */
+class pp_batch_json {
+public:
+    enum type_t {
+        NUL,
+        STRING,
+        ARRAY,
+        OBJECT,
+        OTHER   /* numbers, true, false: not needed */
+    };
+public:
+    type_t                      type = NUL;
+    string                      str;
+    vector<pp_batch_json>       items;
+    vector< pair<string,pp_batch_json> > members;
+public:
+    const pp_batch_json*        member(const char *name) const;
+};
 
-                if (tk == token::DEFINED) {
-                    string macro;
-                    int parens = 0;
+const pp_batch_json *pp_batch_json::member(const char *name) const {
+    for (const auto &m : members) {
+        if (m.first == name)
+            return &m.second;
+    }
 
-                    /* macro name must be preserved, do not expand, so the test can be done properly.
-                     * we allow defined x or defined(x) */
-                    parse_skip_whitespace(li,lie);
-                    while (strit_next_match_inc(li,lie,'(')) {
-                        parens++;
-                        parse_skip_whitespace(li,lie);
-                    }
+    return NULL;
+}
 
-                    macro = parse_identifier(li,lie);
-                    parse_skip_whitespace(li,lie);
-                    tokens.push_back(move(token(token::IDENTIFIER,macro)));
+static void pp_batch_json_ws(const string &s,size_t &i) {
+    while (i < s.size() && (s[i] == ' ' || s[i] == '\t' || s[i] == '\n' || s[i] == '\r')) i++;
+}
 
-                    while (parens > 0) {
-                        if (!strit_next_match_inc(li,lie,')'))
-                            throw invalid_argument("defined() with mismatched parameters");
+static string pp_batch_json_string(const string &s,size_t &i) {
+    string r;
 
-                        parse_skip_whitespace(li,lie);
-                        parens--;
+    if (i >= s.size() || s[i] != '\"')
+        throw invalid_argument("JSON string expected");
+
+    i++;
+    while (i < s.size() && s[i] != '\"') {
+        char c = s[i++];
+
+        if (c == '\\') {
+            if (i >= s.size()) break;
+            c = s[i++];
+            switch (c) {
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'u': {
+                    if ((i+size_t(4)) > s.size()) throw invalid_argument("JSON \\u escape cut off");
+                    const unsigned long u = strtoul(s.substr(i,4).c_str(),NULL,16);
+                    i += 4;
+                    if (u < 0x80ul) {
+                        r += char(u);
                     }
-                }
+                    else if (u < 0x800ul) {
+                        r += char(0xC0ul | (u >> 6ul));
+                        r += char(0x80ul | (u & 0x3Ful));
+                    }
+                    else {
+                        r += char(0xE0ul | (u >> 12ul));
+                        r += char(0x80ul | ((u >> 6ul) & 0x3Ful));
+                        r += char(0x80ul | (u & 0x3Ful));
+                    }
+                    continue; }
+                default: break; /* \" \\ \/ */
             }
-            else if ((tk=is_keyword(ident)) != token::NONE)
-                tokens.push_back(tk);
-            else if (macro_expand && is_macro(ident))
-                do_macro_expand(tokens,ident,li,lie,lineno,source);
-            else
-                tokens.push_back(move(token(token::IDENTIFIER,ident)));
-        }
-        else {
-            throw invalid_argument(string("token parser unexpected char ") + *li);
         }
 
-        parse_skip_whitespace(li,lie);
+        r += c;
     }
-}
 
-static inline bool tokenit_next_match_inc(token_string::iterator &ti,const token_string::iterator tie,const token::token_t c) {
-    if (ti != tie && (*ti).tval == c) {
-        ti++;
-        return true;
-    }
+    if (i >= s.size())
+        throw invalid_argument("JSON string not terminated");
 
-    return false;
+    i++;
+    return r;
 }
 
-const string &tokenit_next_identifier(token_string::iterator &ti,const token_string::iterator tie) {
-    if (ti != tie) {
-        const auto &t = *(ti++);
-        if (t.tval == token::IDENTIFIER)
-            return t.sval;
+static void pp_batch_json_parse(pp_batch_json &r,const string &s,size_t &i,const unsigned int depth=0) {
+    if (depth > 64u)
+        throw invalid_argument("JSON nested too deeply");
+
+    pp_batch_json_ws(s,i);
+    if (i >= s.size())
+        throw invalid_argument("JSON value expected");
+
+    if (s[i] == '\"') {
+        r.type = pp_batch_json::STRING;
+        r.str = pp_batch_json_string(s,i);
     }
+    else if (s[i] == '[' || s[i] == '{') {
+        const bool obj = (s[i] == '{');
+        const char close = obj ? '}' : ']';
+
+        r.type = obj ? pp_batch_json::OBJECT : pp_batch_json::ARRAY;
+        i++;
+        pp_batch_json_ws(s,i);
+        if (i < s.size() && s[i] == close) {
+            i++;
+            return;
+        }
 
-    throw invalid_argument("identifier token expected");
+        while (1) {
+            pp_batch_json_ws(s,i);
+            if (obj) {
+                r.members.push_back(make_pair(pp_batch_json_string(s,i),pp_batch_json()));
+                pp_batch_json_ws(s,i);
+                if (i >= s.size() || s[i] != ':') throw invalid_argument("JSON ':' expected");
+                i++;
+                pp_batch_json_parse(r.members.back().second,s,i,depth+1u);
+            }
+            else {
+                r.items.push_back(pp_batch_json());
+                pp_batch_json_parse(r.items.back(),s,i,depth+1u);
+            }
+
+            pp_batch_json_ws(s,i);
+            if (i < s.size() && s[i] == ',') { i++; continue; }
+            if (i < s.size() && s[i] == close) { i++; break; }
+            throw invalid_argument("JSON ',' or end of list expected");
+        }
+    }
+    else {
+        r.type = (s.compare(i,4,"null") == 0) ? pp_batch_json::NUL : pp_batch_json::OTHER;
+        while (i < s.size() && s[i] != ',' && s[i] != ']' && s[i] != '}' && s[i] != ' ' && s[i] != '\n') i++;
+    }
 }
 
-static stack<pp_cond_t>         pp_cond_stack;
+/* "command" strings are split like a shell would, without expansions */
+static vector<string> pp_batch_split_command(const string &c) {
+    vector<string> r;
+    size_t i = 0;
 
-bool pp_pass() {
-    if (!pp_cond_stack.empty())
-        return pp_cond_stack.top().eval();
+    while (1) {
+        while (i < c.size() && (c[i] == ' ' || c[i] == '\t')) i++;
+        if (i >= c.size()) break;
 
-    return true;
-}
+        string a;
+        char quote = 0;
+        for (;i < c.size();i++) {
+            const char ch = c[i];
 
-class expression {
-    public:
-        class node {
-            public:
-                using node_t = size_t;
-                static constexpr node_t none = ~node_t(0u);
-            public:
-                token                   tval = token::NONE;
-                vector<node_t>          children;
-        };
-    public:
-        vector<node>                    nodelist;
-        node::node_t                    root = node::none;
-    public:
-        node::node_t                    newnode();
-        node::node_t                    newnode(const token &nt);
-        node::node_t                    newnode(const token &nt,const token::token_t ntval);
-    public:
-        inline node& getnode(const node::node_t &n) {
-            if (n < nodelist.size())
-                return nodelist[n];
-            else
-                throw runtime_error("node out of range");
-        }
-        inline const node& getnode(const node::node_t &n) const {
-            if (n < nodelist.size())
-                return nodelist[n];
-            else
-                throw runtime_error("node out of range");
+            if (quote != 0) {
+                if (ch == quote) quote = 0;
+                else if (ch == '\\' && quote == '\"' && (i+size_t(1)) < c.size()) a += c[++i];
+                else a += ch;
+            }
+            else if (ch == '\'' || ch == '\"') quote = ch;
+            else if (ch == '\\' && (i+size_t(1)) < c.size()) a += c[++i];
+            else if (ch == ' ' || ch == '\t') break;
+            else a += ch;
         }
-};
 
-expression::node::node_t expression::newnode() {
-    const node::node_t r = nodelist.size();
-    nodelist.resize(r+size_t(1));
-    return r;
-}
+        r.push_back(a);
+    }
 
-expression::node::node_t expression::newnode(const token &nt) {
-    const node::node_t r = nodelist.size();
-    nodelist.resize(r+size_t(1));
-    nodelist[r].tval = nt;
     return r;
 }
 
-expression::node::node_t expression::newnode(const token &nt,const token::token_t ntval) {
-    const node::node_t r = nodelist.size();
-    nodelist.resize(r+size_t(1));
-    nodelist[r].tval = nt;
-    nodelist[r].tval.tval = ntval;
-    return r;
-}
+static string pp_batch_path(const string &dir,const string &p) {
+    if (p.empty() || p[0] == '/' || dir.empty())
+        return p;
 
-struct tokenlist_entry {
-    token::token_t              match;
-    token::token_t              replace;
-};
+    return (dir.back() == '/') ? (dir + p) : (dir + "/" + p);
+}
 
-bool match_token_list(token::token_t &repl,const token &t,const tokenlist_entry *tokens) {
-    while (tokens->match != token::NONE) {
-        if (t.tval == tokens->match) {
-            repl = tokens->replace;
-            return true;
-        }
+/* the output of an entry is its "output" or -o with .o replaced by .i. without either,
+ * the input with its extension replaced by .i */
+static string pp_batch_output(const string &in,const string &out) {
+    string r = out;
 
-        tokens++;
+    if (r.empty()) {
+        const size_t sl = in.find_last_of('/');
+        const size_t dot = in.find_last_of('.');
+        r = (dot != string::npos && (sl == string::npos || dot > sl)) ? in.substr(0,dot) : in;
+        return r + ".i";
     }
 
-    return false;
+    if (r.size() > 2 && r.compare(r.size()-2,2,".o") == 0)
+        r.replace(r.size()-2,2,".i");
+    else if (r.size() > 4 && r.compare(r.size()-4,4,".obj") == 0)
+        r.replace(r.size()-4,4,".i");
+
+    return r;
 }
 
-expression::node::node_t parse_expr(expression &expr,token_string::iterator &ti,const token_string::iterator &tie,unsigned int min_prec = (~0u));
+void pp_batch_load(vector<pp_batch_unit> &units,const string &path) {
+    string text;
 
-expression::node::node_t parse_expr_rtl_unary(expression &expr,token_string::iterator &ti,const token_string::iterator &tie,unsigned int min_prec,const tokenlist_entry *match_token) {
-    token::token_t repl;
-    unsigned int prec;
+    {
+        FILE *fp = fopen(path.c_str(),"rb");
+        if (fp == NULL)
+            throw runtime_error("cannot open");
 
-    while (ti != tie && match_token_list(/*&*/repl,*ti,match_token) && (prec=token::precedence(*ti,true)) <= min_prec) {
-        const expression::node::node_t opnode = expr.newnode(*(ti++),repl);
+        char buf[16384];
+        size_t rd;
+        while ((rd=fread(buf,1,sizeof(buf),fp)) > 0)
+            text.append(buf,rd);
 
-        if (ti != tie) {
-            expr.getnode(opnode).children.resize(1);
-            expr.getnode(opnode).children[0] = parse_expr(expr,ti,tie,prec);
-            return opnode;
+        fclose(fp);
+    }
+
+    pp_batch_json root;
+    size_t i = 0;
+
+    pp_batch_json_parse(root,text,i);
+    if (root.type != pp_batch_json::ARRAY)
+        throw invalid_argument("expected a JSON array of compile commands");
+
+    for (const auto &e : root.items) {
+        const pp_batch_json *dir = e.member("directory");
+        const pp_batch_json *file = e.member("file");
+        const pp_batch_json *output = e.member("output");
+        const pp_batch_json *arguments = e.member("arguments");
+        const pp_batch_json *command = e.member("command");
+        const string d = (dir != NULL) ? dir->str : string();
+        vector<string> args;
+        pp_batch_unit u;
+        string out;
+
+        if (arguments != NULL) {
+            for (const auto &a : arguments->items)
+                args.push_back(a.str);
         }
-        else {
-            throw invalid_argument("missing rvalue");
+        else if (command != NULL) {
+            args = pp_batch_split_command(command->str);
         }
-    }
 
-    return expression::node::none;
+        if (file != NULL)
+            u.in_file = pp_batch_path(d,file->str);
+        if (output != NULL)
+            out = pp_batch_path(d,output->str);
+
+        for (size_t ai=1;ai < args.size();ai++) { /* args[0] is the compiler */
+            const string &a = args[ai];
+            const bool more = (ai+size_t(1)) < args.size();
+
+            if ((a == "-D" || a == "-U") && more)
+                u.macros.push_back(make_pair(a[1],args[++ai]));
+            else if (a.size() > 2 && (a.compare(0,2,"-D") == 0 || a.compare(0,2,"-U") == 0))
+                u.macros.push_back(make_pair(a[1],a.substr(2)));
+            else if (a == "-I" && more)
+                u.include_paths.push_back(pp_batch_path(d,args[++ai]));
+            else if (a.size() > 2 && a.compare(0,2,"-I") == 0)
+                u.include_paths.push_back(pp_batch_path(d,a.substr(2)));
+            else if (a == "-o" && more)
+                out = pp_batch_path(d,args[++ai]);
+            else if (!a.empty() && a[0] != '-' && file == NULL)
+                u.in_file = pp_batch_path(d,a);
+        }
+
+        if (u.in_file.empty())
+            throw invalid_argument("compile command without an input file");
+
+        u.out_file = pp_batch_output(u.in_file,out);
+        if (u.out_file == u.in_file)
+            throw invalid_argument("output would overwrite the input " + u.in_file);
+
+        units.push_back(move(u));
+    }
 }
 
-expression::node::node_t parse_expr_rtl_ternary(expression &expr,token_string::iterator &ti,const token_string::iterator &tie,unsigned int min_prec,expression::node::node_t headnode) {
-    unsigned int prec;
+/* --batch: run every unit of the compile database, on --jobs threads */
+static int preprocess_batch(const pp_cmdline &cl) {
+    const pp_options &opt = cl.opt;
+    vector<pp_batch_unit> units;
 
-    while (ti != tie && (*ti).tval == token::QUESTIONMARK && (prec=token::precedence(*ti,false)) <= min_prec) {
-        const expression::node::node_t opnode = expr.newnode(*(ti++),token::TERNARY);
+    if (!opt.configs.empty() || opt.unifdef || !opt.pch_save_file.empty() || !opt.macro_stats_file.empty()) {
+        fprintf(pp_stderr(),"--batch cannot be used with --config, --unifdef, --pch-save or --macro-stats\n");
+        return 1;
+    }
 
-        if (ti != tie) {
-            expr.getnode(opnode).children.resize(3);
-            expr.getnode(opnode).children[0] = headnode;
-            expr.getnode(opnode).children[1] = parse_expr(expr,ti,tie,prec);
+    try {
+        pp_batch_load(units,cl.batch_file);
+    }
+    catch (const exception &e) {
+        fprintf(pp_stderr(),"%s: error: %s\n",cl.batch_file.c_str(),e.what());
+        return 1;
+    }
 
-            if (ti == tie)
-                throw invalid_argument("Ternary ? expected :");
-            if ((*ti).tval != token::COLON)
-                throw invalid_argument("Ternary ? expected :");
-            ti++;
+    /* shared, read-only while the threads run */
+    shared_ptr<const pp_pch_file> pch;
+    if (!opt.pch_load_file.empty())
+        pch = pp_pch_load(opt.pch_load_file);
+    pp_file_cache_enabled = true;
 
-            expr.getnode(opnode).children[2] = parse_expr(expr,ti,tie,prec);
-            headnode = opnode;
-        }
-        else {
-            throw invalid_argument("missing rvalue");
+    atomic<size_t> next(0);
+
+    /* the threads write where this one does, see --daemon */
+    FILE *const stderr_fp = pp_stderr_fp;
+    const string cwd = pp_cwd;
+
+    const auto worker = [&]() {
+        map<string,pp_directive_index> directive_indexes; /* kept across the units of this thread */
+        size_t i;
+
+        pp_stderr_fp = stderr_fp;
+        pp_cwd = cwd;
+
+        while ((i=next++) < units.size()) {
+            pp_batch_unit &u = units[i];
+            pp_options unit_opt(opt);
+
+            unit_opt.pch_load_file.clear(); /* loaded above, or failed once already */
+            unit_opt.cmdline_macros.insert(unit_opt.cmdline_macros.end(),u.macros.begin(),u.macros.end());
+            unit_opt.include_paths.insert(unit_opt.include_paths.end(),u.include_paths.begin(),u.include_paths.end());
+
+            pp_context ctx(unit_opt);
+            ctx.pch = pch;
+            ctx.directive_indexes.swap(directive_indexes);
+            u.result = preprocess_unit(ctx,u.in_file,u.out_file);
+            ctx.directive_indexes.swap(directive_indexes);
         }
+    };
+
+    size_t jobs = (cl.batch_jobs != 0u) ? cl.batch_jobs : thread::hardware_concurrency();
+    if (jobs == 0) jobs = 1;
+    if (jobs > units.size()) jobs = units.size();
+
+    vector<thread> threads;
+    for (size_t j=1;j < jobs;j++)
+        threads.push_back(thread(worker));
+
+    worker();
+    for (auto &t : threads)
+        t.join();
+
+    int r = 0;
+    for (const auto &u : units) {
+        if (u.result != 0)
+            r = 1;
     }
 
-    return headnode;
+    return r;
 }
 
-expression::node::node_t parse_expr_rtl(expression &expr,token_string::iterator &ti,const token_string::iterator &tie,unsigned int min_prec,const tokenlist_entry *match_token,expression::node::node_t headnode) {
-    token::token_t repl;
-    unsigned int prec;
+/* --daemon. a client sends its working directory and command line, with its standard
+ * streams attached (SCM_RIGHTS), and waits for the exit status. the daemon runs each
+ * command on a thread of its own like the command line program would, against the
+ * shared caches, which it keeps for as long as it runs. inotify on the directory of
+ * every cached file says which entries went stale */
+static const char               pp_daemon_magic[4] = {'H','X','D','1'};
+static constexpr uint32_t       pp_daemon_max_request = uint32_t(1) << uint32_t(24);
+
+/* directive indexes kept between commands, one set per command running */
+static vector< map<string,pp_directive_index> > pp_daemon_indexes;
+
+static int pp_command(int argc,char **argv);
+
+static bool pp_read_full(const int fd,void *p,size_t len) {
+    while (len != 0) {
+        const ssize_t rd = read(fd,p,len);
+        if (rd < 0 && errno == EINTR)
+            continue;
+        if (rd <= 0)
+            return false;
 
-    while (ti != tie && match_token_list(/*&*/repl,*ti,match_token) && (prec=token::precedence(*ti,false)) <= min_prec) {
-        const expression::node::node_t opnode = expr.newnode(*(ti++),repl);
+        p = (char*)p + rd;
+        len -= size_t(rd);
+    }
 
-        if (ti != tie) {
-            expr.getnode(opnode).children.resize(2);
-            expr.getnode(opnode).children[0] = headnode;
-            expr.getnode(opnode).children[1] = parse_expr(expr,ti,tie,prec);
-            headnode = opnode;
-        }
-        else {
-            throw invalid_argument("missing rvalue");
-        }
+    return true;
+}
+
+static bool pp_write_full(const int fd,const void *p,size_t len) {
+    while (len != 0) {
+        const ssize_t wr = send(fd,p,len,MSG_NOSIGNAL);
+        if (wr < 0 && errno == EINTR)
+            continue;
+        if (wr <= 0)
+            return false;
+
+        p = (const char*)p + wr;
+        len -= size_t(wr);
     }
 
-    return headnode;
+    return true;
 }
 
-expression::node::node_t parse_expr_ltr_unary(expression &expr,token_string::iterator &ti,const token_string::iterator &tie,unsigned int min_prec,const tokenlist_entry *match_token,expression::node::node_t headnode) {
-    token::token_t repl;
-    unsigned int prec;
+static int pp_daemon_connect(const string &path) {
+    struct sockaddr_un sa;
+
+    if (path.size() >= sizeof(sa.sun_path))
+        return -1;
 
-    while (ti != tie && match_token_list(/*&*/repl,*ti,match_token) && (prec=token::precedence(*ti,false)) <= min_prec) {
-        const expression::node::node_t opnode = expr.newnode(*(ti++),repl);
+    const int c = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+    if (c < 0)
+        return -1;
 
-        expr.getnode(opnode).children.resize(1);
-        expr.getnode(opnode).children[0] = headnode;
-        headnode = opnode;
+    memset(&sa,0,sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path,path.c_str(),path.size());
+    if (connect(c,(const struct sockaddr*)(&sa),sizeof(sa)) != 0) {
+        close(c);
+        return -1;
     }
 
-    return headnode;
+    return c;
 }
 
-expression::node::node_t parse_expr_ltr(expression &expr,token_string::iterator &ti,const token_string::iterator &tie,unsigned int min_prec,const tokenlist_entry *match_token,expression::node::node_t headnode) {
-    token::token_t repl;
-    unsigned int prec;
+/* drop everything learned from the file system. caller holds pp_shared_lock */
+static void pp_daemon_forget() {
+    pp_file_cache.clear();
+    pp_include_guards.clear();
+    pp_realpaths.clear();
+    pp_dir_listings.clear();
+    pp_include_cache.clear();
+    pp_hdr_cache.clear();
+    pp_hdr_cache_loaded.clear();
+    pp_cache_generation++;
+}
 
-    while (ti != tie && match_token_list(repl,*ti,match_token) && (prec=token::precedence(*ti,false)) <= min_prec) {
-        const expression::node::node_t opnode = expr.newnode(*(ti++),repl);
+/* name in dir was written, created, removed or renamed. caller holds pp_shared_lock */
+static void pp_daemon_changed(const string &dir,const string &name,const uint32_t mask) {
+    const string path = dir + name;
+    bool stale = false;
 
-        if (ti != tie) {
-            expr.getnode(opnode).children.resize(2);
-            expr.getnode(opnode).children[0] = headnode;
-            expr.getnode(opnode).children[1] = parse_expr(expr,ti,tie,prec-1u);
-            headnode = opnode;
-        }
-        else {
-            throw invalid_argument("missing rvalue");
-        }
+    if (mask & IN_ISDIR) { /* everything below it, and every lookup through it */
+        if (mask & (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO))
+            pp_daemon_forget();
+        return;
     }
 
-    return headnode;
-}
+    if (pp_file_cache.erase(path) != 0)
+        stale = true;
+    if (pp_include_guards.erase(path) != 0)
+        stale = true;
 
-expression::node::node_t parse_expr_subexpr(expression &expr,token_string::iterator &ti,const token_string::iterator &tie) {
-    if (ti != tie && (*ti).tval == token::OPEN_PARENS) {
-        ti++;/* step past*/ const expression::node::node_t opnode = parse_expr(expr,ti,tie);
+    if (mask & (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO)) {
+        pp_dir_listings.erase(dir);
+        pp_realpaths.clear(); /* symlinks */
 
-        if (ti == tie)
-            throw invalid_argument("missing closing parens");
-        if ((*ti).tval != token::CLOSE_PARENS)
-            throw invalid_argument("missing closing parens");
-        ti++;
+        /* #include lookups of this name, found or not, may resolve differently now */
+        for (auto ci=pp_include_cache.begin();ci != pp_include_cache.end();) {
+            const string &key = ci->first;
+            const size_t p = key.find_last_of('/');
+            const size_t n = (p != string::npos && p > key.find_last_of('\0')) ? (p + size_t(1)) : (key.find_last_of('\0') + size_t(1));
 
-        return opnode;
+            if (key.compare(n,string::npos,name) == 0) {
+                ci = pp_include_cache.erase(ci);
+                stale = true;
+            }
+            else {
+                ci++;
+            }
+        }
     }
 
-    return expression::node::none;
+    /* header cache entries and directive indexes may have read it */
+    if (stale) {
+        pp_hdr_cache.clear();
+        pp_hdr_cache_loaded.clear();
+        pp_cache_generation++;
+    }
 }
 
-bool is_type_token(token::token_t &repl,const token &t) {
-    switch (t.tval) {
-        case token::INT:
-        case token::CHAR:
-        case token::LONG:
-        case token::SHORT:
-        case token::CONST:
-        case token::SIGNED:
-        case token::UNSIGNED:
-            repl = t.tval;
-            return true;
-        case token::AMPERSAND:
-            repl = token::ADDRESSOF;
-            return true;
-        case token::STAR:
-            repl = token::DEREFERENCE;
-            return true;
-        default:
-            break;
-    };
+static void pp_daemon_watch() {
+    alignas(struct inotify_event) char buf[65536];
 
-    return false;
-}
+    for (;;) {
+        const ssize_t rd = read(pp_watch_fd,buf,sizeof(buf));
+        if (rd < 0 && errno == EINTR)
+            continue;
+        if (rd <= 0) { /* nothing cached can be trusted from here on */
+            fprintf(pp_stderr(),"haxpp daemon: cannot read inotify events: %s\n",strerror(errno));
+            exit(1);
+        }
 
-expression::node::node_t parse_expr_typecast(expression &expr,token_string::iterator &ti,const token_string::iterator &tie,const bool exprfollow=true) {
-    token::token_t repl;
-    auto tmpti = ti;
+        lock_guard<mutex> lock(pp_shared_lock);
+        for (ssize_t i=0;i < rd;) {
+            const struct inotify_event *ev = (const struct inotify_event*)(buf + i);
+            i += ssize_t(sizeof(*ev) + ev->len);
 
-    if (tmpti != tie && (*tmpti).tval == token::OPEN_PARENS) {
-        tmpti++;
-        if (tmpti != tie && is_type_token(/*&*/repl,*tmpti)) {
-            ti = tmpti;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                pp_daemon_forget();
+                continue;
+            }
 
-            const expression::node::node_t opnode = expr.newnode(exprfollow ? token::TYPECAST : token::TYPESPEC);
+            const auto wi = pp_watch_dirs.find(ev->wd);
+            if (wi == pp_watch_dirs.end())
+                continue;
+
+            if (ev->mask & (IN_IGNORED|IN_DELETE_SELF|IN_MOVE_SELF)) { /* the names it was watched by mean something else now */
+                for (const auto &dir : wi->second)
+                    pp_watched.erase(dir);
+                if (!(ev->mask & IN_IGNORED))
+                    inotify_rm_watch(pp_watch_fd,ev->wd);
+                pp_watch_dirs.erase(wi);
+                pp_daemon_forget();
+                continue;
+            }
 
-            /* NTS: Treat LOGICAL_AND as if two ADDRESSOF so && works properly here */
-            while (ti != tie && (is_type_token(/*&*/repl,*ti) || (*ti).tval == token::LOGICAL_AND)) {
-                if ((*ti).tval == token::LOGICAL_AND) {
-                    expr.getnode(opnode).children.push_back(expr.newnode(token::ADDRESSOF));
-                    expr.getnode(opnode).children.push_back(expr.newnode(token::ADDRESSOF));
-                    ti++;
-                }
-                else {
-                    expr.getnode(opnode).children.push_back(expr.newnode(*(ti++),repl));
-                }
+            if (ev->len != 0) {
+                for (const auto &dir : wi->second)
+                    pp_daemon_changed(dir,ev->name,ev->mask);
             }
+        }
+    }
+}
 
-            if (ti == tie)
-                throw invalid_argument("missing closing parens");
-            if ((*ti).tval != token::CLOSE_PARENS)
-                throw invalid_argument("missing closing parens");
-            ti++;
+/* the client's streams, then the request: working directory and arguments */
+static bool pp_daemon_recv(const int c,int (&fds)[3],string &b) {
+    union {
+        struct cmsghdr          h;
+        char                    buf[CMSG_SPACE(sizeof(int) * 3)];
+    } cm;
+    char hdr[sizeof(pp_daemon_magic) + sizeof(uint32_t)];
+    struct msghdr mh;
+    struct iovec iov;
+    uint32_t len;
+
+    memset(&mh,0,sizeof(mh));
+    iov.iov_base = hdr;
+    iov.iov_len = sizeof(hdr);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cm.buf;
+    mh.msg_controllen = sizeof(cm.buf);
+
+    ssize_t rd;
+    do { rd = recvmsg(c,&mh,MSG_CMSG_CLOEXEC); } while (rd < 0 && errno == EINTR);
+    if (rd <= 0)
+        return false;
 
-            if (exprfollow)
-                expr.getnode(opnode).children.push_back(parse_expr(expr,ti,tie));
+    for (struct cmsghdr *h=CMSG_FIRSTHDR(&mh);h != NULL;h=CMSG_NXTHDR(&mh,h)) {
+        if (h->cmsg_level == SOL_SOCKET && h->cmsg_type == SCM_RIGHTS && h->cmsg_len == CMSG_LEN(sizeof(fds)))
+            memcpy(fds,CMSG_DATA(h),sizeof(fds));
+    }
 
-            return opnode;
+    if (fds[0] < 0 || !pp_read_full(c,hdr + rd,sizeof(hdr) - size_t(rd)) || memcmp(hdr,pp_daemon_magic,sizeof(pp_daemon_magic)) != 0)
+        return false;
+
+    memcpy(&len,hdr + sizeof(pp_daemon_magic),sizeof(len));
+    if (len > pp_daemon_max_request)
+        return false;
+
+    b.resize(len);
+    return pp_read_full(c,&b[0],len);
+}
+
+/* one client, on its own thread */
+static void pp_daemon_serve(const int c) {
+    int fds[3] = { -1, -1, -1 };
+    int32_t status = 1;
+    string b;
+
+    if (pp_daemon_recv(c,fds,b)) {
+        FILE *in = fdopen(fds[0],"rb");
+        FILE *out = fdopen(fds[1],"wb");
+        FILE *err = fdopen(fds[2],"wb");
+
+        if (in != NULL && out != NULL && err != NULL) {
+            pp_stdin_fp = in;
+            pp_stdout_fp = out;
+            pp_stderr_fp = err;
+
+            try {
+                pp_bin_reader r(b);
+                const string cwd = r.str();
+                vector<string> args;
+                vector<char*> argv;
+
+                for (uint32_t i=r.u32();i != 0u;i--)
+                    args.push_back(r.str());
+                for (auto &a : args)
+                    argv.push_back(&a[0]);
+                argv.push_back(NULL);
+
+                /* this thread gets a working directory of its own */
+                if (unshare(CLONE_FS) != 0 || chdir(cwd.c_str()) != 0)
+                    throw runtime_error("cannot change to " + cwd + ": " + strerror(errno));
+
+                pp_cwd = cwd;
+                status = pp_command(int(args.size()),argv.data());
+            }
+            catch (const exception &e) {
+                fprintf(err,"haxpp daemon: %s\n",e.what());
+            }
         }
+
+        if (in != NULL) fclose(in); else if (fds[0] >= 0) close(fds[0]);
+        if (out != NULL) fclose(out); else if (fds[1] >= 0) close(fds[1]);
+        if (err != NULL) fclose(err); else if (fds[2] >= 0) close(fds[2]);
     }
 
-    return expression::node::none;
+    pp_write_full(c,&status,sizeof(status));
+    close(c);
 }
 
-expression::node::node_t parse_expr_sizeof(expression &expr,token_string::iterator &ti,const token_string::iterator &tie) {
-    if (ti != tie && (*ti).tval == token::SIZEOF) {
-        ti++;
+static int pp_daemon_run(const pp_cmdline &cl) {
+    const string &path = cl.daemon_socket;
+    struct sockaddr_un sa;
 
-        const expression::node::node_t opnode = expr.newnode(token::SIZEOF);
+    if (!pp_cwd.empty()) {
+        fprintf(pp_stderr(),"--daemon cannot be run by a daemon\n");
+        return 1;
+    }
+    if (path.size() >= sizeof(sa.sun_path)) {
+        fprintf(pp_stderr(),"--daemon socket path is too long\n");
+        return 1;
+    }
 
-        expr.getnode(opnode).children.resize(1);
-        if (ti != tie && (*ti).tval == token::OPEN_PARENS) {
-            expr.getnode(opnode).children[0] = parse_expr_typecast(expr,ti,tie,/*follows*/false);
-        }
-        else {
-            if (ti == tie)
-                throw invalid_argument("sizeof without argument");
+    signal(SIGPIPE,SIG_IGN);
+    if ((pp_watch_fd=inotify_init1(IN_CLOEXEC)) < 0) {
+        fprintf(pp_stderr(),"haxpp daemon: inotify: %s\n",strerror(errno));
+        return 1;
+    }
+    pp_file_cache_enabled = true;
+
+    const int s = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+    if (s < 0) {
+        fprintf(pp_stderr(),"haxpp daemon: socket: %s\n",strerror(errno));
+        return 1;
+    }
 
-            expr.getnode(opnode).children[0] = expr.newnode(*(ti++));
+    memset(&sa,0,sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    memcpy(sa.sun_path,path.c_str(),path.size());
+    if (bind(s,(const struct sockaddr*)(&sa),sizeof(sa)) != 0 && errno == EADDRINUSE) {
+        const int c = pp_daemon_connect(path);
+        if (c >= 0) {
+            close(c);
+            fprintf(pp_stderr(),"haxpp daemon: already running on %s\n",path.c_str());
+            return 1;
         }
 
-        return opnode;
+        unlink(path.c_str()); /* left behind by one that is gone */
+        if (bind(s,(const struct sockaddr*)(&sa),sizeof(sa)) != 0) {
+            fprintf(pp_stderr(),"haxpp daemon: cannot bind %s: %s\n",path.c_str(),strerror(errno));
+            return 1;
+        }
+    }
+    if (listen(s,SOMAXCONN) != 0) {
+        fprintf(pp_stderr(),"haxpp daemon: cannot listen on %s: %s\n",path.c_str(),strerror(errno));
+        return 1;
     }
 
-    return expression::node::none;
-}
+    thread(pp_daemon_watch).detach();
 
-const tokenlist_entry           tokenlist_prec1_unary[] = {
-    {token::INCREMENT,          token::POSTINCREMENT}, // 1
-    {token::DECREMENT,          token::POSTDECREMENT}, // 1
-    {token::NONE,               token::NONE}
-};
-const tokenlist_entry           tokenlist_prec1_binary[] = {
-    {token::PERIOD,             token::STRUCTREF},
-    {token::PTRARROW,           token::PTRARROW},
-    {token::NONE,               token::NONE}
-};
-const tokenlist_entry           tokenlist_prec2_unary[] = {
-    {token::INCREMENT,          token::PREINCREMENT}, // 2
-    {token::DECREMENT,          token::PREDECREMENT}, // 2
-    {token::PLUS,               token::PLUS}, // 2
-    {token::MINUS,              token::NEGATE}, // 2
-    {token::NOT,                token::NOT}, // 2
-    {token::COMPLEMENT,         token::COMPLEMENT}, // 2
-    {token::STAR,               token::DEREFERENCE}, // 2
-    {token::AMPERSAND,          token::ADDRESSOF}, // 2
-    {token::DEFINED,            token::DEFINED}, // 2
-    {token::SIZEOF,             token::SIZEOF}, // 2
-    {token::ALIGNOF,            token::ALIGNOF}, // 2
-    {token::NONE,               token::NONE}
-};
-const tokenlist_entry           tokenlist_precbinary3_12[] = {
-    {token::LOGICAL_OR,         token::LOGICAL_OR}, // 12
-    {token::LOGICAL_AND,        token::LOGICAL_AND}, // 11
-    {token::PIPE,               token::BINARY_OR}, // 10
-    {token::CARET,              token::BINARY_XOR}, // 9
-    {token::AMPERSAND,          token::BINARY_AND}, // 8
-    {token::EQUALS,             token::EQUALS}, // 7
-    {token::NOT_EQUALS,         token::NOT_EQUALS}, // 7
-    {token::LESS_THAN,          token::LESS_THAN}, // 6
-    {token::LESS_THAN_OR_EQUAL, token::LESS_THAN_OR_EQUAL}, // 6
-    {token::GREATER_THAN,       token::GREATER_THAN}, // 6
-    {token::GREATER_THAN_OR_EQUAL,token::GREATER_THAN_OR_EQUAL}, //6
-    {token::LEFT_SHIFT,         token::LEFT_SHIFT}, // 5
-    {token::RIGHT_SHIFT,        token::RIGHT_SHIFT}, // 5
-    {token::PLUS,               token::PLUS}, // 4
-    {token::MINUS,              token::MINUS}, // 4
-    {token::STAR,               token::MULTIPLY}, // 3
-    {token::DIVISION,           token::DIVISION}, // 3
-    {token::MODULUS,            token::MODULUS}, // 3
-    {token::NONE,               token::NONE}
-};
-const tokenlist_entry           tokenlist_prec14[] = {
-    {token::ASSIGNMENT,         token::ASSIGNMENT},
-    {token::PLUS_EQUALS,        token::PLUS_EQUALS},
-    {token::MINUS_EQUALS,       token::MINUS_EQUALS},
-    {token::MULTIPLY_EQUALS,    token::MULTIPLY_EQUALS},
-    {token::DIVIDE_EQUALS,      token::DIVIDE_EQUALS},
-    {token::MODULUS_EQUALS,     token::MODULUS_EQUALS},
-    {token::LEFT_SHIFT_EQUALS,  token::LEFT_SHIFT_EQUALS},
-    {token::RIGHT_SHIFT_EQUALS, token::RIGHT_SHIFT_EQUALS},
-    {token::AND_EQUALS,         token::AND_EQUALS},
-    {token::XOR_EQUALS,         token::XOR_EQUALS},
-    {token::OR_EQUALS,          token::OR_EQUALS},
-    {token::NONE,               token::NONE}
-};
-const tokenlist_entry           tokenlist_prec15[] = {
-    {token::COMMA,              token::COMMA},
-    {token::NONE,               token::NONE}
-};
+    for (;;) {
+        const int c = accept4(s,NULL,NULL,SOCK_CLOEXEC);
+        if (c < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
 
-expression::node::node_t parse_expr(expression &expr,token_string::iterator &ti,const token_string::iterator &tie,unsigned int min_prec) {
-    if (ti == tie)
-        throw invalid_argument("expected token for expr parse");
+            fprintf(pp_stderr(),"haxpp daemon: accept: %s\n",strerror(errno));
+            return 1;
+        }
 
-    expression::node::node_t headnode;
+        thread(pp_daemon_serve,c).detach();
+    }
+}
 
-    /* (typecast) */
-    headnode = parse_expr_typecast(expr,ti,tie);
+/* HAXPP_DAEMON: have the daemon run the command. -1 if there is no daemon to run it */
+static int pp_client_run(const string &path,int argc,char **argv) {
+    char cwd[PATH_MAX];
+    int fds[3] = { 0, 1, 2 };
+    union {
+        struct cmsghdr          h;
+        char                    buf[CMSG_SPACE(sizeof(fds))];
+    } cm;
+    char hdr[sizeof(pp_daemon_magic) + sizeof(uint32_t)];
+    struct msghdr mh;
+    struct iovec iov;
+    int32_t status;
+    string b;
+
+    if (getcwd(cwd,sizeof(cwd)) == NULL)
+        return -1;
+
+    pp_bin_put(b,string(cwd));
+    pp_bin_put(b,uint32_t(argc));
+    for (int i=0;i < argc;i++)
+        pp_bin_put(b,string(argv[i]));
+
+    const uint32_t len = uint32_t(b.size());
+    memcpy(hdr,pp_daemon_magic,sizeof(pp_daemon_magic));
+    memcpy(hdr + sizeof(pp_daemon_magic),&len,sizeof(len));
+
+    const int c = pp_daemon_connect(path);
+    if (c < 0)
+        return -1;
+
+    memset(&mh,0,sizeof(mh));
+    memset(&cm,0,sizeof(cm));
+    iov.iov_base = hdr;
+    iov.iov_len = sizeof(hdr);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cm.buf;
+    mh.msg_controllen = sizeof(cm.buf);
+
+    struct cmsghdr *h = CMSG_FIRSTHDR(&mh);
+    h->cmsg_level = SOL_SOCKET;
+    h->cmsg_type = SCM_RIGHTS;
+    h->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(h),fds,sizeof(fds));
+
+    if (sendmsg(c,&mh,MSG_NOSIGNAL) != ssize_t(sizeof(hdr)) || !pp_write_full(c,b.data(),b.size())) {
+        close(c);
+        return -1; /* nothing was run yet */
+    }
 
-    /* (expression) */
-    if (headnode == expression::node::none)
-        headnode = parse_expr_subexpr(expr,ti,tie);
+    if (!pp_read_full(c,&status,sizeof(status))) {
+        fprintf(pp_stderr(),"haxpp: lost the connection to the daemon at %s\n",path.c_str());
+        status = 1;
+    }
 
-    /* sizeof(type) */
-    if (headnode == expression::node::none)
-        headnode = parse_expr_sizeof(expr,ti,tie);
+    close(c);
+    return status;
+}
 
-    /* expression
-     * expression = ~expression */
-    if (headnode == expression::node::none)
-        headnode = parse_expr_rtl_unary(expr,ti,tie,min_prec,tokenlist_prec2_unary);
+/* --shared-cache: use the cache file at path, creating it if there is none. caller holds pp_shared_lock */
+static bool pp_shm_open(const string &path,const uint64_t size) {
+    char cwd[PATH_MAX];
 
-    /* number */
-    if (headnode == expression::node::none)
-        headnode = expr.newnode(*(ti++));
+    if (pp_shm != NULL)
+        return true;
+    if (getcwd(cwd,sizeof(cwd)) == NULL)
+        return false;
 
-    /* expression
-     * expression ++ -- () [] . -> expression */
-    headnode = parse_expr_ltr_unary(expr,ti,tie,min_prec,tokenlist_prec1_unary,headnode);
-    headnode = parse_expr_ltr(expr,ti,tie,min_prec,tokenlist_prec1_binary,headnode);
+    pp_shm_map *m = pp_shm_attach(path);
+    if (m == NULL && (m=pp_shm_create(path,size,false)) == NULL)
+        m = pp_shm_attach(path); /* another process created it first */
+    if (m == NULL)
+        return false;
 
-    /* expression
-     * expression * / % + - << >> etc expression */
-    headnode = parse_expr_ltr(expr,ti,tie,min_prec,tokenlist_precbinary3_12,headnode);
+    pp_shm_cwd = cwd;
+    pp_shm = m;
+    return true;
+}
 
-    /* expression
-     * expression ? t-expression : f-expression */
-    headnode = parse_expr_rtl_ternary(expr,ti,tie,min_prec,headnode);
+/* --prefetch workers */
+static constexpr size_t         pp_prefetch_batch = 32;     /* files per io_uring submission */
+static constexpr unsigned int   pp_prefetch_threads = 4;    /* without io_uring */
+static vector<thread>           pp_prefetch_workers;
+static bool                     pp_prefetch_stopping = false;
 
-    /* expression
-     * expression = expression (also += -= *= etc) */
-    headnode = parse_expr_rtl(expr,ti,tie,min_prec,tokenlist_prec14,headnode);
+static void pp_prefetch_finish(const vector< shared_ptr<pp_prefetch_entry> > &v) {
+    lock_guard<mutex> lock(pp_prefetch_lock);
 
-    /* expression
-     * expression , expression */
-    headnode = parse_expr_ltr(expr,ti,tie,min_prec,tokenlist_prec15,headnode);
+    for (const auto &e : v)
+        e->done = true;
 
-    return headnode;
+    pp_prefetch_done.notify_all();
 }
 
-void dump_expr_node(FILE *fp,const expression &expr,const expression::node::node_t node,unsigned int depth) {
-    if (fp == NULL)
-        fp = stderr;
+/* up to max entries off the queue, marked started. empty when stopping */
+static vector< pair<string, shared_ptr<pp_prefetch_entry> > > pp_prefetch_next(const size_t max) {
+    vector< pair<string, shared_ptr<pp_prefetch_entry> > > r;
+    unique_lock<mutex> lock(pp_prefetch_lock);
 
-    for (unsigned int c=0;c < depth;c++)
-        fprintf(fp,"| ");
+    while (r.empty()) {
+        pp_prefetch_work.wait(lock,[]() { return pp_prefetch_stopping || !pp_prefetch_queue.empty(); });
+        if (pp_prefetch_stopping)
+            break;
 
-    fprintf(fp,"node[%zu]: %s\n",node,to_string(expr.getnode(node).tval).c_str());
-    for (size_t i=0;i < expr.getnode(node).children.size();i++)
-        dump_expr_node(fp,expr,expr.getnode(node).children[i],depth+1u);
-}
+        while (!pp_prefetch_queue.empty() && r.size() < max) {
+            const string key = move(pp_prefetch_queue.front());
+            pp_prefetch_queue.pop_front();
 
-void dump_expr(FILE *fp,const expression &expr) {
-    if (fp == NULL)
-        fp = stderr;
+            const auto fi = pp_prefetch_files.find(key);
+            if (fi != pp_prefetch_files.end() && !fi->second->started) { /* not taken by the reader first */
+                fi->second->started = true;
+                r.push_back(make_pair(key,fi->second));
+            }
+        }
+    }
 
-    fprintf(fp,"expression:\n");
-    if (expr.root != expression::node::none)
-        dump_expr_node(fp,expr,expr.root,1);
-    fprintf(fp,"END\n");
+    return r;
 }
 
-signed long long pp_if_eval(expression &expr,expression::node::node_t node) {
-    if (node == expression::node::none)
-        throw invalid_argument("expression tree with no root");
-
-    const auto &n = expr.getnode(node);
-    switch (n.tval.tval) {
-        case token::INTEGER:
-            return n.tval.i.s;
-        case token::FLOAT:
-            throw invalid_argument("Floating point not allowed in expressions at preprocessor level");
-        case token::STRING:
-            throw invalid_argument("Strings not allowed in expressions at preprocessor level");
-        case token::ASSIGNMENT:
-            throw invalid_argument("Assignment not permitted in macro preprocessor");
-        case token::POSTINCREMENT:
-        case token::POSTDECREMENT:
-        case token::PREINCREMENT:
-        case token::PREDECREMENT:
-            throw invalid_argument("increment/decrement not allowed in macro preprocessor");
-        case token::DEREFERENCE:
-        case token::STRUCTREF:
-        case token::ADDRESSOF:
-            throw invalid_argument("struct/pointer ref not allowed in macro preprocessor");
-        case token::SIZEOF:
-            throw invalid_argument("sizeof not allowed in macro preprocessor");
-        case token::COMMA:
-            return pp_if_eval(expr,n.children.at(1)); /* a,b -> b */
-        case token::PLUS:
-            if (n.children.size() == 2)
-                return pp_if_eval(expr,n.children.at(0)) + pp_if_eval(expr,n.children.at(1));
-            else if (n.children.size() == 1)
-                return pp_if_eval(expr,n.children.at(0)); /* +a -> a */
-        case token::NEGATE:
-            return -pp_if_eval(expr,n.children.at(0));
-        case token::MINUS:
-            return pp_if_eval(expr,n.children.at(0)) - pp_if_eval(expr,n.children.at(1));
-        case token::NOT:
-            return (pp_if_eval(expr,n.children.at(0)) == 0) ? 1 : 0;
-        case token::COMPLEMENT:
-            return ~pp_if_eval(expr,n.children.at(0));
-        case token::MULTIPLY:
-            return pp_if_eval(expr,n.children.at(0)) * pp_if_eval(expr,n.children.at(1));
-        case token::DIVISION:
-            return pp_if_eval(expr,n.children.at(0)) / pp_if_eval(expr,n.children.at(1));
-        case token::MODULUS:
-            return pp_if_eval(expr,n.children.at(0)) % pp_if_eval(expr,n.children.at(1));
-        case token::LOGICAL_AND:
-            return ((pp_if_eval(expr,n.children.at(0)) != 0ll) && (pp_if_eval(expr,n.children.at(1)) != 0ll)) ? 1 : 0;
-        case token::LOGICAL_OR:
-            return ((pp_if_eval(expr,n.children.at(0)) != 0ll) || (pp_if_eval(expr,n.children.at(1)) != 0ll)) ? 1 : 0;
-        case token::BINARY_AND:
-            return pp_if_eval(expr,n.children.at(0)) & pp_if_eval(expr,n.children.at(1));
-        case token::BINARY_XOR:
-            return pp_if_eval(expr,n.children.at(0)) ^ pp_if_eval(expr,n.children.at(1));
-        case token::BINARY_OR:
-            return pp_if_eval(expr,n.children.at(0)) | pp_if_eval(expr,n.children.at(1));
-        case token::EQUALS:
-            return (pp_if_eval(expr,n.children.at(0)) == pp_if_eval(expr,n.children.at(1))) ? 1 : 0;
-        case token::NOT_EQUALS:
-            return (pp_if_eval(expr,n.children.at(0)) != pp_if_eval(expr,n.children.at(1))) ? 1 : 0;
-        case token::LESS_THAN:
-            return (pp_if_eval(expr,n.children.at(0)) < pp_if_eval(expr,n.children.at(1))) ? 1 : 0;
-        case token::LESS_THAN_OR_EQUAL:
-            return (pp_if_eval(expr,n.children.at(0)) <= pp_if_eval(expr,n.children.at(1))) ? 1 : 0;
-        case token::GREATER_THAN:
-            return (pp_if_eval(expr,n.children.at(0)) > pp_if_eval(expr,n.children.at(1))) ? 1 : 0;
-        case token::GREATER_THAN_OR_EQUAL:
-            return (pp_if_eval(expr,n.children.at(0)) >= pp_if_eval(expr,n.children.at(1))) ? 1 : 0;
-        case token::TERNARY:
-            return (pp_if_eval(expr,n.children.at(0)) != 0ll) ?
-                    pp_if_eval(expr,n.children.at(1)) :
-                    pp_if_eval(expr,n.children.at(2));
-        case token::IDENTIFIER:
-            return 0ll; /* if the macro expansion did not replace the identifier with a value then it is zero */
-        case token::DEFINED:
-            {
-                const auto &c = expr.getnode(n.children.at(0));
-                if (c.tval.tval == token::IDENTIFIER)
-                    return is_macro(c.tval.sval) ? 1 : 0;
-                else
-                    throw invalid_argument("defined() used with a non-identifier");
-            }
-        case token::TYPECAST: /* .at(0)=type tokens .at(1)=expression to typecast */
-            fprintf(stderr,"WARNING: Typecasts are ignored by the macro processor\n");
-            return pp_if_eval(expr,n.children.at(n.children.size()-size_t(1)));
-        default:
+static void pp_prefetch_thread() {
+    for (;;) {
+        const auto v = pp_prefetch_next(1);
+        if (v.empty())
             break;
-    };
 
-    throw invalid_argument(string("unsupported expression in preprocessor level, token ")+to_string(n.tval));
+        auto &e = *v[0].second;
+        e.content = pp_prefetch_read(v[0].first,e.st);
+        pp_prefetch_finish(vector< shared_ptr<pp_prefetch_entry> >(1,v[0].second));
+    }
 }
 
-bool pp_if_eval(token_string::iterator &ti,const token_string::iterator &tie) {
-    (void)ti;
-    (void)tie;
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+/* just enough of an io_uring for batches of openat and read, without liburing */
+class pp_uring {
+public:
+                                pp_uring() { }
+                                pp_uring(const pp_uring &) = delete;
+                                ~pp_uring();
+public:
+    bool                        setup(const unsigned int entries);
+    struct io_uring_sqe*        get_sqe();
+    bool                        submit_and_wait(const unsigned int count,vector<int32_t> &res);
+private:
+    int                         fd = -1;
+    void*                       sq_ring = MAP_FAILED;
+    void*                       cq_ring = MAP_FAILED;
+    size_t                      sq_ring_size = 0;
+    size_t                      cq_ring_size = 0;
+    struct io_uring_sqe*        sqes = (struct io_uring_sqe*)MAP_FAILED;
+    size_t                      sqes_size = 0;
+    unsigned int*               sq_head = NULL;
+    unsigned int*               sq_tail = NULL;
+    unsigned int                sq_mask = 0;
+    unsigned int                sq_entries = 0;
+    unsigned int*               sq_array = NULL;
+    unsigned int*               cq_head = NULL;
+    unsigned int*               cq_tail = NULL;
+    unsigned int                cq_mask = 0;
+    struct io_uring_cqe*        cqes = NULL;
+    unsigned int                tail = 0;               /* sq tail not yet handed to the kernel */
+    unsigned int                pending = 0;
+};
 
-    if (ti == tie)
-        throw invalid_argument("macro if condition requires something to evaluate");
+pp_uring::~pp_uring() {
+    if (sqes != MAP_FAILED) munmap(sqes,sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring,cq_ring_size);
+    if (sq_ring != MAP_FAILED) munmap(sq_ring,sq_ring_size);
+    if (fd >= 0) close(fd);
+}
 
-    expression expr;
-    expr.root = parse_expr(expr,ti,tie);
+bool pp_uring::setup(const unsigned int entries) {
+    struct io_uring_params p;
 
-    if (ppt_only)
-        dump_expr(NULL,expr);
+    memset(&p,0,sizeof(p));
+    if ((fd=int(syscall(__NR_io_uring_setup,entries,&p))) < 0)
+        return false;
 
-    if (ti != tie)
-        throw invalid_argument("if condition did not fully parse");
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_size = cq_ring_size = max(sq_ring_size,cq_ring_size);
 
-    signed long long v = pp_if_eval(expr,expr.root);
-    if (ppt_only)
-        fprintf(stderr,"#if eval result %lld\n",v);
+    sq_ring = mmap(NULL,sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+        return false;
 
-    return v != 0ll;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring = sq_ring;
+    else if ((cq_ring=mmap(NULL,cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING)) == MAP_FAILED)
+        return false;
+
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = (struct io_uring_sqe*)mmap(NULL,sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        return false;
+
+    char *sq = (char*)sq_ring;
+    char *cq = (char*)cq_ring;
+
+    sq_head = (unsigned int*)(sq + p.sq_off.head);
+    sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+    sq_mask = *(unsigned int*)(sq + p.sq_off.ring_mask);
+    sq_entries = p.sq_entries;
+    sq_array = (unsigned int*)(sq + p.sq_off.array);
+    cq_head = (unsigned int*)(cq + p.cq_off.head);
+    cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+    cq_mask = *(unsigned int*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    tail = *sq_tail;
+    return true;
 }
 
-/* preprocessing stage */
-bool accept_tokens(const token_string::iterator &tib,const token_string::iterator &tie) {
-    bool pass = pp_pass();
-    auto ti = tib;
+struct io_uring_sqe *pp_uring::get_sqe() {
+    if (tail - __atomic_load_n(sq_head,__ATOMIC_ACQUIRE) >= sq_entries)
+        return NULL;
 
-    /* we're only looking for #preprocessor directives here that control conditional inclusion */
-    if (ti != tie && tokenit_next_match_inc(ti,tie,token::PREPROC)) {
-        if (tokenit_next_match_inc(ti,tie,token::IF)) {
-            pp_cond_t pc; pc.on_if(pp_if_eval(ti,tie),pass);
-            pp_cond_stack.push(move(pc));
-        }
-        else if (tokenit_next_match_inc(ti,tie,token::ELIF)) {
-            if (!pp_cond_stack.empty()) {
-                pp_cond_stack.top().on_elif(pp_if_eval(ti,tie));
-            }
-            else {
-                throw invalid_argument("#else not allowed here");
-            }
-        }
-        else if (tokenit_next_match_inc(ti,tie,token::IFDEF)) {
-            const string &ident = tokenit_next_identifier(ti,tie); /* will throw exception if not! */
-            pp_cond_t pc; pc.on_ifdef(is_macro(ident),pass);
-            pp_cond_stack.push(move(pc));
+    struct io_uring_sqe *sqe = &sqes[tail & sq_mask];
+    memset(sqe,0,sizeof(*sqe));
+    sq_array[tail & sq_mask] = tail & sq_mask;
+    tail++;
+    pending++;
+    return sqe;
+}
+
+/* submit what get_sqe() handed out and wait for count completions. res[user_data] is
+ * the result of each */
+bool pp_uring::submit_and_wait(const unsigned int count,vector<int32_t> &res) {
+    unsigned int got = 0;
+
+    __atomic_store_n(sq_tail,tail,__ATOMIC_RELEASE);
+    while (got < count) {
+        const long r = syscall(__NR_io_uring_enter,fd,pending,count - got,IORING_ENTER_GETEVENTS,NULL,0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
         }
-        else if (tokenit_next_match_inc(ti,tie,token::IFNDEF)) {
-            const string &ident = tokenit_next_identifier(ti,tie); /* will throw exception if not! */
-            pp_cond_t pc; pc.on_ifdef(!is_macro(ident),pass);
-            pp_cond_stack.push(move(pc));
+        pending -= (unsigned int)min<long>(r,long(pending));
+
+        unsigned int head = *cq_head;
+        while (head != __atomic_load_n(cq_tail,__ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe &cqe = cqes[head & cq_mask];
+            if (cqe.user_data < res.size())
+                res[size_t(cqe.user_data)] = cqe.res;
+            head++;
+            got++;
         }
-        else if (tokenit_next_match_inc(ti,tie,token::DEFINE)) { /* some preprocessing done by the parse token code */
-            const string &ident = tokenit_next_identifier(ti,tie); /* will throw exception if not! */
-            macro_t macro;
-
-            if (tokenit_next_match_inc(ti,tie,token::OPEN_PARENS)) {
-                macro.parens = true;
-                /* parameter list, IDENTIFIER. Final one may be __VA_ARGS__ */
-                do {
-                    if (ti == tie) throw invalid_argument("#define macro param list expected close parens");
-                    if ((*ti).tval == token::IDENTIFIER) {
-                        if (find(macro.param.begin(),macro.param.end(),(*ti).sval) == macro.param.end()) {
-                            macro.param.push_back((*ti).sval);
-                            ti++;
-                        }
-                        else {
-                            throw invalid_argument(string("parameter specified more than once ") + (*ti).sval);
-                        }
+        __atomic_store_n(cq_head,head,__ATOMIC_RELEASE);
+    }
 
-                        if (ti == tie) throw invalid_argument("#define macro param cut off suddenly");
+    return true;
+}
 
-                        /* allow older style param... */
-                        if (tokenit_next_match_inc(ti,tie,token::DOTDOTDOT)) {
-                            macro.last_param_variadic = true;
-                            macro.last_param_optional = false;
+/* one thread, a batch at a time: open them all, then read them all */
+static void pp_prefetch_uring_thread(pp_uring *ring) {
+    unique_ptr<pp_uring> owner(ring);
 
-                            /* this must be the last param! */
-                            if (!tokenit_next_match_inc(ti,tie,token::CLOSE_PARENS))
-                                throw invalid_argument("#define macro param list expected close parens after ...");
+    for (;;) {
+        const auto v = pp_prefetch_next(pp_prefetch_batch);
+        const size_t n = v.size();
+        if (n == 0)
+            break;
 
-                            break;
-                        }
-                        else if (tokenit_next_match_inc(ti,tie,token::CLOSE_PARENS)) {
-                            break;
-                        }
-                        else if (tokenit_next_match_inc(ti,tie,token::COMMA)) {
-                            /* OK */
-                        }
-                    }
-                    else if (tokenit_next_match_inc(ti,tie,token::DOTDOTDOT)) {
-                        macro.param.push_back("__VA_ARGS__");
-                        macro.last_param_variadic = true;
-                        macro.last_param_optional = true;
+        vector<int32_t> fds(n,-1);
+        vector<int32_t> got(n,-1);
+        vector<string> bufs(n);
+        vector<struct stat> sts(n);
+        unsigned int reads = 0;
+
+        for (size_t i=0;i < n;i++) {
+            struct io_uring_sqe *sqe = ring->get_sqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = uint64_t(uintptr_t(v[i].first.c_str()));
+            sqe->open_flags = O_RDONLY|O_CLOEXEC;
+            sqe->user_data = uint64_t(i);
+        }
+        if (ring->submit_and_wait((unsigned int)n,fds)) {
+            for (size_t i=0;i < n;i++) {
+                if (fds[i] < 0 || fstat(fds[i],&sts[i]) != 0 || !S_ISREG(sts[i].st_mode) || sts[i].st_size == 0)
+                    continue;
+
+                bufs[i].resize(size_t(sts[i].st_size));
+                struct io_uring_sqe *sqe = ring->get_sqe();
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = fds[i];
+                sqe->addr = uint64_t(uintptr_t(&bufs[i][0]));
+                sqe->len = uint32_t(bufs[i].size());
+                sqe->off = 0;
+                sqe->user_data = uint64_t(i);
+                reads++;
+            }
+            if (reads != 0u && !ring->submit_and_wait(reads,got))
+                fill(got.begin(),got.end(),-1);
+        }
 
-                        /* this must be the last param! */
-                        if (!tokenit_next_match_inc(ti,tie,token::CLOSE_PARENS))
-                            throw invalid_argument("#define macro param list expected close parens after ...");
+        vector< shared_ptr<pp_prefetch_entry> > done;
+        for (size_t i=0;i < n;i++) {
+            pp_prefetch_entry &e = *v[i].second;
 
-                        break;
-                    }
-                    else if (tokenit_next_match_inc(ti,tie,token::CLOSE_PARENS)) {
-                        break;
-                    }
-                    else {
-                        throw invalid_argument(string("unexpected token in macro parameter list ") + to_string(*ti));
-                    }
-                } while (1);
-            }
+            if (fds[i] >= 0) {
+                char c;
 
-            /* the tokens from here are MACROSUBST, MACROPARAM, __VA_ARGS__, __VA_OPT__ ( MACROSUBST ), STRINGIFY, AND TOKEN_PASTE.
-             * There will never be an IDENTIFIER because the parameter matching has already been done. */
-            while (ti != tie) {
-                if ((*ti).tval == token::MACROSUBST ||
-                    (*ti).tval == token::VA_ARGS ||
-                    (*ti).tval == token::VA_OPT ||
-                    (*ti).tval == token::COMMA ||
-                    (*ti).tval == token::STRINGIFY ||
-                    (*ti).tval == token::TOKEN_PASTE ||
-                    (*ti).tval == token::OPEN_PARENS ||
-                    (*ti).tval == token::CLOSE_PARENS) {
-                    macro.subst.push_back(*ti);
-                    ti++;
-                }
-                else if ((*ti).tval == token::MACROPARAM) {
-                    if ((*ti).i.u >= (unsigned long long)macro.param.size()) throw runtime_error("macro param out of range");
-                    macro.subst.push_back(*ti);
-                    ti++;
-                }
-                else {
-                    throw invalid_argument(string("unexpected token in the body of a macro ") + to_string(*ti));
+                if (bufs[i].empty() && S_ISREG(sts[i].st_mode) && sts[i].st_size == 0)
+                    got[i] = 0;
+                if (got[i] >= 0 && size_t(got[i]) == bufs[i].size() && pread(fds[i],&c,1,off_t(got[i])) == 0) {
+                    e.content = make_shared<const string>(move(bufs[i]));
+                    e.st = sts[i];
                 }
+                close(fds[i]);
             }
+            if (!e.content) /* short read, grown, or the kernel would not: do it the plain way */
+                e.content = pp_prefetch_read(v[i].first,e.st);
 
-            {
-                auto mi = macro_store.find(ident);
-                if (mi != macro_store.end()) {
-                    if (mi->second == macro)
-                        macro_store[ident] = macro;
-                    else
-                        fprintf(stderr,"WARNING: Macro '%s' redefinition\n",ident.c_str());
-                }
-                else {
-                    macro_store[ident] = macro;
-                }
-            }
+            done.push_back(v[i].second);
         }
-        else if (tokenit_next_match_inc(ti,tie,token::UNDEF)) {
-            const string &ident = tokenit_next_identifier(ti,tie); /* will throw exception if not! */
 
-            {
-                auto mi = macro_store.find(ident);
-                if (mi != macro_store.end())
-                    macro_store.erase(mi);
-            }
-        }
-        else if (tokenit_next_match_inc(ti,tie,token::ELSE)) {
-            if (!pp_cond_stack.empty()) {
-                pp_cond_stack.top().on_else();
-            }
-            else {
-                throw invalid_argument("#else not allowed here");
-            }
-        }
-        else if (tokenit_next_match_inc(ti,tie,token::ENDIF)) {
-            if (!pp_cond_stack.empty()) {
-                pp_cond_stack.pop();
-                pass = pp_pass();
-            }
-            else {
-                throw invalid_argument("too many #endif");
-            }
-        }
+        pp_prefetch_finish(done);
     }
-
-    return pass;
 }
+#endif
 
-bool pp_allow_token_display(const token_string &tokens) {
-    auto ti = tokens.begin();
-    const auto tie = tokens.end();
-
-    if (ti != tie) {
-        if ((*ti).tval == token::PREPROC) {
-            ti++;
+static void pp_prefetch_start() {
+    lock_guard<mutex> lock(pp_prefetch_lock);
 
-            return false;
-        }
+    if (!pp_prefetch_workers.empty())
+        return;
 
-        return true;
+    pp_prefetch_stopping = false;
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+    pp_uring *ring = new pp_uring();
+    if (ring->setup(unsigned(pp_prefetch_batch * size_t(2)))) {
+        pp_prefetch_workers.push_back(thread(pp_prefetch_uring_thread,ring));
+        pp_prefetch_enabled = true;
+        return;
     }
+    delete ring;
+#endif
 
-    return false;
+    for (unsigned int i=0;i < pp_prefetch_threads;i++)
+        pp_prefetch_workers.push_back(thread(pp_prefetch_thread));
+    pp_prefetch_enabled = true;
 }
 
-int main(int argc,char **argv) {
-    if (parse_argv(argc,argv))
-        return 1;
+static void pp_prefetch_stop() {
+    {
+        lock_guard<mutex> lock(pp_prefetch_lock);
+        pp_prefetch_stopping = true;
+        pp_prefetch_enabled = false;
+        pp_prefetch_work.notify_all();
+    }
 
-    in_src_stk.alloc();
-    in_src_stk.push();
-    if (in_file == "-")
-        in_src_stk.top().set(stdin);
-    else
-        in_src_stk.top().set(in_file);
+    for (auto &t : pp_prefetch_workers)
+        t.join();
 
-    in_src_stk.top().open();
-    if (!in_src_stk.top().is_open()) {
-        fprintf(stderr,"Unable to open source\n");
-        return 1;
-    }
+    pp_prefetch_workers.clear();
+    pp_prefetch_files.clear();
+    pp_prefetch_queue.clear();
+}
 
-    if (out_file == "-")
-        out_dst.set(stdout);
-    else
-        out_dst.set(out_file);
+/* run one command line, for main() or for a --daemon client */
+static int pp_command(int argc,char **argv) {
+    pp_cmdline cl;
 
-    out_dst.open();
-    if (!out_dst.is_open()) {
-        fprintf(stderr,"Unable to open dest\n");
+    if (parse_argv(cl,argc,argv))
         return 1;
+
+    if (!cl.shared_cache_file.empty()) {
+        lock_guard<mutex> lock(pp_shared_lock);
+        if (!pp_shm_open(cl.shared_cache_file,cl.shared_cache_size))
+            fprintf(pp_stderr(),"WARNING: cannot use %s as --shared-cache\n",cl.shared_cache_file.c_str());
     }
 
-    string line;
-    bool emit_line = false;
-    int32_t lineno_expect = -1;
-    token_string tokens;
+    if (cl.opt.prefetch)
+        pp_prefetch_start();
 
-    while (!in_src_stk.empty()) {
-        const int32_t lineno = in_src_stk.top().current_line();
-        const string &source = in_src_stk.top().get_path();
+    if (!cl.daemon_socket.empty())
+        return pp_daemon_run(cl);
+    if (!cl.batch_file.empty())
+        return preprocess_batch(cl);
 
-        if (read_line(/*&*/line,in_src_stk.top())) {
-            if (ppp_only) {
-                if (lineno_expect != lineno)
-                    emit_line = true;
+    pp_context ctx(cl.opt);
+    if (pp_cwd.empty())
+        return preprocess_unit(ctx,cl.in_file,cl.out_file);
 
-                if (emit_line) {
-                    out_dst.puts(string("#line ") + to_string(lineno) + " " + source + "\n");
-                    emit_line = false;
-                }
+    {
+        lock_guard<mutex> lock(pp_shared_lock);
+        if (!pp_daemon_indexes.empty()) {
+            ctx.directive_indexes.swap(pp_daemon_indexes.back());
+            pp_daemon_indexes.pop_back();
+        }
+    }
 
-                out_dst.puts(line);
-                out_dst.putc('\n');
-                lineno_expect = lineno + int32_t(1);
-            }
-            else {
-                tokens.clear();
-                parse_tokens(tokens,line.begin(),line.end(),lineno,source);
-                if (accept_tokens(tokens.begin(),tokens.end())) {
-                    if (ppt_only) {
-                        if (lineno_expect != lineno)
-                            emit_line = true;
-
-                        if (emit_line) {
-                            out_dst.puts(string("#line ") + to_string(lineno) + " " + source + "\n");
-                            emit_line = false;
-                        }
+    const int r = preprocess_unit(ctx,cl.in_file,cl.out_file);
 
-                        for (const auto &t : tokens)
-                            out_dst.puts(to_string(t));
+    lock_guard<mutex> lock(pp_shared_lock);
+    pp_daemon_indexes.push_back(move(ctx.directive_indexes));
+    return r;
+}
 
-                        out_dst.putc('\n');
-                        lineno_expect = lineno + int32_t(1);
-                    }
-                    else if (pp_only) {
-                        if (pp_allow_token_display(tokens)) {
-                            if (lineno_expect != lineno)
-                                emit_line = true;
-
-                            if (emit_line) {
-                                out_dst.puts(string("#line ") + to_string(lineno) + " " + source + "\n");
-                                emit_line = false;
-                            }
+int main(int argc,char **argv) {
+    const char *daemon = getenv("HAXPP_DAEMON");
 
-                            for (const auto &t : tokens)
-                                out_dst.puts(to_string_pp(t));
+    if (daemon != NULL && *daemon != 0) {
+        bool serve = false;
 
-                            out_dst.putc('\n');
-                            lineno_expect = lineno + int32_t(1);
-                        }
-                    }
-                }
-            }
+        for (int i=1;i < argc;i++) {
+            const char *a = argv[i];
+            while (*a == '-') a++;
+            if (a != argv[i] && !strncmp(a,"daemon=",7))
+                serve = true;
         }
-        else if (in_src_stk.top().eof()) {
-            emit_line = true;
-            in_src_stk.pop();
+
+        if (!serve) {
+            const int r = pp_client_run(daemon,argc,argv);
+            if (r >= 0)
+                return r;
         }
     }
 
-    return 0;
+    const int r = pp_command(argc,argv);
+    pp_prefetch_stop();
+    return r;
 }
 
+#endif /* HAXPP_LIBRARY */
@@ -0,0 +1,67 @@
+/* haxpp as a library (libhaxpp.a). preprocesses source held in memory, takes
+ * #include files from a callback or from the file system, and hands the output
+ * to callbacks instead of writing a file.
+ *
+ *   haxpp pp;
+ *   pp.define("N","4");
+ *   pp.on_text = [&](const char *s,size_t len) { out.append(s,len); };
+ *   if (pp.preprocess("gen.c","int a[N];\n") != 0) fputs(pp.error().c_str(),stderr);
+ *
+ * a haxpp object is not thread safe, but separate objects can be used from
+ * separate threads at the same time. */
+
+#ifndef HAXPP_H
+#define HAXPP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+
+/* one token of output, as handed to haxpp::on_token */
+class haxpp_token {
+public:
+    enum kind_t {
+        IDENTIFIER,
+        NUMBER,
+        STRING,
+        OTHER               /* keywords and punctuators */
+    };
+public:
+    kind_t                      kind = OTHER;
+    std::string                 text;           /* spelling, as -E writes it */
+    int32_t                     line = 0;
+    const std::string*          source = NULL;  /* file the line came from */
+    bool                        first = false;  /* first token of its line */
+};
+
+class haxpp_state;
+
+class haxpp {
+public:
+                                haxpp();
+                                haxpp(const haxpp &) = delete;
+                                ~haxpp();
+public:
+    void                        define(const std::string &name,const std::string &value = "1");
+    void                        undef(const std::string &name);
+    void                        include_path(const std::string &dir);
+    void                        add_file(const std::string &name,const std::string &text);
+    int                         preprocess(const std::string &name,const std::string &text);
+    int                         preprocess_file(const std::string &path);
+    const std::string&          error() const;
+public:
+    /* #include lookup. return true with path and text filled in to supply the file,
+     * false to search add_file() names and then the include paths as usual */
+    std::function<bool(const std::string &name,bool angled,const std::string &includer,std::string &path,std::string &text)> on_include;
+    /* output as -E writes it, #line markers included */
+    std::function<void(const char *text,size_t len)> on_text;
+    /* output one token at a time. if set, on_text is not called */
+    std::function<void(const haxpp_token &t)> on_token;
+private:
+    std::unique_ptr<haxpp_state> st;
+};
+
+#endif /* HAXPP_H */
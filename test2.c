@@ -1,4 +1,4 @@
-#include pingas
+#include "test2.h"
 #define hello
  #define hello
 #    define hello
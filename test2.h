@@ -0,0 +1,7 @@
+#ifndef TEST2_H
+#define TEST2_H
+#include "test2b.h"
+#include "test2b.h"
+#include "test2.h"
+In test2
+#endif
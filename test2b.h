@@ -0,0 +1,2 @@
+#pragma once
+In test2b
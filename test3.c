@@ -176,6 +176,15 @@ testing the HELLO (a,b) today
 testing the HELLO (abc,xyz) today
 #undef HELLO
 
+#define HELLO(a,b) x a##b
+testing the HELLO (,y) today
+testing the HELLO (w,z) today
+#undef HELLO
+
+#define HELLO(a) a ## "abc" a##'c'
+testing the HELLO (L) HELLO (u) HELLO (u8) HELLO (U) today
+#undef HELLO
+
 #define HELLO(a,b) #a #b world #a#b
 testing the HELLO (a,b) today
 testing the HELLO (funny,man) today
@@ -267,3 +276,11 @@ testing the HELLO (funny,man,lol) today
 testing the HELLO (funny,man,lol,omg,wtf) today
 #undef HELLO
 
+#if 0
+// hello
+/ x
+//* not a comment start
+x
+#endif
+y
+
@@ -133,6 +133,7 @@ public:
 public:
     map<string,haxpp_macro>     haxpp_macros;
     vector<string>              include_search;
+    map<string,string>          lookup_cache; /* #include spelling -> path, empty if not found */
     haxpp_linesourcestack       in_lstk;
 
     bool                        emit_line = true;
@@ -1708,16 +1709,24 @@ bool haxpp::macro_expand(char *line,char *linefence,bool &multiline,bool ifexpr)
 }
 
 string haxpp::lookup_header(const string &rpath) {
-    if (is_file(rpath))
-        return rpath;
+    /* the result only depends on the spelling, since the search does not look next to the
+     * including file. misses are remembered too */
+    auto ci = lookup_cache.find(rpath);
+    if (ci != lookup_cache.end())
+        return ci->second;
+
+    string &r = lookup_cache[rpath];
+
+    if (is_file_cached(rpath))
+        return (r = rpath);
 
     for (const auto &spath : preproc.include_search) {
         string fpath = spath + "/" + rpath;
-        if (is_file(fpath))
-            return fpath;
+        if (is_file_cached(fpath))
+            return (r = fpath);
     }
 
-    return string();
+    return r;
 }
 
 int main(int argc,char **argv) {
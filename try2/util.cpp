@@ -8,9 +8,12 @@
 #include <stdint.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
 
 #include "util.h"
 
+#include <map>
+
 using namespace std;
 
 bool is_file(const char * const path) {
@@ -26,6 +29,58 @@ bool is_file(const string &path) {
     return is_file(path.c_str());
 }
 
+/* contents of a directory, read once so that looking for a file in it does not need stat() */
+struct dir_listing_t {
+    bool                                exists = false;
+    std::map<string,unsigned char>      entries; /* name -> d_type, DT_UNKNOWN until checked */
+};
+
+static std::map<string,dir_listing_t>   dir_listings;
+
+static dir_listing_t &get_dir_listing(const string &dir) {
+    auto di = dir_listings.find(dir);
+    if (di != dir_listings.end())
+        return di->second;
+
+    dir_listing_t &dl = dir_listings[dir];
+    DIR *d = opendir(dir.c_str());
+    if (d != NULL) {
+        struct dirent *de;
+
+        dl.exists = true;
+        while ((de=readdir(d)) != NULL) {
+            /* symlinks and file systems that do not report the type get stat()ed on first use */
+            const unsigned char t = (de->d_type == DT_REG || de->d_type == DT_DIR) ? (unsigned char)de->d_type : (unsigned char)DT_UNKNOWN;
+            dl.entries[de->d_name] = t;
+        }
+
+        closedir(d);
+    }
+
+    return dl;
+}
+
+/* is_file() through a per-directory listing cache. files created after
+ * the directory was first listed are not seen */
+bool is_file_cached(const string &path) {
+    const size_t p = path.find_last_of('/');
+    const string dir = (p != string::npos) ? path.substr(0,p+1) : string("./");
+    const string name = (p != string::npos) ? path.substr(p+1) : path;
+
+    dir_listing_t &dl = get_dir_listing(dir);
+    if (!dl.exists)
+        return false;
+
+    auto ei = dl.entries.find(name);
+    if (ei == dl.entries.end())
+        return false;
+
+    if (ei->second == DT_UNKNOWN)
+        ei->second = is_file(path) ? DT_REG : DT_DIR;
+
+    return ei->second == DT_REG;
+}
+
 bool is_out_file(const char * const path) {
     struct stat st;
 